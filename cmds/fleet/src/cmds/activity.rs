@@ -0,0 +1,462 @@
+use std::collections::HashMap;
+use std::path::PathBuf;
+use std::time::Duration;
+
+use anyhow::Result;
+use clap::Parser;
+use nix_eval::drv::BuildPlan;
+use nix_eval::logging::{
+	ActivityTimings, ActivityType, OwnerTimings, TransferMetrics, start_activity_timings,
+	take_activity_timings,
+};
+use nix_eval::recording::{Activity, Recording, critical_path};
+use tabled::settings::Style;
+use tabled::{Table, Tabled};
+use tracing::{debug, info};
+
+#[derive(Parser)]
+pub struct ActivityReport {
+	/// File written with --record-nix-activity
+	file: PathBuf,
+	/// How many of the slowest derivations to show
+	#[clap(long, default_value_t = 20)]
+	top: usize,
+}
+
+#[derive(Tabled)]
+struct SlowRow {
+	#[tabled(rename = "Activity")]
+	kind: &'static str,
+	#[tabled(rename = "Derivation")]
+	drv: String,
+	#[tabled(rename = "Host")]
+	host: String,
+	#[tabled(rename = "Waiting")]
+	waiting: String,
+	#[tabled(rename = "Took")]
+	took: String,
+}
+
+#[derive(Tabled)]
+struct PathRow {
+	#[tabled(rename = "Start")]
+	start: String,
+	#[tabled(rename = "Activity")]
+	kind: &'static str,
+	#[tabled(rename = "Derivation")]
+	drv: String,
+	#[tabled(rename = "Host")]
+	host: String,
+	#[tabled(rename = "Took")]
+	took: String,
+}
+
+#[derive(Tabled)]
+struct PhaseRow {
+	#[tabled(rename = "Phase")]
+	phase: String,
+	#[tabled(rename = "Builds")]
+	builds: usize,
+	#[tabled(rename = "Total")]
+	total: String,
+	#[tabled(rename = "Longest")]
+	longest: String,
+}
+
+#[derive(Tabled)]
+struct SlowPhaseRow {
+	#[tabled(rename = "Host")]
+	owner: String,
+	#[tabled(rename = "Derivation")]
+	drv: String,
+	#[tabled(rename = "Phase")]
+	phase: String,
+	#[tabled(rename = "Took")]
+	took: String,
+}
+
+#[derive(Tabled)]
+struct PlanRow {
+	#[tabled(rename = "Action")]
+	action: &'static str,
+	#[tabled(rename = "Paths")]
+	paths: usize,
+	#[tabled(rename = "Download")]
+	download: String,
+	#[tabled(rename = "Unpacked")]
+	unpacked: String,
+}
+
+fn kind_name(ty: ActivityType) -> &'static str {
+	match ty {
+		ActivityType::Build => "build",
+		ActivityType::BuildWaiting => "waiting",
+		ActivityType::Substitute => "substitute",
+		ActivityType::CopyPath => "copy",
+		ActivityType::FileTransfer => "download",
+		_ => "other",
+	}
+}
+
+#[derive(Tabled)]
+struct TransferRow {
+	#[tabled(rename = "Host")]
+	host: String,
+	#[tabled(rename = "Queries")]
+	queries: u64,
+	#[tabled(rename = "Hit ratio")]
+	hit_ratio: String,
+	#[tabled(rename = "Latency p50")]
+	p50: String,
+	#[tabled(rename = "Latency p90")]
+	p90: String,
+	#[tabled(rename = "Downloaded")]
+	downloaded: String,
+	#[tabled(rename = "Download rate")]
+	download_rate: String,
+	#[tabled(rename = "Copied")]
+	copied: String,
+	#[tabled(rename = "Copy rate")]
+	copy_rate: String,
+}
+
+fn fmt_duration(d: Duration) -> String {
+	format!("{d:.1?}")
+}
+
+fn fmt_bytes(bytes: f64) -> String {
+	const UNITS: [&str; 5] = ["B", "KiB", "MiB", "GiB", "TiB"];
+	let mut value = bytes;
+	let mut unit = 0;
+	while value >= 1024.0 && unit + 1 < UNITS.len() {
+		value /= 1024.0;
+		unit += 1;
+	}
+	format!("{value:.1} {}", UNITS[unit])
+}
+
+impl ActivityReport {
+	pub fn run(&self) -> Result<()> {
+		let recording = Recording::read(&self.file)?;
+		let end = recording.end();
+		let stop = |a: &Activity| a.stop.unwrap_or(end);
+
+		// Activities, which are doing the work themselves, and not just grouping other activities
+		let work = recording
+			.activities()
+			.into_iter()
+			.filter(|a| {
+				matches!(
+					a.ty,
+					ActivityType::Build
+						| ActivityType::BuildWaiting
+						| ActivityType::Substitute
+						| ActivityType::CopyPath
+						| ActivityType::FileTransfer
+				)
+			})
+			.collect::<Vec<_>>();
+
+		let mut waiting = HashMap::<&str, Duration>::new();
+		for a in work.iter().filter(|a| a.ty == ActivityType::BuildWaiting) {
+			if let Some((drv, _)) = recording.subject(a) {
+				*waiting.entry(drv).or_default() += stop(a) - a.start;
+			}
+		}
+
+		let mut slowest = work
+			.iter()
+			.filter(|a| a.ty != ActivityType::BuildWaiting && a.ty != ActivityType::FileTransfer)
+			.collect::<Vec<_>>();
+		slowest.sort_by_key(|a| std::cmp::Reverse(stop(a) - a.start));
+		let rows = slowest.iter().take(self.top).map(|a| {
+			let (drv, host) = recording.subject(a).unwrap_or_default();
+			SlowRow {
+				kind: kind_name(a.ty),
+				drv: drv.to_owned(),
+				host: host.unwrap_or("local").to_owned(),
+				waiting: waiting
+					.get(drv)
+					.filter(|_| a.ty == ActivityType::Build)
+					.map(|d| fmt_duration(*d))
+					.unwrap_or_default(),
+				took: fmt_duration(stop(a) - a.start),
+			}
+		});
+		let mut table = Table::new(rows);
+		table.with(Style::rounded());
+		println!("Slowest derivations:\n{table}");
+
+		let path = critical_path(&work.iter().map(|a| a.start..stop(a)).collect::<Vec<_>>());
+		let mut busy = Duration::ZERO;
+		let mut waited = Duration::ZERO;
+		let rows = path
+			.into_iter()
+			.map(|i| {
+				let a = &work[i];
+				let took = stop(a) - a.start;
+				busy += took;
+				if a.ty == ActivityType::BuildWaiting {
+					waited += took;
+				}
+				let (drv, host) = recording.subject(a).unwrap_or_default();
+				PathRow {
+					start: fmt_duration(a.start),
+					kind: kind_name(a.ty),
+					drv: drv.to_owned(),
+					host: host.unwrap_or("local").to_owned(),
+					took: fmt_duration(took),
+				}
+			})
+			.collect::<Vec<_>>();
+		let mut table = Table::new(rows);
+		table.with(Style::rounded());
+		println!("Critical path:\n{table}");
+
+		let share = |d: Duration| {
+			if end.is_zero() {
+				0.0
+			} else {
+				d.as_secs_f64() / end.as_secs_f64() * 100.0
+			}
+		};
+		println!(
+			"Critical path is busy for {} ({:.0}%) of {} recorded, {} ({:.0}%) of it waiting for a build machine",
+			fmt_duration(busy),
+			share(busy),
+			fmt_duration(end),
+			fmt_duration(waited),
+			share(waited),
+		);
+		if recording.dropped != 0 {
+			println!(
+				"Recording was full, {} events were dropped",
+				recording.dropped
+			);
+		}
+		Ok(())
+	}
+}
+
+/// Reports of nix activities, collected while building.
+#[derive(Parser, Clone)]
+pub struct TimingReports {
+	/// Report critical path of nix builds, substitutions and copies for every host
+	#[clap(long)]
+	critical_path: bool,
+	/// Report time spent in every build phase (configure, build, check...), and the N slowest
+	/// phases of single builds
+	#[clap(long, value_name = "N")]
+	slowest_phases: Option<usize>,
+}
+impl TimingReports {
+	/// Starts collecting activity timings, if any report is requested.
+	pub fn start(&self) -> Result<()> {
+		if self.critical_path || self.slowest_phases.is_some() {
+			start_activity_timings(self.slowest_phases.unwrap_or(0))?;
+		}
+		Ok(())
+	}
+	/// Prints requested reports of the activities, collected since [`Self::start`].
+	pub fn report(&self) {
+		if !self.critical_path && self.slowest_phases.is_none() {
+			return;
+		}
+		let timings = take_activity_timings();
+		if self.critical_path {
+			report_timings(&timings.owners);
+		}
+		if self.slowest_phases.is_some() {
+			report_phases(&timings);
+		}
+	}
+}
+
+/// Prints critical path through the activities of every fleet host.
+fn report_timings(owners: &[OwnerTimings]) {
+	for timings in owners {
+		let owner = if timings.owner.is_empty() {
+			"unknown host"
+		} else {
+			&timings.owner
+		};
+		let mut busy = Duration::ZERO;
+		let mut path_waited = Duration::ZERO;
+		let rows = timings
+			.critical_path
+			.iter()
+			.map(|a| {
+				let took = a.time.end - a.time.start;
+				busy += took;
+				if a.ty == ActivityType::BuildWaiting {
+					path_waited += took;
+				}
+				PathRow {
+					start: fmt_duration(a.time.start),
+					kind: kind_name(a.ty),
+					drv: a.subject.clone(),
+					host: a.host.clone().unwrap_or_default(),
+					took: fmt_duration(took),
+				}
+			})
+			.collect::<Vec<_>>();
+		let mut table = Table::new(rows);
+		table.with(Style::rounded());
+		println!("Critical path of {owner}:\n{table}");
+
+		println!(
+			"Critical path is busy for {} of {}, {} of it waiting for a build machine",
+			fmt_duration(busy),
+			fmt_duration(timings.time.end - timings.time.start),
+			fmt_duration(path_waited),
+		);
+		println!(
+			"In total, builds waited for a machine for {}, while building took {}, substituting {} and copying {}",
+			fmt_duration(timings.waiting),
+			fmt_duration(timings.building),
+			fmt_duration(timings.substituting),
+			fmt_duration(timings.copying),
+		);
+	}
+}
+
+/// Prints total time of every build phase, and the slowest phases of single builds.
+fn report_phases(timings: &ActivityTimings) {
+	if timings.phases.is_empty() {
+		return;
+	}
+
+	let mut totals = timings.phases.iter().collect::<Vec<_>>();
+	totals.sort_by_key(|p| std::cmp::Reverse(p.total));
+	let rows = totals.into_iter().map(|p| PhaseRow {
+		phase: p.name.clone(),
+		builds: p.builds,
+		total: fmt_duration(p.total),
+		longest: fmt_duration(p.longest),
+	});
+	let mut table = Table::new(rows);
+	table.with(Style::rounded());
+	println!("Build phases:\n{table}");
+
+	let rows = timings.slowest_phases.iter().map(|p| SlowPhaseRow {
+		owner: p.owners.join(", "),
+		drv: p.drv.clone(),
+		phase: p.name.clone(),
+		took: fmt_duration(p.took),
+	});
+	let mut table = Table::new(rows);
+	table.with(Style::rounded());
+	println!("Slowest phases:\n{table}");
+}
+
+/// Prints per-host transfer metrics, collected with
+/// [`nix_eval::logging::start_transfer_metrics`], and emits them as tracing events.
+pub fn report_transfers(metrics: &[TransferMetrics]) {
+	if metrics.is_empty() {
+		return;
+	}
+	let millis = |d: Option<Duration>| d.map(|d| d.as_millis() as u64);
+	for m in metrics {
+		info!(
+			target: "nix::transfers",
+			host = m.host,
+			queries = m.queries,
+			substitutes = m.substitutes,
+			hit_ratio = m.hit_ratio(),
+			latency_p50_ms = millis(m.latency_quantile(0.5)),
+			latency_p90_ms = millis(m.latency_quantile(0.9)),
+			latency_p99_ms = millis(m.latency_quantile(0.99)),
+			downloads = m.downloads,
+			download_bytes = m.download_bytes,
+			download_rate = m.download_rate(),
+			copies = m.copies,
+			copy_bytes = m.copy_bytes,
+			copy_rate = m.copy_rate(),
+			"transfer metrics",
+		);
+	}
+
+	let quantile = |m: &TransferMetrics, q: f64| {
+		if m.queries == 0 {
+			String::new()
+		} else {
+			match m.latency_quantile(q) {
+				Some(d) => format!("<{}", fmt_duration(d)),
+				None => "slow".to_owned(),
+			}
+		}
+	};
+	let rate = |r: Option<f64>| r.map(|r| format!("{}/s", fmt_bytes(r))).unwrap_or_default();
+	let rows = metrics.iter().map(|m| TransferRow {
+		host: m.host.clone(),
+		queries: m.queries,
+		hit_ratio: m
+			.hit_ratio()
+			.map(|r| format!("{:.0}%", r * 100.0))
+			.unwrap_or_default(),
+		p50: quantile(m, 0.5),
+		p90: quantile(m, 0.9),
+		downloaded: fmt_bytes(m.download_bytes as f64),
+		download_rate: rate(m.download_rate()),
+		copied: fmt_bytes(m.copy_bytes as f64),
+		copy_rate: rate(m.copy_rate()),
+	});
+	let mut table = Table::new(rows);
+	table.with(Style::rounded());
+	println!("Transfers:\n{table}");
+}
+
+/// Prints what nix is going to build and substitute, found with [`nix_eval::drv::query_missing`],
+/// every path is listed at debug level.
+pub fn report_build_plan(plan: &BuildPlan) {
+	info!(
+		target: "nix::plan",
+		builds = plan.will_build.len(),
+		substitutes = plan.will_substitute.len(),
+		unknown = plan.unknown.len(),
+		download_bytes = plan.download_size,
+		nar_bytes = plan.nar_size,
+		"build plan",
+	);
+	for drv in &plan.will_build {
+		debug!(target: "nix::plan", drv, "will be built");
+	}
+	for path in &plan.will_substitute {
+		debug!(target: "nix::plan", path, "will be substituted");
+	}
+	for path in &plan.unknown {
+		debug!(target: "nix::plan", path, "can't be built or substituted");
+	}
+
+	let rows = [
+		PlanRow {
+			action: "build",
+			paths: plan.will_build.len(),
+			download: String::new(),
+			unpacked: String::new(),
+		},
+		PlanRow {
+			action: "substitute",
+			paths: plan.will_substitute.len(),
+			download: fmt_bytes(plan.download_size as f64),
+			unpacked: fmt_bytes(plan.nar_size as f64),
+		},
+		PlanRow {
+			action: "unknown",
+			paths: plan.unknown.len(),
+			download: String::new(),
+			unpacked: String::new(),
+		},
+	];
+	let rows = rows
+		.into_iter()
+		.filter(|r| r.paths != 0)
+		.collect::<Vec<_>>();
+	if rows.is_empty() {
+		println!("Build plan: everything is already built");
+		return;
+	}
+	let mut table = Table::new(rows);
+	table.with(Style::rounded());
+	println!("Build plan:\n{table}");
+}
@@ -1,16 +1,26 @@
-use std::{env::current_dir, os::unix::fs::symlink, path::PathBuf};
+use std::{
+	env::current_dir,
+	os::unix::fs::symlink,
+	path::{Path, PathBuf},
+};
 
-use anyhow::Result;
+use anyhow::{Result, anyhow};
 use clap::Parser;
 use fleet_base::{
 	deploy::{DeployAction, deploy_task, upload_task},
-	host::{Config, DeployKind, GenerationStorage},
+	host::{Config, ConfigHost, DeployKind, GenerationStorage},
 	opts::FleetOpts,
 };
 use futures::{StreamExt as _, stream::FuturesUnordered};
-use nix_eval::nix_go;
+use itertools::Itertools as _;
+use nix_eval::{
+	drv::{ClosureCopier, DrvGraph, build_drv_paths, query_missing},
+	logging::register_build_graph,
+};
 use tokio::task::spawn_blocking;
-use tracing::{Instrument, error, field, info, info_span, warn};
+use tracing::{Instrument, Span, error, field, info, info_span, warn};
+
+use crate::cmds::activity::{TimingReports, report_build_plan};
 
 #[derive(Parser)]
 pub struct Deploy {
@@ -19,6 +29,21 @@ pub struct Deploy {
 	disable_rollback: bool,
 	/// Action to execute after system is built
 	action: DeployAction,
+	/// Don't print what is going to be built and substituted before building
+	#[clap(long)]
+	no_build_plan: bool,
+	/// Number of hosts, to which system closures are copied at once
+	#[clap(long, default_value_t = 4)]
+	copy_jobs: usize,
+	/// Copy store paths, which are corrupted or missing on hosts, again
+	#[clap(long)]
+	repair: bool,
+	/// Build systems of all hosts in a single nix call, so dependencies shared between hosts are
+	/// built once. Hosts are only uploaded once every system is built
+	#[clap(long)]
+	shared_build: bool,
+	#[clap(flatten)]
+	timings: TimingReports,
 }
 
 #[derive(Parser, Clone)]
@@ -27,59 +52,188 @@ pub struct BuildSystems {
 	/// are "sdImage"/"isoImage", and your configuration may include any other build attributes.
 	#[clap(long, default_value = "toplevel-fleet")]
 	build_attr: String,
+	/// Don't print what is going to be built and substituted before building
+	#[clap(long)]
+	no_build_plan: bool,
+	/// Build systems of all hosts in a single nix call, so dependencies shared between hosts are
+	/// built once
+	#[clap(long)]
+	shared_build: bool,
+	#[clap(flatten)]
+	timings: TimingReports,
 }
 
-async fn build_task(config: Config, hostname: String, build_attr: &str) -> Result<PathBuf> {
-	info!("building");
-	let host = config.host(&hostname)?;
-	// let action = Action::from(self.subcommand.clone());
-	let nixos = host.nixos_config()?;
-	let drv = nix_go!(nixos.system.build[{ build_attr }]);
-	let out_output = spawn_blocking(move || drv.build("out"))
+/// Evaluates derivations of all hosts, and prints what nix is going to build and substitute
+/// for them. Hosts, which fail to evaluate, are skipped, their builds report the error.
+async fn build_plan(hosts: &[ConfigHost], build_attr: &str) {
+	let mut drv_paths = Vec::new();
+	for host in hosts {
+		match host.system_drv_path(build_attr) {
+			Ok(path) => drv_paths.push(path),
+			Err(e) => warn!(host = %host.name, "not included into build plan: {e:#}"),
+		}
+	}
+	match spawn_blocking(move || query_missing(&drv_paths))
 		.await
-		.expect("system derivation build should not panic")?;
+		.expect("build plan query should not panic")
+	{
+		Ok(plan) => report_build_plan(&plan),
+		Err(e) => warn!("failed to query build plan: {e:#}"),
+	}
+}
 
-	// We already have system profiles for backups.
-	if !host.local {
-		info!("adding gc root");
-		let mut cmd = config.local_host().cmd("nix").await?;
-		cmd.arg("build")
-			.comparg(
-				"--profile",
-				format!(
-					"/nix/var/nix/profiles/{}-{hostname}",
-					config.data.gc_root_prefix
-				),
-			)
-			.arg(&out_output);
-		cmd.sudo().run_nix().await?;
+/// Builds `build_attr` of a single host in its own nix store call, in the current span.
+async fn build_host(host: &ConfigHost, build_attr: &str) -> Result<PathBuf> {
+	info!("evaluating");
+	let drv_path = host.system_drv_path(build_attr)?;
+	info!("building");
+	let span = Span::current();
+	let owner = host.name.clone();
+	spawn_blocking(move || {
+		let _graph = match DrvGraph::resolve(&drv_path) {
+			Ok(graph) => Some(register_build_graph(&span, Some(&owner), &graph)),
+			Err(e) => {
+				span.in_scope(|| warn!("failed to read derivation graph: {e:#}"));
+				None
+			}
+		};
+		build_drv_paths(&[drv_path], "out")?[0].out_path()
+	})
+	.await
+	.expect("system derivation build should not panic")
+}
+
+/// Builds `build_attr` of every host in a single nix store call, so dependencies shared between
+/// hosts are built once, and nix fills all `max-jobs` slots with builds of any host. Returns
+/// built systems in the order of `hosts`.
+///
+/// The call only returns once every host is built, so a host can't be uploaded before builds
+/// of other hosts finish. Hosts, which fail to evaluate (including nixos assertions), are not
+/// built.
+async fn build_hosts(hosts: &[(ConfigHost, Span)], build_attr: &str) -> Vec<Result<PathBuf>> {
+	let mut targets = Vec::new();
+	let mut drvs = Vec::new();
+	for (host, span) in hosts {
+		let drv_path = span.in_scope(|| {
+			info!("evaluating");
+			host.system_drv_path(build_attr)
+		});
+		targets.push(drv_path.map(|drv_path| {
+			drvs.push((drv_path, host.name.clone(), span.clone()));
+			drvs.len() - 1
+		}));
+	}
+	let built = spawn_blocking(move || {
+		// Activities of derivations, shared between hosts, are owned by all of them
+		let mut graphs = Vec::new();
+		for (drv_path, host, span) in &drvs {
+			span.in_scope(|| info!("building"));
+			match DrvGraph::resolve(drv_path) {
+				Ok(graph) => graphs.push(register_build_graph(span, Some(host), &graph)),
+				Err(e) => span.in_scope(|| warn!("failed to read derivation graph: {e:#}")),
+			}
+		}
+		let drv_paths = drvs
+			.into_iter()
+			.map(|(drv_path, ..)| drv_path)
+			.collect_vec();
+		build_drv_paths(&drv_paths, "out")
+	})
+	.await
+	.expect("system derivation build should not panic");
+
+	match built {
+		Ok(built) => targets
+			.into_iter()
+			.map(|target| target.and_then(|i| built[i].out_path()))
+			.collect(),
+		Err(e) => {
+			let e = format!("{e:#}");
+			targets
+				.into_iter()
+				.map(|target| target.and_then(|_| Err(anyhow!("{e}"))))
+				.collect()
+		}
+	}
+}
+
+/// Results of [`build_hosts`] with `shared`, otherwise every host is built by its own task with
+/// [`build_host`], and is deployed as soon as its build finishes.
+async fn shared_builds(
+	hosts: &[(ConfigHost, Span)],
+	build_attr: &str,
+	shared: bool,
+) -> Vec<Option<Result<PathBuf>>> {
+	if shared {
+		build_hosts(hosts, build_attr)
+			.await
+			.into_iter()
+			.map(Some)
+			.collect()
+	} else {
+		hosts.iter().map(|_| None).collect()
 	}
+}
 
-	Ok(out_output)
+/// Roots the built system in the deployer profile of the host.
+async fn add_gc_root(config: &Config, host: &ConfigHost, built: &Path) -> Result<()> {
+	// We already have system profiles for backups.
+	if host.local {
+		return Ok(());
+	}
+	info!("adding gc root");
+	let mut cmd = config.local_host().cmd("nix").await?;
+	cmd.arg("build")
+		.comparg(
+			"--profile",
+			format!(
+				"/nix/var/nix/profiles/{}-{}",
+				config.data.gc_root_prefix, host.name
+			),
+		)
+		.arg(built);
+	cmd.sudo().run_nix().await
 }
 
 impl BuildSystems {
 	pub async fn run(self, config: &Config, opts: &FleetOpts) -> Result<()> {
 		let hosts = opts.filter_skipped(config.list_hosts()?)?;
+		if !self.no_build_plan {
+			build_plan(&hosts, &self.build_attr).await;
+		}
+		self.timings.start()?;
+		let hosts = hosts
+			.into_iter()
+			.map(|host| {
+				let span = info_span!("build", host = field::display(&host.name));
+				(host, span)
+			})
+			.collect_vec();
+		let built = shared_builds(&hosts, &self.build_attr, self.shared_build).await;
 		let tasks = FuturesUnordered::new();
-		let build_attr = self.build_attr.clone();
-		for host in hosts {
+		for ((host, span), built) in hosts.into_iter().zip(built) {
 			let config = config.clone();
-			let span = info_span!("build", host = field::display(&host.name));
-			let hostname = host.name;
-			let build_attr = build_attr.clone();
+			let build_attr = &self.build_attr;
 			tasks.push(
 				(async move {
-					let built = match build_task(config, hostname.clone(), &build_attr).await {
+					let built = match built {
+						Some(built) => built,
+						None => build_host(&host, build_attr).await,
+					};
+					let built = match built {
 						Ok(path) => path,
 						Err(e) => {
-							error!("failed to deploy host: {:?}", e);
+							error!("failed to build host system: {:?}", e);
 							return;
 						}
 					};
+					if let Err(e) = add_gc_root(&config, &host, &built).await {
+						error!("failed to add gc root: {:?}", e);
+						return;
+					}
 					// TODO: Handle error
 					let mut out = current_dir().expect("cwd exists");
-					out.push(format!("built-{hostname}"));
+					out.push(format!("built-{}", host.name));
 
 					info!("linking iso image to {:?}", out);
 					if let Err(e) = symlink(built, out) {
@@ -90,6 +244,7 @@ impl BuildSystems {
 			);
 		}
 		tasks.collect::<Vec<()>>().await;
+		self.timings.report();
 		Ok(())
 	}
 }
@@ -97,12 +252,12 @@ impl BuildSystems {
 impl Deploy {
 	pub async fn run(self, config: &Config, opts: &FleetOpts) -> Result<()> {
 		let hosts = opts.filter_skipped(config.list_hosts()?)?;
-		let mut tasks = FuturesUnordered::new();
-		for host in hosts.into_iter() {
-			let config = config.clone();
-			let span = info_span!("deploy", host = field::display(&host.name));
-			let hostname = host.name.clone();
-			let opts = opts.clone();
+		if !self.no_build_plan {
+			build_plan(&hosts, "toplevel-fleet").await;
+		}
+		self.timings.start()?;
+		let mut deployed = Vec::new();
+		for host in hosts {
 			if let Some(deploy_kind) = opts.action_attr::<DeployKind>(&host, "deploy_kind")? {
 				host.set_deploy_kind(deploy_kind);
 			};
@@ -112,18 +267,35 @@ impl Deploy {
 			if let Some(legacy) = opts.action_attr::<bool>(&host, "legacy_ssh_store")? {
 				host.set_legacy_ssh_store(legacy);
 			};
+			let span = info_span!("deploy", host = field::display(&host.name));
+			deployed.push((host, span));
+		}
+		let built = shared_builds(&deployed, "toplevel-fleet", self.shared_build).await;
+		// Destination stores are closed, once every host is deployed
+		let copier = ClosureCopier::new(self.copy_jobs, self.repair);
+		let mut tasks = FuturesUnordered::new();
+		for ((host, span), built) in deployed.into_iter().zip(built) {
+			let config = config.clone();
+			let opts = opts.clone();
+			let copier = copier.clone();
 
 			tasks.push(
 				(async move {
-					let built = match build_task(config.clone(), hostname.clone(), "toplevel-fleet")
-						.await
-					{
+					let built = match built {
+						Some(built) => built,
+						None => build_host(&host, "toplevel-fleet").await,
+					};
+					let built = match built {
 						Ok(path) => path,
 						Err(e) => {
 							error!("failed to build host system closure: {:?}", e);
 							return;
 						}
 					};
+					if let Err(e) = add_gc_root(&config, &host, &built).await {
+						error!("failed to add gc root: {:?}", e);
+						return;
+					}
 
 					let deploy_kind = match host.deploy_kind().await {
 						Ok(v) => v,
@@ -140,15 +312,21 @@ impl Deploy {
 						disable_rollback = true;
 					}
 
-					let remote_path =
-						match upload_task(&config, &host, GenerationStorage::Deployer, built).await
-						{
-							Ok(v) => v,
-							Err(e) => {
-								error!("upload failed: {e}");
-								return;
-							}
-						};
+					let remote_path = match upload_task(
+						&config,
+						&copier,
+						&host,
+						GenerationStorage::Deployer,
+						built,
+					)
+					.await
+					{
+						Ok(v) => v,
+						Err(e) => {
+							error!("upload failed: {e}");
+							return;
+						}
+					};
 
 					if let Err(e) = deploy_task(
 						self.action,
@@ -172,6 +350,7 @@ impl Deploy {
 			);
 		}
 		tasks.collect::<Vec<()>>().await;
+		self.timings.report();
 		Ok(())
 	}
 }
@@ -0,0 +1,35 @@
+use std::io::Write;
+use std::path::PathBuf;
+
+use anyhow::{Result, bail};
+use clap::Parser;
+use fleet_base::host::Config;
+use nix_eval::build_logs;
+
+#[derive(Parser)]
+pub struct Logs {
+	/// Host, for which the derivation was built
+	host: String,
+	/// Derivation path, or its name (`hello-1.0.drv` or `hello-1.0`)
+	drv: String,
+}
+
+/// Directory, in which build logs of nix derivations are stored.
+pub fn build_log_dir(config: &Config) -> PathBuf {
+	config.directory.join(".fleet/logs")
+}
+
+impl Logs {
+	pub async fn run(self, config: &Config) -> Result<()> {
+		let dir = build_log_dir(config);
+		if !dir.join("index").exists() {
+			bail!("no build logs are stored, builds need to be run with --store-build-logs");
+		}
+		let Some(entry) = build_logs::find(&dir, &self.host, &self.drv)? else {
+			bail!("no stored build log of {} for {}", self.drv, self.host);
+		};
+		let log = entry.read()?;
+		std::io::stdout().lock().write_all(&log)?;
+		Ok(())
+	}
+}
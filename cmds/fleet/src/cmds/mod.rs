@@ -1,6 +1,8 @@
+pub mod activity;
 pub mod build_systems;
 pub mod complete;
 pub mod info;
+pub mod logs;
 pub mod rollback;
 pub mod secrets;
 pub mod tf;
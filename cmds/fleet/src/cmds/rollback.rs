@@ -7,6 +7,7 @@ use fleet_base::{
 	host::{Config, ConfigHost, Generation, GenerationStorage},
 	opts::FleetOpts,
 };
+use nix_eval::drv::ClosureCopier;
 use tabled::Table;
 use tracing::{info, warn};
 
@@ -106,6 +107,7 @@ impl RollbackSingle {
 				};
 				let remote_path = upload_task(
 					config,
+					&ClosureCopier::new(1, false),
 					&host,
 					generation.location,
 					generation.store_path.clone(),
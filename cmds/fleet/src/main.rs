@@ -4,14 +4,16 @@ pub(crate) mod cmds;
 // pub(crate) mod command;
 pub(crate) mod extra_args;
 
-use std::{env, ffi::OsString, process::ExitCode, sync::Arc};
+use std::{env, ffi::OsString, path::PathBuf, process::ExitCode, sync::Arc};
 
 use anyhow::{Result, bail};
 use clap::{CommandFactory, Parser};
 use cmds::{
+	activity::{ActivityReport, report_transfers},
 	build_systems::{BuildSystems, Deploy},
 	complete::Complete,
 	info::Info,
+	logs::{Logs, build_log_dir},
 	rollback::RollbackSingle,
 	secrets::Secret,
 	tf::Tf,
@@ -23,7 +25,14 @@ use human_repr::HumanCount;
 #[cfg(feature = "indicatif")]
 use indicatif::{ProgressState, ProgressStyle};
 use nix_eval::{
-	gc_register_my_thread, gc_unregister_my_thread, init_libraries, init_tokio_for_nix,
+	gc_register_my_thread, gc_unregister_my_thread, init_libraries, init_settings,
+	init_tokio_for_nix,
+	logging::{
+		Backpressure, LoggerMode, close_build_log_store, flush_logger, open_build_log_store,
+		set_build_log_tail_on_failure, set_error_trace_depth, set_logger_mode,
+		start_activity_recording, start_transfer_metrics, stop_activity_recording,
+		take_transfer_metrics,
+	},
 };
 use opentelemetry::trace::TracerProvider;
 use opentelemetry_appender_tracing::layer::OpenTelemetryTracingBridge;
@@ -31,7 +40,7 @@ use opentelemetry_exporter_env::{
 	OtlpBaseSettings, OtlpLogsSettings, OtlpTracesSettings, ResolvedOtlpSettings,
 };
 use opentelemetry_sdk::{logs::SdkLoggerProvider, trace::SdkTracerProvider};
-use tracing::{Instrument, error, info, info_span};
+use tracing::{Instrument, error, info, info_span, warn};
 #[cfg(feature = "indicatif")]
 use tracing_indicatif::IndicatifLayer;
 use tracing_subscriber::{EnvFilter, prelude::*};
@@ -93,6 +102,10 @@ enum Opts {
 	Complete(Complete),
 	/// Compile and evaluate terranix configuration
 	Tf(Tf),
+	/// Summarize nix activity recorded with --record-nix-activity
+	ActivityReport(ActivityReport),
+	/// Show stored build log of a derivation
+	Logs(Logs),
 }
 
 #[derive(Parser)]
@@ -110,6 +123,38 @@ struct RootOpts {
 	otel_logs: OtlpLogsSettings,
 	#[clap(flatten)]
 	otel_traces: OtlpTracesSettings,
+	/// Queue nix log events into per-thread buffers of this size (in KiB),
+	/// and convert them to tracing events on a separate thread
+	#[clap(long, help_heading = "Logging", env = "FLEET_NIX_LOG_BUFFER")]
+	nix_log_buffer: Option<usize>,
+	/// Drop nix progress updates instead of waiting, when nix log buffer is full
+	#[clap(long, help_heading = "Logging", requires = "nix_log_buffer")]
+	nix_log_drop_progress: bool,
+	/// Write every nix activity event into this file, to be analyzed with `fleet activity-report`
+	#[clap(long, help_heading = "Logging")]
+	record_nix_activity: Option<PathBuf>,
+	/// Keep at most this many frames of nix error traces, 0 keeps all frames
+	#[clap(long, help_heading = "Logging", env = "FLEET_NIX_TRACE_DEPTH")]
+	nix_trace_depth: Option<usize>,
+	/// Store output of every nix build, to be read with `fleet logs`.
+	/// Live build output is then replaced with its tail, shown when the build stops
+	#[clap(long, help_heading = "Logging")]
+	store_build_logs: bool,
+	/// Show only this many last lines of stored build output when the build stops, or of failed
+	/// build output with --build-log-tail-on-failure
+	#[clap(long, help_heading = "Logging", default_value_t = 25)]
+	build_log_tail: usize,
+	/// Show build output only for failed builds, as the last --build-log-tail lines of the
+	/// build error. Nix is told the logger is not verbose, so it keeps the tail itself
+	/// (the log-lines setting, overridable with --option)
+	#[clap(long, help_heading = "Logging")]
+	build_log_tail_on_failure: bool,
+	/// Report substituter latency, hit ratio and transfer rates per host, when finished
+	#[clap(long, help_heading = "Logging")]
+	transfer_metrics: bool,
+	/// Set nix setting (store, fetcher, evaluator or any other one), may be repeated
+	#[clap(long = "option", value_names = ["NAME", "VALUE"], num_args = 2)]
+	nix_option: Vec<String>,
 }
 
 async fn run_command(config: &Config, opts: FleetOpts, command: Opts) -> Result<()> {
@@ -125,6 +170,8 @@ async fn run_command(config: &Config, opts: FleetOpts, command: Opts) -> Result<
 		Opts::Complete(c) => {
 			tokio::task::spawn_blocking(move || c.run(RootOpts::command())).await?
 		}
+		Opts::ActivityReport(_) => unreachable!("handled before logging is set up"),
+		Opts::Logs(l) => l.run(config).await?,
 	};
 	Ok(())
 }
@@ -224,6 +271,13 @@ fn main() -> ExitCode {
 		c.run(RootOpts::command());
 		return ExitCode::SUCCESS;
 	}
+	if let Opts::ActivityReport(r) = &opts.command {
+		if let Err(e) = r.run() {
+			eprintln!("{e:#}");
+			return ExitCode::FAILURE;
+		}
+		return ExitCode::SUCCESS;
+	}
 
 	if let Err(e) = setup_logging(&opts) {
 		eprintln!("{e:#}");
@@ -231,6 +285,68 @@ fn main() -> ExitCode {
 	}
 
 	init_libraries();
+	if let Some(depth) = opts.nix_trace_depth {
+		set_error_trace_depth(depth);
+	}
+	if let Some(kib) = opts.nix_log_buffer {
+		set_logger_mode(LoggerMode::Buffered {
+			ring_capacity: kib * 1024,
+			backpressure: if opts.nix_log_drop_progress {
+				Backpressure::DropProgress
+			} else {
+				Backpressure::Block
+			},
+		});
+	}
+	if let Some(path) = &opts.record_nix_activity {
+		if let Err(e) = start_activity_recording(path) {
+			eprintln!("{e:#}");
+			return ExitCode::FAILURE;
+		}
+	}
+
+	let transfer_metrics = opts.transfer_metrics;
+	if transfer_metrics {
+		if let Err(e) = start_transfer_metrics() {
+			eprintln!("{e:#}");
+			return ExitCode::FAILURE;
+		}
+	}
+
+	if opts.build_log_tail_on_failure {
+		set_build_log_tail_on_failure(true);
+	}
+
+	let fail_fast = opts.fleet_opts.fail_fast
+		&& matches!(opts.command, Opts::Deploy(_) | Opts::BuildSystems(_));
+	let log_lines = opts
+		.build_log_tail_on_failure
+		.then(|| opts.build_log_tail.to_string());
+	if fail_fast || log_lines.is_some() || !opts.nix_option.is_empty() {
+		// Explicit --option keep-going and log-lines are applied after these
+		let settings = fail_fast
+			.then_some(("keep-going", "false"))
+			.into_iter()
+			.chain(log_lines.as_deref().map(|lines| ("log-lines", lines)))
+			.chain(
+				opts.nix_option
+					.chunks_exact(2)
+					.map(|s| (s[0].as_str(), s[1].as_str())),
+			);
+		match init_settings(settings) {
+			Ok(rejected) if rejected.is_empty() => {}
+			Ok(rejected) => {
+				for r in rejected {
+					eprintln!("{r}");
+				}
+				return ExitCode::FAILURE;
+			}
+			Err(e) => {
+				eprintln!("{e:#}");
+				return ExitCode::FAILURE;
+			}
+		}
+	}
 
 	let runtime = tokio::runtime::Builder::new_multi_thread()
 		.enable_all()
@@ -246,7 +362,7 @@ fn main() -> ExitCode {
 
 	init_tokio_for_nix(runtime.clone());
 
-	runtime.block_on(async {
+	let code = runtime.block_on(async {
 		tokio::task::spawn(async move {
 			if let Err(e) = main_real(opts).await {
 				error!("{e:#}");
@@ -257,8 +373,15 @@ fn main() -> ExitCode {
 		})
 		.await
 		.expect("primary task panicked")
-	})
+	});
 	// async_main(opts)
+	flush_logger();
+	stop_activity_recording();
+	close_build_log_store();
+	if transfer_metrics {
+		report_transfers(&take_transfer_metrics());
+	}
+	code
 }
 
 async fn main_real(opts: RootOpts) -> Result<()> {
@@ -270,6 +393,17 @@ async fn main_real(opts: RootOpts) -> Result<()> {
 		nix_args,
 		matches!(opts.command, Opts::Deploy(_) | Opts::BuildSystems(_)),
 	)?;
+	if opts.store_build_logs && !matches!(opts.command, Opts::Logs(_)) {
+		// Failed builds already have their tail in the error
+		let tail = if opts.build_log_tail_on_failure {
+			0
+		} else {
+			opts.build_log_tail
+		};
+		if let Err(e) = open_build_log_store(&build_log_dir(&config), tail) {
+			warn!("build logs will not be stored: {e:#}");
+		}
+	}
 
 	match run_command(&config, opts.fleet_opts, opts.command).await {
 		Ok(()) => {
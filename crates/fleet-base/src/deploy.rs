@@ -3,6 +3,7 @@ use std::{path::PathBuf, time::Duration};
 use anyhow::{Context as _, Result, anyhow, bail};
 use clap::ValueEnum;
 use itertools::Itertools;
+use nix_eval::drv::ClosureCopier;
 use tokio::time::sleep;
 use tracing::{Instrument as _, error, info, info_span, warn};
 
@@ -255,6 +256,7 @@ pub async fn deploy_task(
 
 pub async fn upload_task(
 	config: &Config,
+	copier: &ClosureCopier,
 	host: &ConfigHost,
 	location: GenerationStorage,
 	generation: PathBuf,
@@ -266,7 +268,7 @@ pub async fn upload_task(
 		info!("uploading system closure");
 		let mut tries = 0;
 		loop {
-			match host.remote_derivation(&generation).await {
+			match host.remote_derivation(copier, &generation).await {
 				Ok(remote) => {
 					assert!(remote == generation, "CA derivations aren't implemented");
 					return Ok(remote);
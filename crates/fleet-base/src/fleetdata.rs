@@ -725,6 +725,15 @@ impl FleetSecrets {
 	pub fn contains(&self, secret: &str) -> bool {
 		self.0.contains_key(secret)
 	}
+	/// Number of stored distributions, which have expired at `now` and will be pruned
+	/// during evaluation.
+	pub fn expired_count(&self, now: DateTime<Utc>) -> usize {
+		self.0
+			.values()
+			.flat_map(|d| d.distributions())
+			.filter(|d| d.secret.expires_at.is_some_and(|e| e < now))
+			.count()
+	}
 	pub fn remove(&mut self, secret: &str) {
 		self.0.remove(secret);
 	}
@@ -12,13 +12,18 @@ use std::{
 use anyhow::{Context, Result, anyhow, bail, ensure};
 use chrono::{DateTime, Utc};
 use fleet_shared::SecretData;
-use nix_eval::{Value, nix_go, nix_go_json, util::assert_warn};
+use nix_eval::{
+	EvalCache, Value,
+	drv::ClosureCopier,
+	nix_go, nix_go_json,
+	util::{assert_warn, check_assertions},
+};
 use openssh::{ControlPersist, SessionBuilder};
 use serde::de::DeserializeOwned;
 use tabled::Tabled;
 use tempfile::NamedTempFile;
 use time::{UtcDateTime, format_description};
-use tracing::warn;
+use tracing::{info_span, warn};
 
 use crate::{
 	command::MyCommand,
@@ -41,6 +46,16 @@ pub struct FleetConfigInternals {
 	pub config_field: Value,
 	/// flake.output
 	pub flake_outputs: Value,
+	/// Evaluation cache of `fleetConfigurations.default {}`, host lists, tags and system
+	/// derivations are looked up through it.
+	///
+	/// Secrets provided by fleet primops are a part of the cache key, see [`FleetOpts::build`],
+	/// and the cache is only written by [`Config::save`] if they weren't changed by this run.
+	///
+	/// [`FleetOpts::build`]: crate::opts::FleetOpts::build
+	pub eval_cache: EvalCache,
+	/// Serialized `data`, as it was loaded
+	pub loaded_data: String,
 	// TODO: Remove with connectivity refactor
 	pub localhost: String,
 
@@ -108,7 +123,8 @@ pub struct ConfigHost {
 	session_destination: OnceLock<String>,
 	legacy_ssh_store: OnceLock<bool>,
 
-	pub host_config: Option<Value>,
+	/// `config.hosts.<name>`, evaluated on first use. None for the local host.
+	host_config: Option<OnceLock<Value>>,
 	pub nixos_config: OnceLock<Value>,
 	pub nixos_unchecked_config: OnceLock<Value>,
 	pub pkgs_override: Option<Value>,
@@ -451,7 +467,11 @@ impl ConfigHost {
 		Ok(data)
 	}
 	/// Returns path for futureproofing, as path might change i.e on conversion to CA
-	pub async fn remote_derivation(&self, path: &PathBuf) -> Result<PathBuf> {
+	pub async fn remote_derivation(
+		&self,
+		copier: &ClosureCopier,
+		path: &PathBuf,
+	) -> Result<PathBuf> {
 		if self.local {
 			// Path is located locally, thus already trusted.
 			return Ok(path.to_owned());
@@ -470,35 +490,35 @@ impl ConfigHost {
 		if let Err(e) = sign.sudo().run_nix().await {
 			warn!("failed to sign store paths: {e}");
 		}
-		let mut nix = MyCommand::new(
-			// Not used
-			EscalationStrategy::Su,
-			"nix",
-		);
-		nix.arg("copy").arg("--substitute-on-destination");
-
 		let proto = if self.legacy_ssh_store.get().cloned().unwrap_or(false) {
 			"ssh"
 		} else {
 			"ssh-ng"
 		};
 
-		match self.deploy_kind().await? {
+		let (uri, check_sigs) = match self.deploy_kind().await? {
 			DeployKind::Fleet | DeployKind::UpgradeToFleet | DeployKind::NixosLustrate => {
-				nix.comparg("--to", format!("{proto}://{}", self.name));
+				(format!("{proto}://{}", self.name), true)
 			}
-			DeployKind::NixosInstall => {
-				nix
-					// Signature checking makes no sense with remote-store store argument set, as we're not even interacting with remote nix daemon
-					.arg("--no-check-sigs")
-					.comparg(
-						"--to",
-						format!("{proto}://root@{}?remote-store=/mnt", self.name),
-					);
-			}
-		}
-		nix.arg(path);
-		nix.run_nix().await.context("nix copy")?;
+			// Signature checking makes no sense with remote-store store argument set, as we're not even interacting with remote nix daemon
+			DeployKind::NixosInstall => (
+				format!("{proto}://root@{}?remote-store=/mnt", self.name),
+				false,
+			),
+		};
+		let path_str = path
+			.to_str()
+			.ok_or_else(|| anyhow!("store path should be utf-8"))?;
+		copier
+			.copy_closure(
+				uri,
+				vec![path_str.to_owned()],
+				true,
+				check_sigs,
+				self.name.clone(),
+			)
+			.await
+			.context("copying closure")?;
 		Ok(path.to_owned())
 	}
 	pub async fn systemctl_stop(&self, name: &str) -> Result<()> {
@@ -531,20 +551,35 @@ impl ConfigHost {
 		if let Some(v) = self.groups.get() {
 			return Ok(v.clone());
 		}
-		let Some(host_config) = &self.host_config else {
+		if self.host_config.is_none() {
 			return Ok(vec![]);
-		};
-		let tags: Vec<String> = nix_go_json!(host_config.tags);
+		}
+		let tags = self
+			.config
+			.eval_cache
+			.strings(&["config", "hosts", &self.name, "tags"])?;
 
 		let _ = self.groups.set(tags.clone());
 
 		Ok(tags)
 	}
+	fn host_config(&self) -> Result<Option<Value>> {
+		let Some(cell) = &self.host_config else {
+			return Ok(None);
+		};
+		if let Some(v) = cell.get() {
+			return Ok(Some(v.clone()));
+		}
+		let config = &self.config.config_field;
+		let name = &self.name;
+		let host_config = nix_go!(config.hosts[{ name }]);
+		Ok(Some(cell.get_or_init(|| host_config).clone()))
+	}
 	pub fn nixos_config(&self) -> Result<Value> {
 		if let Some(v) = self.nixos_config.get() {
 			return Ok(v.clone());
 		}
-		let Some(host_config) = &self.host_config else {
+		let Some(host_config) = self.host_config()? else {
 			bail!("local host has no nixos_config");
 		};
 		let nixos_config = nix_go!(host_config.nixos.config);
@@ -558,7 +593,7 @@ impl ConfigHost {
 		if let Some(v) = self.nixos_unchecked_config.get() {
 			return Ok(v.clone());
 		}
-		let Some(host_config) = &self.host_config else {
+		let Some(host_config) = self.host_config()? else {
 			bail!("local host has no nixos_config");
 		};
 		let nixos_config = nix_go!(host_config.nixos_unchecked.config);
@@ -568,6 +603,26 @@ impl ConfigHost {
 		Ok(nixos_config)
 	}
 
+	/// Derivation path of `system.build.<build_attr>`, after nixos assertions and warnings are
+	/// checked, answered from the evaluation cache while the fleet flake and state are unchanged.
+	pub fn system_drv_path(&self, build_attr: &str) -> Result<String> {
+		if self.host_config.is_none() {
+			bail!("local host has no nixos_config");
+		}
+		let cache = &self.config.eval_cache;
+		let name = &self.name;
+		info_span!("assert_warn", action = "nixos config evaluation").in_scope(|| {
+			let errors = cache.strings(&["config", "hosts", name, "nixos", "config", "errors"])?;
+			check_assertions(errors, || {
+				cache.strings(&["config", "hosts", name, "nixos", "config", "warnings"])
+			})
+		})?;
+
+		cache.drv_path(&[
+			"config", "hosts", name, "nixos", "config", "system", "build", build_attr,
+		])
+	}
+
 	pub fn list_defined_secrets(&self) -> Result<Vec<String>> {
 		let nixos = self.nixos_unchecked_config()?;
 		let secrets = nix_go!(nixos.secrets);
@@ -579,7 +634,7 @@ impl ConfigHost {
 		if let Some(value) = &self.pkgs_override {
 			return Ok(value.clone());
 		}
-		let Some(host_config) = &self.host_config else {
+		let Some(host_config) = self.host_config()? else {
 			bail!("local host has no host_config");
 		};
 		// TODO: Should nixos.options be cached?
@@ -614,9 +669,7 @@ impl SharedSecretDefinition {
 
 impl Config {
 	pub fn tagged_hostnames(&self, tag: &str) -> Result<Vec<String>> {
-		let config = &self.config_field;
-		let tagged: Vec<String> = nix_go_json!(config.taggedWith[{ tag }]);
-		Ok(tagged)
+		self.eval_cache.strings(&["config", "taggedWith", tag])
 	}
 	pub fn expand_owner_set(&self, owners: Vec<String>) -> Result<BTreeSet<String>> {
 		let mut out = BTreeSet::new();
@@ -661,22 +714,26 @@ impl Config {
 			.iter()
 			.filter_map(|v| v.as_host())
 			.collect::<HashSet<_>>();
-		let config = &self.config_field;
-		let mut names = nix_go!(config.hosts).list_fields()?;
+		let mut names = self.host_names()?;
 		names.retain(|s| filter(s));
 		names.sort_by_key(|h| prefer.contains(h.as_str()));
 
-		Ok(names.into_iter().map(|h| self.host(&h)))
+		Ok(names
+			.into_iter()
+			.map(|h| Ok(self.host_with_config(&h, None))))
 	}
 
 	pub fn host(&self, name: &str) -> Result<ConfigHost> {
 		let config = &self.config_field;
 		let host_config = nix_go!(config.hosts[{ name }]);
 
-		Ok(ConfigHost {
+		Ok(self.host_with_config(name, Some(host_config)))
+	}
+	fn host_with_config(&self, name: &str, host_config: Option<Value>) -> ConfigHost {
+		ConfigHost {
 			config: self.clone(),
 			name: name.to_owned(),
-			host_config: Some(host_config),
+			host_config: Some(host_config.map(OnceLock::from).unwrap_or_default()),
 			nixos_config: OnceLock::new(),
 			nixos_unchecked_config: OnceLock::new(),
 			groups: OnceLock::new(),
@@ -688,16 +745,18 @@ impl Config {
 			deploy_kind: OnceLock::new(),
 			session_destination: OnceLock::new(),
 			legacy_ssh_store: OnceLock::new(),
-		})
+		}
+	}
+	/// Names of all hosts, answered from the evaluation cache while the fleet flake is unchanged.
+	pub fn host_names(&self) -> Result<Vec<String>> {
+		self.eval_cache.attr_names(&["config", "hosts"])
 	}
 	pub fn list_hosts(&self) -> Result<Vec<ConfigHost>> {
-		let config = &self.config_field;
-		let names = nix_go!(config.hosts).list_fields()?;
-		let mut out = vec![];
-		for name in names {
-			out.push(self.host(&name)?);
-		}
-		Ok(out)
+		Ok(self
+			.host_names()?
+			.into_iter()
+			.map(|name| self.host_with_config(&name, None))
+			.collect())
 	}
 	// TODO: Replace usages with .host().nixos_config
 	pub fn system_config(&self, host: &str) -> Result<Value> {
@@ -716,9 +775,16 @@ impl Config {
 		))))
 	}
 
+	/// Writes fleet.nix, and the evaluation cache if fleet state wasn't changed by this run.
+	///
+	/// Entries evaluated while primops were generating or pruning secrets describe the updated
+	/// state, which is keyed differently by the next run.
 	pub fn save(&self) -> Result<()> {
 		let mut tempfile = NamedTempFile::new_in(self.directory.clone()).context("failed to create updated version of fleet.nix in the same directory as original.\nDo you have write access to it? Access only to the fleet.nix won't be enough, the directory is used for atomic overwrite operation.\nIt is not recommended to use fleet by root anyway, move fleet project to your home directory.")?;
 		let data = nixlike::serialize(&*self.data)?;
+		if data == self.loaded_data {
+			self.eval_cache.commit();
+		}
 		tempfile.write_all(
 			format!(
 				"# This file contains fleet state and shouldn't be edited by hand\n\n{data}\n\n# vim: ts=2 et nowrap\n"
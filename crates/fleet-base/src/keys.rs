@@ -3,7 +3,6 @@ use std::str::FromStr as _;
 use age::Recipient;
 use anyhow::{Result, anyhow, bail};
 use futures::{StreamExt as _, TryStreamExt as _};
-use itertools::Itertools as _;
 use tracing::warn;
 
 use crate::{fleetdata::SecretOwner, host::Config};
@@ -63,7 +62,7 @@ impl Config {
 	#[allow(dead_code)]
 	pub async fn orphaned_data(&self) -> Result<Vec<String>> {
 		let mut out = Vec::new();
-		let host_names = self.list_hosts()?.into_iter().map(|h| h.name).collect_vec();
+		let host_names = self.host_names()?;
 		let hosts = self.data.hosts.read().expect("no poisoning");
 		for hostname in hosts
 			.iter()
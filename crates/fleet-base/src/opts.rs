@@ -99,7 +99,7 @@ pub struct FleetOpts {
 	/// By default fleet continues on single derivation build failure;
 	/// this flag makes command fail immediately
 	///
-	/// Opposite of Nix's --keep-going
+	/// Opposite of Nix's --keep-going, which is otherwise read from nix.conf
 	#[clap(long)]
 	pub fail_fast: bool,
 }
@@ -214,6 +214,8 @@ impl FleetOpts {
 		let bytes =
 			std::fs::read_to_string(&fleet_data_path).context("reading fleet state (fleet.nix)")?;
 		let data = Arc::new(FleetData::from_str(&bytes)?);
+		let loaded_data = nixlike::serialize(&*data)?;
+		let now = Utc::now();
 
 		init_primops();
 
@@ -236,14 +238,26 @@ impl FleetOpts {
 
 		let lock = FlakeLockFlags::new(&flake_settings)?;
 
-		let flake = flake.lock(&fetch_settings, &flake_settings, &lock)?;
+		let locked = flake.lock(&fetch_settings, &flake_settings, &lock)?;
 
-		let flake = flake.get_attrs(&mut flake_settings)?;
+		let flake = locked.get_attrs(&mut flake_settings)?;
 
 		let builtins_field = Value::eval("builtins")?;
 
 		let fleet_root = flake.get_field("fleetConfigurations")?;
 		let fleet_field = nix_go!(fleet_root.default(Obj {}));
+		// fleet.nix is read by fleet primops during evaluation, and is not necessarily
+		// committed to the flake. Primops also prune expired secrets, cached results are
+		// stale once any of them expires.
+		let expired = data
+			.secrets
+			.read()
+			.expect("no poisoning")
+			.expired_count(now);
+		let eval_cache = locked.eval_cache(
+			&fleet_field,
+			&format!("fleetConfigurations.default\n{expired}\n{bytes}"),
+		)?;
 
 		let config_field = nix_go!(fleet_field.config);
 
@@ -268,11 +282,13 @@ impl FleetOpts {
 		let config = Config(Arc::new(FleetConfigInternals {
 			// TODO: Load from somewhere
 			prefer_identities: BTreeSet::new(),
-			now: Utc::now(),
+			now,
 
 			directory,
 			data,
 			flake_outputs: flake,
+			eval_cache,
+			loaded_data,
 			local_system: self.local_system.clone(),
 			nix_args,
 			config_field,
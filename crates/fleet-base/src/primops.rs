@@ -4,7 +4,7 @@ use std::sync::OnceLock;
 use anyhow::{Context, bail, ensure};
 use fleet_shared::SecretData;
 use itertools::Itertools;
-use nix_eval::{NativeFn, Value, await_in_nix, nix_go, nix_go_json};
+use nix_eval::{NativeFn, Value, await_in_nix, nix_go, nix_go_json, nix_go_lazy};
 use serde::Deserialize;
 use tracing::{info, warn};
 
@@ -264,7 +264,7 @@ pub fn init_primops() {
 
 			let default_generator_drv = get_default_generator_drv(config, &generator)?;
 			let mut expectations = Expectations {
-				parts: nix_go_json!(default_generator_drv.parts),
+				parts: nix_go_lazy!(default_generator_drv.parts),
 				generation_data: nix_go_json!(default_generator_drv.generationData),
 				owners: expected_owners.clone(),
 			};
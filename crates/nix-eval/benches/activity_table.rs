@@ -0,0 +1,59 @@
+//! Contention on the activity table, with as many concurrent builds as `max-jobs = 16` allows.
+//!
+//! Run with `cargo bench -p nix-eval --features bench --bench activity_table`.
+use std::time::Instant;
+
+use nix_eval::drv::DrvGraph;
+use nix_eval::logging::register_build_graph;
+use nix_eval::logging_bench::replay_synthetic_builds;
+use tracing::info_span;
+use tracing_subscriber::{EnvFilter, prelude::*};
+
+const DERIVATIONS: usize = 20_000;
+const MAX_JOBS: u32 = 16;
+
+fn synthetic_graph() -> DrvGraph {
+	let mut graph = DrvGraph::default();
+	let inputs = (1..=DERIVATIONS as u32).collect::<Vec<_>>();
+	graph.push(
+		"/nix/store/00000000000000000000000000000000-system.drv",
+		&inputs,
+		&["out"],
+	);
+	for i in 1..=DERIVATIONS {
+		graph.push(
+			&format!("/nix/store/{i:032}-package-{i}.drv"),
+			&[],
+			&["out"],
+		);
+	}
+	graph
+}
+
+fn main() {
+	tracing_subscriber::registry()
+		.with(
+			tracing_subscriber::fmt::layer()
+				.with_writer(std::io::sink)
+				.with_filter(EnvFilter::new("info")),
+		)
+		.init();
+	nix_eval::init_libraries();
+
+	let graph = synthetic_graph();
+	let drvs = (1..graph.len() as u32)
+		.map(|node| graph.path(node).to_owned())
+		.collect::<Vec<_>>();
+
+	for jobs in [1, 4, MAX_JOBS, MAX_JOBS * 2] {
+		let span = info_span!("bench", jobs);
+		let _guard = register_build_graph(&span, None, &graph);
+		let start = Instant::now();
+		replay_synthetic_builds(&drvs, jobs);
+		let elapsed = start.elapsed();
+		println!(
+			"max-jobs={jobs:<3} {:>10.0} builds/s ({elapsed:?})",
+			DERIVATIONS as f64 / elapsed.as_secs_f64(),
+		);
+	}
+}
@@ -0,0 +1,125 @@
+//! Matching of activity texts against span patterns, compared with the `starts_with` chain it
+//! replaced.
+//!
+//! Texts are taken from a `--record-nix-activity` file, if `ACTIVITY_RECORDING` is set, and are
+//! synthetic otherwise.
+//!
+//! Run with `cargo bench -p nix-eval --bench activity_text`.
+use std::hint::black_box;
+use std::path::Path;
+use std::time::{Duration, Instant};
+
+use nix_eval::logging::{ActivityType, match_activity_text};
+use nix_eval::recording::{EventKind, Recording};
+
+const ROUNDS: usize = 20;
+const MIN_TEXTS: usize = 100_000;
+
+/// Matching, as it was done before patterns were moved into a table.
+fn chain(ty: ActivityType, s: &str) -> Option<&str> {
+	let between = |pref: &str, suff: &str| {
+		(s.starts_with(pref) && s.ends_with(suff))
+			.then(|| s.trim_start_matches(pref).trim_end_matches(suff))
+	};
+	match ty {
+		ActivityType::Unknown => between("copying \"", "\" to the store")
+			.or_else(|| between("copying '", "' to the store"))
+			.or_else(|| between("hashing '", "'"))
+			.or_else(|| between("connecting to '", "'"))
+			.or_else(|| between("copying outputs from '", "'"))
+			.or_else(|| between("copying dependencies to '", "'"))
+			.or_else(|| between("waiting for the upload lock to '", "'"))
+			.or_else(|| (s == "querying info about missing paths").then_some("")),
+		ActivityType::BuildWaiting => between("waiting for a machine to build '", "'"),
+		_ => None,
+	}
+}
+
+fn recorded(path: &Path) -> Vec<(ActivityType, String)> {
+	let recording = Recording::read(path).expect("recording is readable");
+	recording
+		.events
+		.iter()
+		.filter_map(|e| match &e.kind {
+			EventKind::Start {
+				ty, text, fields, ..
+			} if fields.is_empty() => Some((*ty, recording.string(*text)?.to_owned())),
+			_ => None,
+		})
+		.collect()
+}
+
+fn synthetic() -> Vec<(ActivityType, String)> {
+	(0..1000)
+		.flat_map(|i| {
+			[
+				(
+					ActivityType::Unknown,
+					format!("copying '/home/user/fleet/hosts/host-{i}' to the store"),
+				),
+				(ActivityType::Unknown, format!("hashing '/tmp/source-{i}'")),
+				(
+					ActivityType::Unknown,
+					format!("connecting to 'ssh://builder-{i}'"),
+				),
+				(
+					ActivityType::Unknown,
+					format!("copying dependencies to 'ssh://builder-{i}'"),
+				),
+				(
+					ActivityType::BuildWaiting,
+					format!("waiting for a machine to build '/nix/store/{i:032}-package-{i}.drv'"),
+				),
+				(
+					ActivityType::Unknown,
+					"querying info about missing paths".to_owned(),
+				),
+				(
+					ActivityType::Unknown,
+					format!("evaluating derivation 'host-{i}'"),
+				),
+				(ActivityType::Realise, String::new()),
+			]
+		})
+		.collect()
+}
+
+fn measure(
+	texts: &[(ActivityType, String)],
+	f: impl Fn(ActivityType, &str) -> Option<&str>,
+) -> Duration {
+	let mut best = Duration::MAX;
+	for _ in 0..ROUNDS {
+		let start = Instant::now();
+		for (ty, s) in texts {
+			black_box(f(*ty, black_box(s)));
+		}
+		best = best.min(start.elapsed());
+	}
+	best
+}
+
+fn main() {
+	let mut texts = match std::env::var_os("ACTIVITY_RECORDING") {
+		Some(path) => recorded(Path::new(&path)),
+		None => synthetic(),
+	};
+	assert!(!texts.is_empty(), "no activity texts to match");
+	for (ty, s) in &texts {
+		assert_eq!(match_activity_text(*ty, s), chain(*ty, s), "{ty:?} {s}");
+	}
+	let base = texts.clone();
+	while texts.len() < MIN_TEXTS {
+		texts.extend_from_slice(&base);
+	}
+
+	for (name, took) in [
+		("chain", measure(&texts, chain)),
+		("table", measure(&texts, match_activity_text)),
+	] {
+		println!(
+			"{name:<6} {:>6.1} ns/text",
+			took.as_nanos() as f64 / texts.len() as f64
+		);
+	}
+}
@@ -0,0 +1,61 @@
+//! Reading of a derivation closure with the C++ reader (`DrvGraph::resolve`), with a single
+//! thread compared with several concurrent store reads.
+//!
+//! The closure is of `DRV_PATH` if set (e.g. a system toplevel), and of 5000 synthetic
+//! derivations otherwise.
+//!
+//! Run with `cargo bench -p nix-eval --bench drv_closure`.
+use std::time::{Duration, Instant};
+
+use nix_eval::drv::DrvGraph;
+use nix_eval::{Result, Value};
+
+const ROUNDS: u32 = 5;
+
+const SYNTHETIC: &str = r#"
+let
+	drv = name: inputs: derivation {
+		inherit name inputs;
+		system = builtins.currentSystem;
+		builder = "/bin/sh";
+	};
+	nodes = builtins.genList (i: drv "node-${toString i}"
+		(if i == 0 then [ ] else [ (builtins.elemAt nodes (i / 2)) (builtins.elemAt nodes (i / 3)) ])
+	) 5000;
+in (drv "root" nodes).drvPath
+"#;
+
+fn measure(name: &str, expected: usize, f: impl Fn() -> Result<usize>) -> Result<()> {
+	let mut times = (0..ROUNDS)
+		.map(|_| {
+			let start = Instant::now();
+			assert_eq!(f()?, expected);
+			Ok(start.elapsed())
+		})
+		.collect::<Result<Vec<Duration>>>()?;
+	times.sort();
+	println!(
+		"{name:<16} median {:?}, min {:?}",
+		times[times.len() / 2],
+		times[0],
+	);
+	Ok(())
+}
+
+fn main() -> Result<()> {
+	nix_eval::init_libraries();
+
+	let root = match std::env::var("DRV_PATH") {
+		Ok(path) => path,
+		Err(_) => Value::eval(SYNTHETIC)?.to_string()?,
+	};
+	let nodes = DrvGraph::resolve(&root)?.len();
+	println!("{nodes} derivations");
+
+	for threads in [1, 4, 0] {
+		measure(&format!("c++, threads={threads}"), nodes, || {
+			Ok(DrvGraph::resolve_with_threads(&root, threads)?.len())
+		})?;
+	}
+	Ok(())
+}
@@ -0,0 +1,72 @@
+//! Cost of forwarding every nix event to tracing, compared with dropping
+//! disabled ones on the C++ side, at the default `info` filter.
+//!
+//! Run with `cargo bench -p nix-eval --features bench --bench log_filter`.
+use std::time::{Duration, Instant};
+
+use nix_eval::logging::{forward_all_nix_events, refresh_log_filter};
+use nix_eval::logging_bench::replay_synthetic_activities;
+use nix_eval::{
+	FetchSettings, FlakeLockFlags, FlakeReference, FlakeReferenceParseFlags, FlakeSettings, Result,
+	nix_go,
+};
+use tracing_subscriber::{EnvFilter, prelude::*};
+
+const ACTIVITIES: u64 = 100_000;
+const EVALUATIONS: u32 = 5;
+
+/// Locks this repository flake, and evaluates fleet package derivation.
+fn evaluate() -> Result<Duration> {
+	let start = Instant::now();
+	let mut fetch_settings = FetchSettings::new();
+	fetch_settings.set(c"warn-dirty", c"false");
+
+	let manifest = format!("git+file://{}/../../", env!("CARGO_MANIFEST_DIR"));
+	let mut flake = FlakeSettings::new()?;
+	let parse = FlakeReferenceParseFlags::new(&flake)?;
+	let (mut r, _) = FlakeReference::new(&manifest, &flake, &parse, &fetch_settings)?;
+	let lock = FlakeLockFlags::new(&flake)?;
+	let locked = r.lock(&fetch_settings, &flake, &lock)?;
+	let attrs = locked.get_attrs(&mut flake)?;
+	let drv_path = nix_go!(attrs.packages["x86_64-linux"].fleet.drvPath);
+	drv_path.to_string()?;
+	Ok(start.elapsed())
+}
+
+fn run(name: &str) -> Result<()> {
+	let start = Instant::now();
+	replay_synthetic_activities(ACTIVITIES, 4);
+	let replay = start.elapsed();
+
+	let mut evals = (0..EVALUATIONS)
+		.map(|_| evaluate())
+		.collect::<Result<Vec<_>>>()?;
+	evals.sort();
+	println!(
+		"{name:<12} replay: {:>10.0} act/s, evaluation: median {:?}, min {:?}",
+		ACTIVITIES as f64 / replay.as_secs_f64(),
+		evals[evals.len() / 2],
+		evals[0],
+	);
+	Ok(())
+}
+
+fn main() -> Result<()> {
+	tracing_subscriber::registry()
+		.with(
+			tracing_subscriber::fmt::layer()
+				.with_writer(std::io::sink)
+				.with_filter(EnvFilter::new("info")),
+		)
+		.init();
+	nix_eval::init_libraries();
+
+	// Warm up fetcher and evaluation caches
+	evaluate()?;
+
+	forward_all_nix_events();
+	run("forward all")?;
+	refresh_log_filter();
+	run("filtered")?;
+	Ok(())
+}
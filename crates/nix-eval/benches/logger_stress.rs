@@ -0,0 +1,273 @@
+//! Nix logger bridge under load: a stream of log lines, errors, activities and their results is
+//! replayed through the installed logger from several C++ threads at once.
+//!
+//! The stream is taken from a `--record-nix-activity` file if `ACTIVITY_RECORDING` is set
+//! (recordings have no log lines and errors, and no text of build output), and is synthetic
+//! otherwise.
+//!
+//! Allocations are counted with a counting Rust allocator, and by replacing C++ `operator new`.
+//!
+//! Run with `cargo bench -p nix-eval --features bench --bench logger_stress`.
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::ffi::c_void;
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Duration;
+
+use nix_eval::logging::{ActivityType, Backpressure, LoggerMode, flush_logger, set_logger_mode};
+use nix_eval::logging_bench::{CallField, LoggerCall, LoggerCallKind, stress_tracing_logger};
+use nix_eval::recording::{EventKind, Field, Recording};
+use tracing_subscriber::{EnvFilter, prelude::*};
+
+const MIN_CALLS: usize = 200_000;
+
+static RUST_ALLOCATIONS: AtomicU64 = AtomicU64::new(0);
+static CPP_ALLOCATIONS: AtomicU64 = AtomicU64::new(0);
+
+struct CountingAllocator;
+unsafe impl GlobalAlloc for CountingAllocator {
+	unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+		RUST_ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+		unsafe { System.alloc(layout) }
+	}
+	unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+		unsafe { System.dealloc(ptr, layout) }
+	}
+	unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+		RUST_ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+		unsafe { System.realloc(ptr, layout, new_size) }
+	}
+}
+#[global_allocator]
+static ALLOCATOR: CountingAllocator = CountingAllocator;
+
+unsafe extern "C" {
+	fn malloc(size: usize) -> *mut c_void;
+}
+/// C++ `operator new(size_t)`, libstdc++ implements it with malloc too, so its `operator delete`
+/// still matches.
+#[unsafe(no_mangle)]
+pub extern "C" fn _Znwm(size: usize) -> *mut c_void {
+	CPP_ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+	let ptr = unsafe { malloc(size.max(1)) };
+	if ptr.is_null() {
+		std::process::abort();
+	}
+	ptr
+}
+/// C++ `operator new[](size_t)`
+#[unsafe(no_mangle)]
+pub extern "C" fn _Znam(size: usize) -> *mut c_void {
+	_Znwm(size)
+}
+
+fn call(kind: LoggerCallKind, ty: u32, activity: u64, fields: Vec<CallField>) -> LoggerCall {
+	LoggerCall {
+		kind,
+		lvl: 3,
+		ty,
+		activity,
+		parent: 0,
+		text: String::new(),
+		fields,
+	}
+}
+fn int(i: u64) -> CallField {
+	CallField {
+		string: false,
+		i,
+		s: String::new(),
+	}
+}
+fn string(s: impl Into<String>) -> CallField {
+	CallField {
+		string: true,
+		i: 0,
+		s: s.into(),
+	}
+}
+
+// Nix `ResultType` values
+const RESULT_BUILD_LOG_LINE: u32 = 101;
+const RESULT_SET_PHASE: u32 = 104;
+const RESULT_PROGRESS: u32 = 105;
+
+/// Evaluation and deployment of a host: log lines, path info queries, substitutions with
+/// downloads, builds with phases and output, and an occasional error.
+fn synthetic() -> Vec<LoggerCall> {
+	let mut out = Vec::new();
+	let mut next_id = 0;
+	let mut id = || {
+		next_id += 1;
+		next_id
+	};
+	for i in 0..200 {
+		let path = format!("/nix/store/{i:032}-package-{i}");
+		out.push(LoggerCall {
+			text: format!("evaluating file '/home/user/fleet/hosts/host-{i}.nix'"),
+			lvl: 5,
+			..call(LoggerCallKind::Log, 0, 0, vec![])
+		});
+
+		let query = id();
+		out.push(call(
+			LoggerCallKind::Start,
+			ActivityType::QueryPathInfo as u32,
+			query,
+			vec![string(&path), string("https://cache.nixos.org")],
+		));
+		out.push(call(LoggerCallKind::Stop, 0, query, vec![]));
+
+		let substitute = id();
+		out.push(call(
+			LoggerCallKind::Start,
+			ActivityType::Substitute as u32,
+			substitute,
+			vec![string(&path), string("https://cache.nixos.org")],
+		));
+		let download = id();
+		out.push(LoggerCall {
+			parent: substitute,
+			..call(
+				LoggerCallKind::Start,
+				ActivityType::FileTransfer as u32,
+				download,
+				vec![string(format!(
+					"https://cache.nixos.org/nar/{i:052}.nar.xz"
+				))],
+			)
+		});
+		for done in 1..=4 {
+			out.push(call(
+				LoggerCallKind::Result,
+				RESULT_PROGRESS,
+				download,
+				vec![int(done << 20), int(4 << 20), int(0), int(0)],
+			));
+		}
+		out.push(call(LoggerCallKind::Stop, 0, download, vec![]));
+		out.push(call(LoggerCallKind::Stop, 0, substitute, vec![]));
+
+		let build = id();
+		out.push(call(
+			LoggerCallKind::Start,
+			ActivityType::Build as u32,
+			build,
+			vec![string(format!("{path}.drv")), string(""), int(1), int(1)],
+		));
+		for phase in ["unpackPhase", "buildPhase", "installPhase"] {
+			out.push(call(
+				LoggerCallKind::Result,
+				RESULT_SET_PHASE,
+				build,
+				vec![string(phase)],
+			));
+			for line in 0..10 {
+				out.push(call(
+					LoggerCallKind::Result,
+					RESULT_BUILD_LOG_LINE,
+					build,
+					vec![string(format!("building object {line} of package-{i}"))],
+				));
+			}
+		}
+		out.push(call(LoggerCallKind::Stop, 0, build, vec![]));
+
+		if i % 50 == 0 {
+			out.push(LoggerCall {
+				text: format!("builder for '{path}.drv' failed with exit code 1"),
+				lvl: 0,
+				..call(LoggerCallKind::Error, 0, 0, vec![])
+			});
+		}
+	}
+	out
+}
+
+fn recorded(path: &Path) -> Vec<LoggerCall> {
+	let recording = Recording::read(path).expect("recording is readable");
+	let fields = |fields: &[Field]| {
+		fields
+			.iter()
+			.map(|f| match f {
+				Field::Int(i) => int(*i),
+				Field::Str(s) => string(recording.string(*s).unwrap_or("recorded output")),
+			})
+			.collect()
+	};
+	recording
+		.events
+		.iter()
+		.map(|e| match &e.kind {
+			EventKind::Start {
+				ty,
+				parent,
+				text,
+				fields: f,
+			} => LoggerCall {
+				parent: *parent,
+				text: recording.string(*text).unwrap_or_default().to_owned(),
+				..call(LoggerCallKind::Start, *ty as u32, e.activity, fields(f))
+			},
+			EventKind::Stop => call(LoggerCallKind::Stop, 0, e.activity, vec![]),
+			EventKind::Result { ty, fields: f } => {
+				call(LoggerCallKind::Result, *ty, e.activity, fields(f))
+			}
+		})
+		.collect()
+}
+
+fn run(name: &str, mode: LoggerMode, calls: &[LoggerCall], threads: u32, rounds: u32) {
+	set_logger_mode(mode);
+	let rust = RUST_ALLOCATIONS.load(Ordering::Relaxed);
+	let cpp = CPP_ALLOCATIONS.load(Ordering::Relaxed);
+	let stress = stress_tracing_logger(calls, threads, rounds);
+	flush_logger();
+	let rust = RUST_ALLOCATIONS.load(Ordering::Relaxed) - rust;
+	let cpp = CPP_ALLOCATIONS.load(Ordering::Relaxed) - cpp;
+
+	let elapsed = Duration::from_nanos(stress.elapsed_ns);
+	let per_call = |n: u64| n as f64 / stress.calls as f64;
+	println!(
+		"{name:<22} threads={threads:<3} {:>10.0} calls/s, p50 {:>6} ns, p99 {:>7} ns, allocations/call: rust {:>5.2}, c++ {:>5.2}",
+		stress.calls as f64 / elapsed.as_secs_f64(),
+		stress.p50_ns,
+		stress.p99_ns,
+		per_call(rust),
+		per_call(cpp),
+	);
+}
+
+fn main() {
+	tracing_subscriber::registry()
+		.with(
+			tracing_subscriber::fmt::layer()
+				.with_writer(std::io::sink)
+				.with_filter(EnvFilter::new("info")),
+		)
+		.init();
+	nix_eval::init_libraries();
+
+	let calls = match std::env::var_os("ACTIVITY_RECORDING") {
+		Some(path) => recorded(Path::new(&path)),
+		None => synthetic(),
+	};
+	assert!(!calls.is_empty(), "no logger calls to replay");
+	let rounds = MIN_CALLS.div_ceil(calls.len()) as u32;
+
+	let buffered = |backpressure| LoggerMode::Buffered {
+		ring_capacity: 1 << 20,
+		backpressure,
+	};
+	for threads in [1, 4, 16] {
+		run("sync", LoggerMode::Sync, &calls, threads, rounds);
+		run(
+			"buffered/block",
+			buffered(Backpressure::Block),
+			&calls,
+			threads,
+			rounds,
+		);
+	}
+	set_logger_mode(LoggerMode::Sync);
+}
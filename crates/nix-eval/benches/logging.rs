@@ -0,0 +1,52 @@
+//! Throughput of the nix logger bridge, synchronous vs ring-buffered.
+//!
+//! Run with `cargo bench -p nix-eval --features bench --bench logging`.
+use std::time::{Duration, Instant};
+
+use nix_eval::logging::{Backpressure, LoggerMode, flush_logger, set_logger_mode};
+use nix_eval::logging_bench::replay_synthetic_activities;
+use tracing_subscriber::{EnvFilter, prelude::*};
+
+const ACTIVITIES: u64 = 100_000;
+
+fn run(name: &str, mode: LoggerMode, threads: u32) {
+	set_logger_mode(mode);
+	let start = Instant::now();
+	replay_synthetic_activities(ACTIVITIES, threads);
+	let produced = start.elapsed();
+	flush_logger();
+	let drained = start.elapsed();
+
+	let rate = |d: Duration| ACTIVITIES as f64 / d.as_secs_f64();
+	println!(
+		"{name:<22} threads={threads:<3} producers: {:>10.0} act/s, drained: {:>10.0} act/s",
+		rate(produced),
+		rate(drained),
+	);
+}
+
+fn main() {
+	tracing_subscriber::registry()
+		.with(
+			tracing_subscriber::fmt::layer()
+				.with_writer(std::io::sink)
+				.with_filter(EnvFilter::new("debug")),
+		)
+		.init();
+	nix_eval::init_libraries();
+
+	let buffered = |backpressure| LoggerMode::Buffered {
+		ring_capacity: 1 << 20,
+		backpressure,
+	};
+	for threads in [1, 4, 16] {
+		run("sync", LoggerMode::Sync, threads);
+		run("buffered/block", buffered(Backpressure::Block), threads);
+		run(
+			"buffered/drop-progress",
+			buffered(Backpressure::DropProgress),
+			threads,
+		);
+	}
+	set_logger_mode(LoggerMode::Sync);
+}
@@ -0,0 +1,91 @@
+//! Conversion of a large attribute set to a Rust value, by walking the nix value directly
+//! (`Value::as_json`), compared with the `builtins.toJSON` round trip it replaced.
+//!
+//! The attribute set is shaped like the `secrets` option of a host with 200 secrets.
+//!
+//! Run with `cargo bench -p nix-eval --bench value_serde`.
+use std::collections::BTreeMap;
+use std::time::{Duration, Instant};
+
+use nix_eval::{Result, Value};
+use serde::Deserialize;
+
+const ROUNDS: u32 = 50;
+
+const SECRETS: &str = r#"
+builtins.listToAttrs (builtins.genList (i: let name = "secret-${toString i}"; in {
+	inherit name;
+	value = {
+		shared = i / 4 * 4 == i;
+		owners = [ "host-a" "host-b" ];
+		group = "root";
+		mode = "0440";
+		generator = null;
+		expectedGenerationData = { inherit name; version = i; };
+		parts = builtins.listToAttrs (map (part: {
+			name = part;
+			value = {
+				encrypted = part == "secret";
+				raw = builtins.concatStringsSep "" (builtins.genList (_: "${name}-${part}") 8);
+				path = "/run/secrets/${name}/${part}";
+				stablePath = "/run/secrets/${name}/${part}.stable";
+			};
+		}) [ "secret" "public" "cert" ]);
+	};
+}) 200)
+"#;
+
+#[derive(Deserialize)]
+#[serde(rename_all = "camelCase")]
+#[allow(dead_code)]
+struct Secret {
+	shared: bool,
+	owners: Vec<String>,
+	generator: Option<String>,
+	expected_generation_data: serde_json::Value,
+	parts: BTreeMap<String, Part>,
+}
+#[derive(Deserialize)]
+#[serde(rename_all = "camelCase")]
+#[allow(dead_code)]
+struct Part {
+	encrypted: bool,
+	raw: String,
+	path: String,
+}
+
+fn to_json_round_trip(v: &Value) -> Result<BTreeMap<String, Secret>> {
+	let to_json = Value::eval("builtins.toJSON")?;
+	let s = to_json.call(v.clone())?.to_string()?;
+	Ok(serde_json::from_str(&s)?)
+}
+
+fn measure(name: &str, f: impl Fn() -> Result<BTreeMap<String, Secret>>) -> Result<()> {
+	let mut times = (0..ROUNDS)
+		.map(|_| {
+			let start = Instant::now();
+			let secrets = f()?;
+			assert_eq!(secrets.len(), 200);
+			Ok(start.elapsed())
+		})
+		.collect::<Result<Vec<Duration>>>()?;
+	times.sort();
+	println!(
+		"{name:<16} median {:?}, min {:?}",
+		times[times.len() / 2],
+		times[0],
+	);
+	Ok(())
+}
+
+fn main() -> Result<()> {
+	nix_eval::init_libraries();
+
+	let secrets = Value::eval(SECRETS)?;
+	// Force the whole value once, so only the conversion is measured
+	to_json_round_trip(&secrets)?;
+
+	measure("builtins.toJSON", || to_json_round_trip(&secrets))?;
+	measure("value walker", || secrets.as_json())?;
+	Ok(())
+}
@@ -23,6 +23,7 @@ fn main() {
 		"nix-flake",
 		"nix-fetchers",
 		"bdw-gc",
+		"libzstd",
 	] {
 		if let Ok(library) = pkg_config::probe_library(lib) {
 			for lib_path in library.libs {
@@ -36,8 +37,20 @@ fn main() {
 
 	cxx_build::bridge("src/logging.rs")
 		.file("src/logging.cc")
+		.file("src/logging_buffered.cc")
+		.file("src/logging_build_logs.cc")
+		.file("src/logging_recorder.cc")
+		.file("src/logging_timings.cc")
+		.file("src/logging_transfers.cc")
 		.std("c++23")
 		.compile("nix-eval-logging");
+	// Logger benchmark drivers are kept out of the library
+	if std::env::var_os("CARGO_FEATURE_BENCH").is_some() {
+		cxx_build::bridge("src/logging_bench.rs")
+			.file("src/logging_bench.cc")
+			.std("c++23")
+			.compile("nix-eval-logging-bench");
+	}
 	cxx_build::bridge("src/lib.rs")
 		.file("src/lib.cc")
 		.std("c++23")
@@ -47,6 +60,14 @@ fn main() {
 	println!("cargo:rerun-if-changed=src/lib.hh");
 	println!("cargo:rerun-if-changed=src/logging.cc");
 	println!("cargo:rerun-if-changed=src/logging.hh");
+	println!("cargo:rerun-if-changed=src/logging_buffered.cc");
+	println!("cargo:rerun-if-changed=src/logging_build_logs.cc");
+	println!("cargo:rerun-if-changed=src/logging_internal.hh");
+	println!("cargo:rerun-if-changed=src/logging_recorder.cc");
+	println!("cargo:rerun-if-changed=src/logging_timings.cc");
+	println!("cargo:rerun-if-changed=src/logging_transfers.cc");
+	println!("cargo:rerun-if-changed=src/logging_bench.cc");
+	println!("cargo:rerun-if-changed=src/logging_bench.hh");
 
 	//
 	let mut libnix = bindgen::builder()
@@ -0,0 +1,224 @@
+//! Spans for nix activities, which carry their argument only in the text, like
+//! "copying '/some/path' to the store".
+//!
+//! Patterns are listed in [`PATTERNS`], and are matched with a radix trie of their prefixes, so
+//! the text is scanned once regardless of the number of patterns.
+use std::sync::LazyLock;
+
+use tracing::{Span, debug_span};
+
+use crate::logging::{ActivityType, parse_drv};
+
+pub(crate) struct TextPattern {
+	pub ty: ActivityType,
+	pub prefix: &'static str,
+	/// Text following the argument, `None` if the text should be equal to the prefix.
+	pub suffix: Option<&'static str>,
+	pub span: fn(&str) -> Span,
+}
+impl TextPattern {
+	/// Argument of the pattern, given the text following the prefix.
+	fn capture<'s>(&self, ty: ActivityType, rest: &'s str) -> Option<&'s str> {
+		if self.ty != ty {
+			return None;
+		}
+		match self.suffix {
+			Some(suffix) if rest.len() >= suffix.len() => {
+				let (arg, tail) = rest.split_at_checked(rest.len() - suffix.len())?;
+				same_bytes(tail.as_bytes(), suffix.as_bytes()).then_some(arg)
+			}
+			Some(_) => None,
+			None => rest.is_empty().then_some(rest),
+		}
+	}
+}
+
+/// Patterns are short, comparing them inline is cheaper than calling memcmp.
+fn same_bytes(a: &[u8], b: &[u8]) -> bool {
+	a.len() == b.len() && a.iter().zip(b).all(|(a, b)| a == b)
+}
+
+pub(crate) static PATTERNS: &[TextPattern] = &[
+	TextPattern {
+		ty: ActivityType::Unknown,
+		prefix: "copying \"",
+		suffix: Some("\" to the store"),
+		span: |tree| debug_span!(target: "nix::trees", "copying", tree),
+	},
+	TextPattern {
+		ty: ActivityType::Unknown,
+		prefix: "copying '",
+		suffix: Some("' to the store"),
+		span: |tree| debug_span!(target: "nix::trees", "copying", tree),
+	},
+	TextPattern {
+		ty: ActivityType::Unknown,
+		prefix: "hashing '",
+		suffix: Some("'"),
+		span: |tree| debug_span!(target: "nix::trees", "hashing", tree),
+	},
+	TextPattern {
+		ty: ActivityType::Unknown,
+		prefix: "connecting to '",
+		suffix: Some("'"),
+		span: |host| debug_span!(target: "nix::remote", "connecting", host),
+	},
+	TextPattern {
+		ty: ActivityType::Unknown,
+		prefix: "copying outputs from '",
+		suffix: Some("'"),
+		span: |host| debug_span!(target: "nix::remote", "copying outputs", host),
+	},
+	TextPattern {
+		ty: ActivityType::Unknown,
+		prefix: "copying dependencies to '",
+		suffix: Some("'"),
+		span: |host| debug_span!(target: "nix::remote", "copying dependencies", host),
+	},
+	TextPattern {
+		ty: ActivityType::Unknown,
+		prefix: "waiting for the upload lock to '",
+		suffix: Some("'"),
+		span: |host| debug_span!(target: "nix::remote", "waiting for upload lock", host),
+	},
+	TextPattern {
+		ty: ActivityType::BuildWaiting,
+		prefix: "waiting for a machine to build '",
+		suffix: Some("'"),
+		span: |drv| {
+			let drv = parse_drv(drv);
+			debug_span!(target: "nix::build-waiting", "waiting for available builder", drv)
+		},
+	},
+	TextPattern {
+		ty: ActivityType::Unknown,
+		prefix: "querying info about missing paths",
+		suffix: None,
+		span: |_| debug_span!(target: "nix::remote", "querying"),
+	},
+];
+
+#[derive(Default)]
+struct Node {
+	/// Bytes between the parent node and this one, chains of nodes with a single child and no
+	/// patterns are merged, so most of the prefix is compared at once.
+	label: Vec<u8>,
+	/// First byte of the child label, and the child index
+	children: Vec<(u8, u32)>,
+	/// Indices of patterns, whose prefix ends at this node
+	patterns: Vec<u16>,
+}
+
+struct Matcher {
+	nodes: Vec<Node>,
+}
+impl Matcher {
+	fn new(patterns: &[TextPattern]) -> Self {
+		// Trie with a byte per node first
+		let mut bytes = vec![Node::default()];
+		for (i, pattern) in patterns.iter().enumerate() {
+			let mut node = 0;
+			for b in pattern.prefix.bytes() {
+				node = match bytes[node].children.iter().find(|(c, _)| *c == b) {
+					Some((_, child)) => *child as usize,
+					None => {
+						let child = bytes.len();
+						bytes[node].children.push((b, child as u32));
+						bytes.push(Node::default());
+						child
+					}
+				};
+			}
+			bytes[node].patterns.push(i as u16);
+		}
+		let mut nodes = Vec::new();
+		Self::merge(&bytes, 0, vec![], &mut nodes);
+		Self { nodes }
+	}
+
+	fn merge(bytes: &[Node], mut node: usize, mut label: Vec<u8>, out: &mut Vec<Node>) -> u32 {
+		while bytes[node].patterns.is_empty() && bytes[node].children.len() == 1 {
+			let (b, child) = bytes[node].children[0];
+			label.push(b);
+			node = child as usize;
+		}
+		let id = out.len();
+		out.push(Node {
+			label,
+			children: vec![],
+			patterns: bytes[node].patterns.clone(),
+		});
+		for &(b, child) in &bytes[node].children {
+			let child = Self::merge(bytes, child as usize, vec![b], out);
+			out[id].children.push((b, child));
+		}
+		id as u32
+	}
+
+	/// Pattern with the longest matching prefix, and its argument.
+	fn find<'s>(&self, ty: ActivityType, s: &'s str) -> Option<(&'static TextPattern, &'s str)> {
+		let bytes = s.as_bytes();
+		let mut node = &self.nodes[0];
+		let mut depth = 0;
+		let mut found = None;
+		while bytes.len() - depth >= node.label.len()
+			&& same_bytes(&bytes[depth..depth + node.label.len()], &node.label)
+		{
+			depth += node.label.len();
+			for &i in &node.patterns {
+				let pattern = &PATTERNS[i as usize];
+				// Prefix ends at a char boundary, as it is a valid string itself
+				if let Some(arg) = pattern.capture(ty, &s[depth..]) {
+					found = Some((pattern, arg));
+				}
+			}
+			let Some(b) = bytes.get(depth) else {
+				break;
+			};
+			match node.children.iter().find(|(c, _)| c == b) {
+				Some((_, child)) => node = &self.nodes[*child as usize],
+				None => break,
+			}
+		}
+		found
+	}
+}
+
+static MATCHER: LazyLock<Matcher> = LazyLock::new(|| Matcher::new(PATTERNS));
+
+/// Finds the pattern of the activity text, and returns it with the captured argument.
+pub(crate) fn find(ty: ActivityType, s: &str) -> Option<(&'static TextPattern, &str)> {
+	MATCHER.find(ty, s)
+}
+
+#[cfg(test)]
+mod tests {
+	use super::*;
+
+	#[test]
+	fn captures_argument_of_longest_prefix() {
+		let arg = |ty, s| find(ty, s).map(|(p, arg)| (p.prefix, arg));
+		assert_eq!(
+			arg(ActivityType::Unknown, "copying '/tmp/src' to the store"),
+			Some(("copying '", "/tmp/src"))
+		);
+		assert_eq!(
+			arg(ActivityType::Unknown, "copying outputs from 'ssh://b'"),
+			Some(("copying outputs from '", "ssh://b"))
+		);
+		assert_eq!(
+			arg(ActivityType::Unknown, "querying info about missing paths"),
+			Some(("querying info about missing paths", ""))
+		);
+		assert_eq!(
+			arg(ActivityType::Unknown, "querying info about missing paths!"),
+			None
+		);
+		assert_eq!(
+			arg(ActivityType::Unknown, "waiting for a machine to build 'x'"),
+			None
+		);
+		assert_eq!(arg(ActivityType::Unknown, "copying '/tmp/src'"), None);
+		assert_eq!(arg(ActivityType::Unknown, ""), None);
+	}
+}
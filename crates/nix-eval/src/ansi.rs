@@ -0,0 +1,431 @@
+//! Terminal escape sequence filtering for nix log lines.
+//!
+//! Only SGR (color) sequences, newlines and tabs are kept, everything else that could move the
+//! cursor or otherwise corrupt the output is removed. Output is the same as what running the line
+//! through `vte::Parser` produces, only the parts of its state machine that affect the result are
+//! implemented.
+use std::borrow::Cow;
+use std::fmt::Write as _;
+use std::str;
+
+const ESC: u8 = 0x1b;
+
+/// Removes control characters and non-color escape sequences.
+///
+/// Most of the lines have nothing to remove, they are returned without copying.
+pub(crate) fn filter(s: &str) -> Cow<'_, str> {
+	if is_plain(s.as_bytes()) {
+		Cow::Borrowed(s)
+	} else {
+		let mut filter = Filter {
+			out: String::with_capacity(s.len()),
+			..Filter::default()
+		};
+		filter.advance(s.as_bytes());
+		Cow::Owned(filter.out)
+	}
+}
+
+const ONES: u64 = u64::from_ne_bytes([0x01; 8]);
+const HIGH_BITS: u64 = u64::from_ne_bytes([0x80; 8]);
+
+/// Nonzero if any byte of the word is less than `n`, which should be at most 0x80.
+fn has_less(word: u64, n: u8) -> u64 {
+	word.wrapping_sub(ONES * n as u64) & !word & HIGH_BITS
+}
+fn has_byte(word: u64, b: u8) -> u64 {
+	has_less(word ^ (ONES * b as u64), 1)
+}
+
+/// Whether the byte at `i` would be passed to the output as is.
+fn is_plain_at(bytes: &[u8], i: usize) -> bool {
+	match bytes[i] {
+		b'\n' | b'\t' => true,
+		0x00..=0x1f => false,
+		// C1 controls are U+0080..=U+009F
+		0xc2 => bytes.get(i + 1).is_none_or(|next| *next >= 0xa0),
+		_ => true,
+	}
+}
+
+/// Looks for C0 controls (ESC included) and C1 controls, 8 bytes at a time.
+fn is_plain(bytes: &[u8]) -> bool {
+	let words = bytes.len() / 8;
+	for w in 0..words {
+		let start = w * 8;
+		let word = u64::from_ne_bytes(
+			bytes[start..start + 8]
+				.try_into()
+				.expect("slice has 8 bytes"),
+		);
+		if has_less(word, 0x20) | has_byte(word, 0xc2) != 0
+			&& !(start..start + 8).all(|i| is_plain_at(bytes, i))
+		{
+			return false;
+		}
+	}
+	(words * 8..bytes.len()).all(|i| is_plain_at(bytes, i))
+}
+
+#[derive(Clone, Copy, Default, PartialEq, Eq)]
+enum State {
+	#[default]
+	Ground,
+	Escape,
+	EscapeIntermediate,
+	CsiEntry,
+	CsiParam,
+	CsiIntermediate,
+	CsiIgnore,
+	DcsEntry,
+	DcsParam,
+	DcsIntermediate,
+	DcsPassthrough,
+	DcsIgnore,
+	OscString,
+	SosPmApcString,
+}
+
+const MAX_PARAMS: usize = 32;
+
+/// CSI parameters, grouped the same way as in `vte::Params`, sequences with more than
+/// `MAX_PARAMS` values are truncated.
+#[derive(Default)]
+struct Params {
+	/// Number of values in the group, stored at the index of the first group value.
+	group_len: [u8; MAX_PARAMS],
+	values: [u16; MAX_PARAMS],
+	/// Number of values in the unfinished group.
+	current: u8,
+	len: usize,
+}
+impl Params {
+	fn is_full(&self) -> bool {
+		self.len == MAX_PARAMS
+	}
+	fn clear(&mut self) {
+		self.current = 0;
+		self.len = 0;
+	}
+	/// Adds the last value of the current group.
+	fn push(&mut self, value: u16) {
+		self.group_len[self.len - self.current as usize] = self.current + 1;
+		self.values[self.len] = value;
+		self.current = 0;
+		self.len += 1;
+	}
+	/// Adds a value to the current group, separated from the next one by ':'.
+	fn extend(&mut self, value: u16) {
+		self.group_len[self.len - self.current as usize] = self.current + 1;
+		self.values[self.len] = value;
+		self.current += 1;
+		self.len += 1;
+	}
+	fn write(&self, out: &mut String) {
+		let mut i = 0;
+		while i < self.len {
+			if i != 0 {
+				out.push(';');
+			}
+			let group = &self.values[i..i + self.group_len[i] as usize];
+			for (j, value) in group.iter().enumerate() {
+				if j != 0 {
+					out.push(':');
+				}
+				let _ = write!(out, "{value}");
+			}
+			i += group.len();
+		}
+	}
+}
+
+#[derive(Default)]
+struct Filter {
+	state: State,
+	params: Params,
+	param: u16,
+	out: String,
+}
+impl Filter {
+	fn advance(&mut self, bytes: &[u8]) {
+		let mut i = 0;
+		while i < bytes.len() {
+			if self.state == State::Ground {
+				i += self.advance_ground(&bytes[i..]);
+			} else {
+				self.advance_byte(bytes[i]);
+				i += 1;
+			}
+		}
+	}
+
+	/// Consumes text up to and including the next ESC, returns the number of consumed bytes.
+	fn advance_ground(&mut self, bytes: &[u8]) -> usize {
+		let plain = bytes.iter().position(|b| *b == ESC).unwrap_or(bytes.len());
+		// Input is always valid utf-8, but DCS string may end in the middle of a character
+		let (text, consumed) = match str::from_utf8(&bytes[..plain]) {
+			Ok(text) => (text, plain),
+			Err(e) => {
+				let valid = str::from_utf8(&bytes[..e.valid_up_to()]).expect("valid prefix");
+				self.print(valid);
+				return match e.error_len() {
+					Some(len) => {
+						// Single C1 byte is executed, which means removed
+						if len != 1 || bytes[valid.len()] > 0x9f {
+							self.out.push(char::REPLACEMENT_CHARACTER);
+						}
+						valid.len() + len
+					}
+					None if plain < bytes.len() => {
+						self.out.push(char::REPLACEMENT_CHARACTER);
+						self.enter_escape();
+						plain + 1
+					}
+					// Truncated character at the end of input is never printed
+					None => bytes.len(),
+				};
+			}
+		};
+		self.print(text);
+		if consumed < bytes.len() {
+			self.enter_escape();
+			return consumed + 1;
+		}
+		consumed
+	}
+
+	fn print(&mut self, text: &str) {
+		let mut run = 0;
+		for (i, c) in text.char_indices() {
+			if matches!(c, '\x00'..='\x1f' | '\u{80}'..='\u{9f}') {
+				self.out.push_str(&text[run..i]);
+				self.execute(c as u8);
+				run = i + c.len_utf8();
+			}
+		}
+		self.out.push_str(&text[run..]);
+	}
+
+	fn execute(&mut self, byte: u8) {
+		// We don't want \r, bells, etc
+		if byte == b'\n' || byte == b'\t' {
+			self.out.push(byte as char);
+		}
+	}
+
+	fn enter_escape(&mut self) {
+		self.params.clear();
+		self.param = 0;
+		self.state = State::Escape;
+	}
+
+	fn anywhere(&mut self, byte: u8) {
+		match byte {
+			0x18 | 0x1a => self.state = State::Ground,
+			ESC => self.enter_escape(),
+			_ => {}
+		}
+	}
+
+	fn advance_byte(&mut self, byte: u8) {
+		use State::*;
+		match (self.state, byte) {
+			(Ground, _) => unreachable!("ground is handled by advance_ground"),
+
+			(Escape, 0x00..=0x17 | 0x19 | 0x1c..=0x1f) => self.execute(byte),
+			(Escape, 0x20..=0x2f) => self.state = EscapeIntermediate,
+			(Escape, 0x50) => self.state = DcsEntry,
+			(Escape, 0x58 | 0x5e | 0x5f) => self.state = SosPmApcString,
+			(Escape, 0x5b) => self.state = CsiEntry,
+			(Escape, 0x5d) => self.state = OscString,
+			(Escape, 0x30..=0x7e) => self.state = Ground,
+			(Escape, 0x18 | 0x1a) => self.state = Ground,
+			(Escape, _) => {}
+
+			(EscapeIntermediate, 0x00..=0x17 | 0x19 | 0x1c..=0x1f) => self.execute(byte),
+			(EscapeIntermediate, 0x20..=0x2f | 0x7f) => {}
+			(EscapeIntermediate, 0x30..=0x7e) => self.state = Ground,
+
+			(
+				CsiEntry | CsiParam | CsiIntermediate | CsiIgnore,
+				0x00..=0x17 | 0x19 | 0x1c..=0x1f,
+			) => self.execute(byte),
+			(CsiEntry | CsiParam, 0x20..=0x2f) => self.state = CsiIntermediate,
+			(CsiEntry | CsiParam, 0x30..=0x39) => {
+				if !self.params.is_full() {
+					self.param = self
+						.param
+						.saturating_mul(10)
+						.saturating_add((byte - b'0') as u16);
+				}
+				self.state = CsiParam;
+			}
+			(CsiEntry | CsiParam, 0x3a) => {
+				if !self.params.is_full() {
+					self.params.extend(self.param);
+					self.param = 0;
+				}
+				self.state = CsiParam;
+			}
+			(CsiEntry | CsiParam, 0x3b) => {
+				if !self.params.is_full() {
+					self.params.push(self.param);
+					self.param = 0;
+				}
+				self.state = CsiParam;
+			}
+			// Private markers are dropped, but parameters are still collected
+			(CsiEntry, 0x3c..=0x3f) => self.state = CsiParam,
+			(CsiParam, 0x3c..=0x3f) => self.state = CsiIgnore,
+			(CsiEntry | CsiParam | CsiIntermediate, 0x40..=0x7e) => self.csi_dispatch(byte),
+			(CsiParam | CsiIgnore, 0x7f) => {}
+			(CsiIntermediate, 0x20..=0x2f) => {}
+			(CsiIntermediate, 0x30..=0x3f) => self.state = CsiIgnore,
+			(CsiIgnore, 0x20..=0x3f) => {}
+			(CsiIgnore, 0x40..=0x7e) => self.state = Ground,
+
+			(DcsEntry | DcsParam | DcsIntermediate, 0x00..=0x17 | 0x19 | 0x1c..=0x1f | 0x7f) => {}
+			(DcsEntry | DcsParam, 0x20..=0x2f) => self.state = DcsIntermediate,
+			(DcsEntry | DcsParam, 0x30..=0x3b) => self.state = DcsParam,
+			(DcsEntry, 0x3c..=0x3f) => self.state = DcsParam,
+			(DcsParam, 0x3c..=0x3f) => self.state = DcsIgnore,
+			(DcsIntermediate, 0x20..=0x2f) => {}
+			(DcsIntermediate, 0x30..=0x3f) => self.state = DcsIgnore,
+			(DcsEntry | DcsParam | DcsIntermediate, 0x40..=0x7e) => self.state = DcsPassthrough,
+
+			(DcsPassthrough, 0x18 | 0x1a | 0x9c) => self.state = Ground,
+			(DcsPassthrough, ESC) => self.enter_escape(),
+			(DcsPassthrough, _) => {}
+
+			(OscString, 0x07 | 0x18 | 0x1a) => self.state = Ground,
+			(OscString, ESC) => self.enter_escape(),
+			(OscString, _) => {}
+
+			(_, _) => self.anywhere(byte),
+		}
+	}
+
+	fn csi_dispatch(&mut self, action: u8) {
+		if !self.params.is_full() {
+			self.params.push(self.param);
+		}
+		// Only plain colors are enabled, everything other might corrupt the output
+		if action == b'm' {
+			self.out.push_str("\x1b[");
+			self.params.write(&mut self.out);
+			self.out.push('m');
+		}
+		self.state = State::Ground;
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use super::*;
+
+	/// Lines were passed to the previous implementation in chunks of this size.
+	const VTE_CHUNK: usize = 50;
+
+	/// Previous implementation, used as the reference.
+	fn vte_filter(i: &str, chunk: usize) -> String {
+		struct AnsiFiltered {
+			output: String,
+		}
+		impl vte::Perform for AnsiFiltered {
+			fn print(&mut self, c: char) {
+				self.output.push(c);
+			}
+			fn execute(&mut self, byte: u8) {
+				if byte == b'\n' || byte == b'\t' {
+					self.output.push(byte as char);
+				}
+			}
+			fn csi_dispatch(
+				&mut self,
+				params: &vte::Params,
+				_intermediates: &[u8],
+				_ignore: bool,
+				action: char,
+			) {
+				if action != 'm' {
+					return;
+				}
+				self.output.push_str("\x1b[");
+				for (i, par) in params.iter().enumerate() {
+					if i != 0 {
+						self.output.push(';');
+					}
+					for (i, sub) in par.iter().enumerate() {
+						if i != 0 {
+							self.output.push(':');
+						}
+						let _ = write!(self.output, "{sub}");
+					}
+				}
+				self.output.push(action);
+			}
+		}
+		let mut out = AnsiFiltered {
+			output: String::new(),
+		};
+		let mut parser = vte::Parser::new();
+		for chunk in i.as_bytes().chunks(chunk) {
+			parser.advance(&mut out, chunk);
+		}
+		out.output
+	}
+
+	#[test]
+	fn plain_lines_are_borrowed() {
+		for line in [
+			"",
+			"building '/nix/store/xxx-hello.drv'",
+			"\ttab\tseparated\n",
+			"unicode: ©°±µ — ✓ 😀, and DEL \x7f",
+		] {
+			assert!(matches!(filter(line), Cow::Borrowed(_)), "{line:?}");
+		}
+	}
+
+	#[test]
+	fn keeps_only_colors() {
+		assert_eq!(
+			filter("\x1b[1;31merror:\x1b[0m x"),
+			"\x1b[1;31merror:\x1b[0m x"
+		);
+		assert_eq!(filter("\x1b[m\x1b[38:2:1:2:3m"), "\x1b[0m\x1b[38:2:1:2:3m");
+		assert_eq!(filter("50%\r\x1b[2K\x1b[1G60%"), "50%60%");
+		assert_eq!(filter("\x1b]0;title\x07text\u{85}"), "text");
+	}
+
+	#[test]
+	fn matches_vte() {
+		const FRAGMENTS: &[&str] = &[
+			"\x1b", "\x1b[", "\x1b]", "\x1bP", "\x1bX", "\x1b(", "[", "]", "0", "1", "38", "65536",
+			";", ":", "m", "K", "?", " ", "!", "\x07", "\x18", "\x1a", "\x7f", "\n", "\t", "\r",
+			"\x00", "\u{85}", "\u{9c}", "Ĝ", "é", "€", "😀", "building", "a", "\\",
+		];
+		let mut seed = 0x2545_f491_4f6c_dd1d_u64;
+		let mut next = move || {
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			seed
+		};
+		let mut line = String::new();
+		for _ in 0..100_000 {
+			line.clear();
+			for _ in 0..next() % 120 {
+				line.push_str(FRAGMENTS[(next() % FRAGMENTS.len() as u64) as usize]);
+			}
+			// When a character is split between chunks, vte prints it even if it is a C1
+			// control, and may skip the few bytes after it. Such lines are compared to
+			// the output of a single chunk instead.
+			let split = (VTE_CHUNK..line.len())
+				.step_by(VTE_CHUNK)
+				.any(|i| !line.is_char_boundary(i));
+			let chunk = if split { line.len().max(1) } else { VTE_CHUNK };
+			assert_eq!(filter(&line), vte_filter(&line, chunk), "{line:?}");
+		}
+	}
+}
@@ -0,0 +1,79 @@
+//! Reader for build logs, stored with [`crate::logging::open_build_log_store`].
+//!
+//! Store layout is described next to `BuildLogStore` in logging_build_logs.cc.
+use std::path::{Path, PathBuf};
+use std::time::{Duration, SystemTime};
+
+use anyhow::{Context, Result, bail};
+
+use crate::logging::{nix_logging_cxx, parse_drv};
+
+pub struct BuildLogEntry {
+	/// Fleet host, for which the derivation was built, empty if unknown.
+	pub owner: String,
+	pub drv_path: String,
+	pub file: PathBuf,
+	pub started: SystemTime,
+	pub lines: u64,
+}
+impl BuildLogEntry {
+	/// Matches full drv path, drv file name or derivation name.
+	pub fn matches_drv(&self, drv: &str) -> bool {
+		let name = parse_drv(&self.drv_path);
+		self.drv_path == drv || name == drv || name.strip_suffix(".drv") == Some(drv)
+	}
+
+	/// Decompressed build output.
+	pub fn read(&self) -> Result<Vec<u8>> {
+		let Some(path) = self.file.to_str() else {
+			bail!("non-utf8 build log path: {}", self.file.display());
+		};
+		let mut reader = nix_logging_cxx::open_build_log(path)?;
+		let mut out = Vec::new();
+		loop {
+			let chunk = reader.pin_mut().read()?;
+			if chunk.is_empty() {
+				break Ok(out);
+			}
+			out.extend_from_slice(chunk);
+		}
+	}
+}
+
+/// Index entries of the store, the latest build of a derivation is the last one.
+pub fn read_index(dir: &Path) -> Result<Vec<BuildLogEntry>> {
+	let index = dir.join("index");
+	let data =
+		std::fs::read_to_string(&index).with_context(|| format!("reading {}", index.display()))?;
+	let mut out = Vec::new();
+	for (i, line) in data.lines().enumerate() {
+		let mut fields = line.split('\t');
+		let (Some(owner), Some(drv_path), Some(file), Some(started), Some(lines), None) = (
+			fields.next(),
+			fields.next(),
+			fields.next(),
+			fields.next(),
+			fields.next(),
+			fields.next(),
+		) else {
+			bail!("malformed line {} in {}", i + 1, index.display());
+		};
+		out.push(BuildLogEntry {
+			owner: owner.to_owned(),
+			drv_path: drv_path.to_owned(),
+			file: dir.join(file),
+			started: SystemTime::UNIX_EPOCH
+				+ Duration::from_secs(started.parse().context("start time")?),
+			lines: lines.parse().context("line count")?,
+		});
+	}
+	Ok(out)
+}
+
+/// Latest stored build of the derivation for the host.
+pub fn find(dir: &Path, owner: &str, drv: &str) -> Result<Option<BuildLogEntry>> {
+	Ok(read_index(dir)?
+		.into_iter()
+		.rev()
+		.find(|e| e.owner == owner && e.matches_drv(drv)))
+}
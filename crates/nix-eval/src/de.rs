@@ -0,0 +1,612 @@
+//! Serde deserializers of nix values.
+use std::borrow::Cow;
+use std::fmt;
+use std::slice;
+
+use serde::de::{
+	self, DeserializeSeed, EnumAccess, IntoDeserializer, MapAccess, SeqAccess, VariantAccess,
+	Visitor,
+};
+use serde::forward_to_deserialize_any;
+
+use crate::nix_cxx::{ValueToken, ValueTokenKind, ValueTokens};
+use crate::{NixType, Value};
+
+#[derive(Debug, thiserror::Error)]
+#[error("{0}")]
+pub struct Error(String);
+impl de::Error for Error {
+	fn custom<T: fmt::Display>(msg: T) -> Self {
+		Self(msg.to_string())
+	}
+}
+fn nix<T>(r: anyhow::Result<T>) -> Result<T, Error> {
+	r.map_err(|e| Error(format!("{e:#}")))
+}
+
+/// Deserializer over a value flattened by `walk_value` in lib.cc, the value should be kept alive
+/// while it is used, as strings are referenced from it.
+pub(crate) struct TokenDeserializer<'t> {
+	tokens: &'t [ValueToken],
+	strings: &'t [String],
+	pos: usize,
+}
+impl<'t> TokenDeserializer<'t> {
+	pub(crate) fn new(tokens: &'t ValueTokens) -> Self {
+		Self {
+			tokens: &tokens.tokens,
+			strings: &tokens.strings,
+			pos: 0,
+		}
+	}
+	fn next(&mut self) -> Result<&'t ValueToken, Error> {
+		let token = self
+			.tokens
+			.get(self.pos)
+			.ok_or_else(|| Error("unexpected end of value".to_owned()))?;
+		self.pos += 1;
+		Ok(token)
+	}
+	fn str(&self, token: &ValueToken) -> Cow<'t, str> {
+		if token.kind == ValueTokenKind::OwnedString {
+			return Cow::Borrowed(&self.strings[token.data as usize]);
+		}
+		// Nix strings are not necessarily utf-8, builtins.toJSON replaces invalid sequences too
+		let bytes = unsafe { slice::from_raw_parts(token.data as *const u8, token.len) };
+		String::from_utf8_lossy(bytes)
+	}
+	fn visit_str<'de, V: Visitor<'de>>(
+		&self,
+		token: &ValueToken,
+		visitor: V,
+	) -> Result<V::Value, Error> {
+		match self.str(token) {
+			Cow::Borrowed(s) => visitor.visit_str(s),
+			Cow::Owned(s) => visitor.visit_string(s),
+		}
+	}
+	fn visit_entries<'de, V: Visitor<'de>>(
+		&mut self,
+		token: &ValueToken,
+		visitor: V,
+	) -> Result<V::Value, Error> {
+		let mut entries = Entries {
+			de: self,
+			left: token.len,
+		};
+		let out = if token.kind == ValueTokenKind::List {
+			visitor.visit_seq(&mut entries)?
+		} else {
+			visitor.visit_map(&mut entries)?
+		};
+		if entries.left != 0 {
+			let read = token.len - entries.left;
+			return Err(Error(format!(
+				"invalid length {}, expected {read} elements",
+				token.len
+			)));
+		}
+		Ok(out)
+	}
+}
+
+impl<'de> de::Deserializer<'de> for &mut TokenDeserializer<'_> {
+	type Error = Error;
+
+	fn deserialize_any<V: Visitor<'de>>(self, visitor: V) -> Result<V::Value, Error> {
+		let token = self.next()?;
+		match token.kind {
+			ValueTokenKind::Null => visitor.visit_unit(),
+			ValueTokenKind::Bool => visitor.visit_bool(token.data != 0),
+			ValueTokenKind::Int => visitor.visit_i64(token.data as i64),
+			ValueTokenKind::Float => visitor.visit_f64(f64::from_bits(token.data)),
+			ValueTokenKind::String | ValueTokenKind::OwnedString => self.visit_str(token, visitor),
+			ValueTokenKind::List | ValueTokenKind::Attrs => self.visit_entries(token, visitor),
+			_ => Err(Error("invalid value token".to_owned())),
+		}
+	}
+
+	fn deserialize_option<V: Visitor<'de>>(self, visitor: V) -> Result<V::Value, Error> {
+		match self.tokens.get(self.pos) {
+			Some(token) if token.kind == ValueTokenKind::Null => {
+				self.pos += 1;
+				visitor.visit_none()
+			}
+			_ => visitor.visit_some(self),
+		}
+	}
+
+	fn deserialize_newtype_struct<V: Visitor<'de>>(
+		self,
+		_name: &'static str,
+		visitor: V,
+	) -> Result<V::Value, Error> {
+		visitor.visit_newtype_struct(self)
+	}
+
+	/// Same representation as serde_json: unit variants are strings, other variants are attribute
+	/// sets with a single attribute.
+	fn deserialize_enum<V: Visitor<'de>>(
+		self,
+		_name: &'static str,
+		_variants: &'static [&'static str],
+		visitor: V,
+	) -> Result<V::Value, Error> {
+		let token = self.next()?;
+		match token.kind {
+			ValueTokenKind::String | ValueTokenKind::OwnedString => {
+				visitor.visit_enum(self.str(token).into_owned().into_deserializer())
+			}
+			ValueTokenKind::Attrs if token.len == 1 => visitor.visit_enum(Variant { de: self }),
+			_ => Err(Error(
+				"invalid type: expected string or attribute set with a single attribute".to_owned(),
+			)),
+		}
+	}
+
+	forward_to_deserialize_any! {
+		bool i8 i16 i32 i64 i128 u8 u16 u32 u64 u128 f32 f64 char str string
+		bytes byte_buf unit unit_struct seq tuple
+		tuple_struct map struct identifier ignored_any
+	}
+}
+
+struct Entries<'d, 't> {
+	de: &'d mut TokenDeserializer<'t>,
+	left: usize,
+}
+impl<'de> SeqAccess<'de> for Entries<'_, '_> {
+	type Error = Error;
+
+	fn next_element_seed<T: DeserializeSeed<'de>>(
+		&mut self,
+		seed: T,
+	) -> Result<Option<T::Value>, Error> {
+		if self.left == 0 {
+			return Ok(None);
+		}
+		self.left -= 1;
+		seed.deserialize(&mut *self.de).map(Some)
+	}
+	fn size_hint(&self) -> Option<usize> {
+		Some(self.left)
+	}
+}
+impl<'de> MapAccess<'de> for Entries<'_, '_> {
+	type Error = Error;
+
+	fn next_key_seed<K: DeserializeSeed<'de>>(
+		&mut self,
+		seed: K,
+	) -> Result<Option<K::Value>, Error> {
+		if self.left == 0 {
+			return Ok(None);
+		}
+		self.left -= 1;
+		seed.deserialize(&mut *self.de).map(Some)
+	}
+	fn next_value_seed<V: DeserializeSeed<'de>>(&mut self, seed: V) -> Result<V::Value, Error> {
+		seed.deserialize(&mut *self.de)
+	}
+	fn size_hint(&self) -> Option<usize> {
+		Some(self.left)
+	}
+}
+
+struct Variant<'d, 't> {
+	de: &'d mut TokenDeserializer<'t>,
+}
+impl<'de> EnumAccess<'de> for Variant<'_, '_> {
+	type Error = Error;
+	type Variant = Self;
+
+	fn variant_seed<V: DeserializeSeed<'de>>(self, seed: V) -> Result<(V::Value, Self), Error> {
+		let variant = seed.deserialize(&mut *self.de)?;
+		Ok((variant, self))
+	}
+}
+impl<'de> VariantAccess<'de> for Variant<'_, '_> {
+	type Error = Error;
+
+	fn unit_variant(self) -> Result<(), Error> {
+		de::Deserialize::deserialize(self.de)
+	}
+	fn newtype_variant_seed<T: DeserializeSeed<'de>>(self, seed: T) -> Result<T::Value, Error> {
+		seed.deserialize(self.de)
+	}
+	fn tuple_variant<V: Visitor<'de>>(self, _len: usize, visitor: V) -> Result<V::Value, Error> {
+		de::Deserializer::deserialize_seq(self.de, visitor)
+	}
+	fn struct_variant<V: Visitor<'de>>(
+		self,
+		_fields: &'static [&'static str],
+		visitor: V,
+	) -> Result<V::Value, Error> {
+		de::Deserializer::deserialize_map(self.de, visitor)
+	}
+}
+
+/// Value, which is only forced when it is deserialized.
+enum Lazy {
+	Forced(Value),
+	Field(Value, String),
+	Elem(Value, usize),
+}
+impl Lazy {
+	fn force(self) -> Result<Value, Error> {
+		match self {
+			Self::Forced(v) => Ok(v),
+			Self::Field(attrs, name) => nix(attrs.get_field(name.as_str())),
+			Self::Elem(list, i) => nix(list.get_elem(i)),
+		}
+	}
+}
+
+/// How builtins.toJSON converts an attribute set.
+enum Attrs {
+	/// Has `__toString`, the conversion is left to `walk_value`
+	ToString,
+	/// Derivation, or another set with `outPath`
+	OutPath(Value),
+	/// Attribute names in lexicographic order
+	Fields(Vec<String>),
+}
+impl Attrs {
+	fn new(v: &Value) -> Result<Self, Error> {
+		if nix(v.has_field("__toString"))? {
+			return Ok(Self::ToString);
+		}
+		if nix(v.has_field("outPath"))? {
+			return nix(v.get_field("outPath")).map(Self::OutPath);
+		}
+		let mut names = nix(v.list_fields())?;
+		names.sort_unstable();
+		Ok(Self::Fields(names))
+	}
+}
+
+/// Deserializer, which walks the value with separate FFI calls, and only forces the deserialized
+/// parts of it: struct fields are looked up by name, and ignored values are not forced.
+///
+/// Conversions match [`TokenDeserializer`], and values it can't convert itself (paths, sets with
+/// `__toString`...) are converted by `walk_value`.
+pub(crate) struct LazyDeserializer(Lazy);
+impl LazyDeserializer {
+	pub(crate) fn new(value: Value) -> Self {
+		Self(Lazy::Forced(value))
+	}
+	fn eager<'de, V: Visitor<'de>>(v: &Value, visitor: V) -> Result<V::Value, Error> {
+		let tokens = nix(v.walk())?;
+		de::Deserializer::deserialize_any(&mut TokenDeserializer::new(&tokens), visitor)
+	}
+	fn visit_attrs<'de, V: Visitor<'de>>(
+		v: Value,
+		fields: Option<&[&str]>,
+		visitor: V,
+	) -> Result<V::Value, Error> {
+		match Attrs::new(&v)? {
+			Attrs::ToString => Self::eager(&v, visitor),
+			Attrs::OutPath(out) => de::Deserializer::deserialize_any(Self::new(out), visitor),
+			Attrs::Fields(mut names) => {
+				if let Some(fields) = fields {
+					names.retain(|n| fields.contains(&n.as_str()));
+				}
+				visitor.visit_map(LazyMap {
+					attrs: v,
+					names: names.into_iter(),
+					current: None,
+				})
+			}
+		}
+	}
+}
+
+impl<'de> de::Deserializer<'de> for LazyDeserializer {
+	type Error = Error;
+
+	fn deserialize_any<V: Visitor<'de>>(self, visitor: V) -> Result<V::Value, Error> {
+		let v = self.0.force()?;
+		match v.type_of() {
+			NixType::Null => visitor.visit_unit(),
+			NixType::Bool => visitor.visit_bool(nix(v.to_bool())?),
+			NixType::Int => visitor.visit_i64(nix(v.to_int())?),
+			NixType::Float => visitor.visit_f64(nix(v.to_float())?),
+			NixType::String => visitor.visit_string(nix(v.to_string())?),
+			NixType::List => {
+				let len = nix(v.list_len())?;
+				visitor.visit_seq(LazySeq {
+					list: v,
+					next: 0,
+					len,
+				})
+			}
+			NixType::Attrs => Self::visit_attrs(v, None, visitor),
+			_ => Self::eager(&v, visitor),
+		}
+	}
+
+	fn deserialize_struct<V: Visitor<'de>>(
+		self,
+		_name: &'static str,
+		fields: &'static [&'static str],
+		visitor: V,
+	) -> Result<V::Value, Error> {
+		let v = self.0.force()?;
+		if v.type_of() == NixType::Attrs {
+			return Self::visit_attrs(v, Some(fields), visitor);
+		}
+		de::Deserializer::deserialize_any(Self::new(v), visitor)
+	}
+
+	fn deserialize_option<V: Visitor<'de>>(self, visitor: V) -> Result<V::Value, Error> {
+		let v = self.0.force()?;
+		if v.is_null() {
+			visitor.visit_none()
+		} else {
+			visitor.visit_some(Self::new(v))
+		}
+	}
+
+	fn deserialize_newtype_struct<V: Visitor<'de>>(
+		self,
+		_name: &'static str,
+		visitor: V,
+	) -> Result<V::Value, Error> {
+		visitor.visit_newtype_struct(self)
+	}
+
+	fn deserialize_enum<V: Visitor<'de>>(
+		self,
+		_name: &'static str,
+		_variants: &'static [&'static str],
+		visitor: V,
+	) -> Result<V::Value, Error> {
+		let v = self.0.force()?;
+		match v.type_of() {
+			NixType::String => visitor.visit_enum(nix(v.to_string())?.into_deserializer()),
+			NixType::Attrs => match nix(v.list_fields())?.as_mut_slice() {
+				[name] => {
+					let name = std::mem::take(name);
+					visitor.visit_enum(LazyVariant { attrs: v, name })
+				}
+				_ => Err(Error(
+					"invalid type: expected string or attribute set with a single attribute"
+						.to_owned(),
+				)),
+			},
+			_ => Self::eager(&v, visitor),
+		}
+	}
+
+	fn deserialize_ignored_any<V: Visitor<'de>>(self, visitor: V) -> Result<V::Value, Error> {
+		visitor.visit_unit()
+	}
+
+	forward_to_deserialize_any! {
+		bool i8 i16 i32 i64 i128 u8 u16 u32 u64 u128 f32 f64 char str string
+		bytes byte_buf unit unit_struct seq tuple
+		tuple_struct map identifier
+	}
+}
+
+struct LazySeq {
+	list: Value,
+	next: usize,
+	len: usize,
+}
+impl<'de> SeqAccess<'de> for LazySeq {
+	type Error = Error;
+
+	fn next_element_seed<T: DeserializeSeed<'de>>(
+		&mut self,
+		seed: T,
+	) -> Result<Option<T::Value>, Error> {
+		if self.next == self.len {
+			return Ok(None);
+		}
+		self.next += 1;
+		let elem = Lazy::Elem(self.list.clone(), self.next - 1);
+		seed.deserialize(LazyDeserializer(elem)).map(Some)
+	}
+	fn size_hint(&self) -> Option<usize> {
+		Some(self.len - self.next)
+	}
+}
+
+struct LazyMap {
+	attrs: Value,
+	names: std::vec::IntoIter<String>,
+	current: Option<String>,
+}
+impl<'de> MapAccess<'de> for LazyMap {
+	type Error = Error;
+
+	fn next_key_seed<K: DeserializeSeed<'de>>(
+		&mut self,
+		seed: K,
+	) -> Result<Option<K::Value>, Error> {
+		let Some(name) = self.names.next() else {
+			return Ok(None);
+		};
+		let key = seed.deserialize(name.as_str().into_deserializer())?;
+		self.current = Some(name);
+		Ok(Some(key))
+	}
+	fn next_value_seed<V: DeserializeSeed<'de>>(&mut self, seed: V) -> Result<V::Value, Error> {
+		let name = self
+			.current
+			.take()
+			.expect("value is requested after its key");
+		seed.deserialize(LazyDeserializer(Lazy::Field(self.attrs.clone(), name)))
+	}
+	fn size_hint(&self) -> Option<usize> {
+		Some(self.names.len())
+	}
+}
+
+struct LazyVariant {
+	attrs: Value,
+	name: String,
+}
+impl LazyVariant {
+	fn content(self) -> LazyDeserializer {
+		LazyDeserializer(Lazy::Field(self.attrs, self.name))
+	}
+}
+impl<'de> EnumAccess<'de> for LazyVariant {
+	type Error = Error;
+	type Variant = Self;
+
+	fn variant_seed<V: DeserializeSeed<'de>>(self, seed: V) -> Result<(V::Value, Self), Error> {
+		let variant = seed.deserialize(self.name.as_str().into_deserializer())?;
+		Ok((variant, self))
+	}
+}
+impl<'de> VariantAccess<'de> for LazyVariant {
+	type Error = Error;
+
+	fn unit_variant(self) -> Result<(), Error> {
+		Ok(())
+	}
+	fn newtype_variant_seed<T: DeserializeSeed<'de>>(self, seed: T) -> Result<T::Value, Error> {
+		seed.deserialize(self.content())
+	}
+	fn tuple_variant<V: Visitor<'de>>(self, _len: usize, visitor: V) -> Result<V::Value, Error> {
+		de::Deserializer::deserialize_seq(self.content(), visitor)
+	}
+	fn struct_variant<V: Visitor<'de>>(
+		self,
+		fields: &'static [&'static str],
+		visitor: V,
+	) -> Result<V::Value, Error> {
+		de::Deserializer::deserialize_struct(self.content(), "", fields, visitor)
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use std::collections::BTreeMap;
+	use std::fmt::Debug;
+
+	use serde::Deserialize;
+	use serde::de::DeserializeOwned;
+
+	use super::*;
+
+	/// Flattens the value the way `walk_value` does: attribute names are referenced, string
+	/// values are owned by the tokens. Referenced strings point into `value`.
+	fn push_tokens(value: &serde_json::Value, out: &mut ValueTokens) {
+		let token = |kind, len, data| ValueToken { kind, len, data };
+		let referenced = |s: &str| token(ValueTokenKind::String, s.len(), s.as_ptr() as u64);
+		match value {
+			serde_json::Value::Null => out.tokens.push(token(ValueTokenKind::Null, 0, 0)),
+			serde_json::Value::Bool(b) => {
+				out.tokens.push(token(ValueTokenKind::Bool, 0, *b as u64))
+			}
+			serde_json::Value::Number(n) => out.tokens.push(match n.as_i64() {
+				Some(i) => token(ValueTokenKind::Int, 0, i as u64),
+				None => token(
+					ValueTokenKind::Float,
+					0,
+					n.as_f64().expect("finite").to_bits(),
+				),
+			}),
+			serde_json::Value::String(s) => {
+				out.tokens.push(token(
+					ValueTokenKind::OwnedString,
+					0,
+					out.strings.len() as u64,
+				));
+				out.strings.push(s.clone());
+			}
+			serde_json::Value::Array(elems) => {
+				out.tokens.push(token(ValueTokenKind::List, elems.len(), 0));
+				for elem in elems {
+					push_tokens(elem, out);
+				}
+			}
+			serde_json::Value::Object(attrs) => {
+				out.tokens
+					.push(token(ValueTokenKind::Attrs, attrs.len(), 0));
+				for (name, value) in attrs {
+					out.tokens.push(referenced(name));
+					push_tokens(value, out);
+				}
+			}
+		}
+	}
+
+	/// Deserializes the same json with both deserializers, they should agree on the result, or
+	/// both fail.
+	fn assert_same<T: DeserializeOwned + PartialEq + Debug>(json: &str) {
+		let value: serde_json::Value = serde_json::from_str(json).expect("valid json");
+		let mut tokens = ValueTokens {
+			tokens: vec![],
+			strings: vec![],
+		};
+		push_tokens(&value, &mut tokens);
+		let ours = T::deserialize(&mut TokenDeserializer::new(&tokens));
+		let theirs = serde_json::from_str::<T>(json);
+		match (ours, theirs) {
+			(Ok(ours), Ok(theirs)) => assert_eq!(ours, theirs, "{json}"),
+			(Err(_), Err(_)) => {}
+			(ours, theirs) => panic!("{json}: {ours:?}, serde_json: {theirs:?}"),
+		}
+	}
+
+	#[derive(Deserialize, Debug, PartialEq)]
+	struct Optional {
+		set: Option<u32>,
+		null: Option<String>,
+		#[serde(default)]
+		missing: Option<bool>,
+		nested: Option<Option<i64>>,
+	}
+
+	#[derive(Deserialize, Debug, PartialEq)]
+	#[serde(rename_all = "camelCase")]
+	enum Kind {
+		Unit,
+		Newtype(u32),
+		Tuple(i32, String),
+		Struct { enabled: bool },
+	}
+
+	#[test]
+	fn options() {
+		assert_same::<Optional>(r#"{"set": 1, "null": null, "nested": 2}"#);
+		assert_same::<Optional>(r#"{"set": null, "null": "a", "nested": null}"#);
+		assert_same::<Option<Vec<u8>>>("null");
+		assert_same::<Option<Vec<u8>>>("[1, 2]");
+	}
+
+	#[test]
+	fn enums() {
+		assert_same::<Kind>(r#""unit""#);
+		assert_same::<Kind>(r#"{"newtype": 3}"#);
+		assert_same::<Kind>(r#"{"tuple": [-1, "a"]}"#);
+		assert_same::<Kind>(r#"{"struct": {"enabled": true}}"#);
+		assert_same::<Vec<Kind>>(r#"["unit", {"newtype": 0}]"#);
+		assert_same::<Kind>(r#""other""#);
+		assert_same::<Kind>(r#"{"unit": null, "newtype": 1}"#);
+		assert_same::<Kind>("1");
+	}
+
+	#[test]
+	fn nested_maps() {
+		assert_same::<BTreeMap<String, BTreeMap<String, Vec<f64>>>>(
+			r#"{"a": {"x": [1.5, -2], "y": []}, "b": {}}"#,
+		);
+		assert_same::<BTreeMap<String, serde_json::Value>>(
+			r#"{"a": {"b": [null, true, "c", {"d": 0.25}]}, "e": 1}"#,
+		);
+	}
+
+	#[test]
+	fn length_errors() {
+		assert_same::<(u32, u32)>("[1, 2]");
+		assert_same::<(u32, u32)>("[1]");
+		assert_same::<(u32, u32)>("[1, 2, 3]");
+		assert_same::<[String; 1]>(r#"["a", "b"]"#);
+	}
+}
@@ -1,10 +1,13 @@
-use std::collections::{HashMap, HashSet, VecDeque};
-use std::ffi::CString;
+use std::path::PathBuf;
+use std::sync::Arc;
 
 use anyhow::{Result, bail};
-use serde::Deserialize;
+use tokio::sync::Semaphore;
+use tokio::task::spawn_blocking;
+use tracing::Span;
 
-use crate::nix_raw::{derivation_free, derivation_to_json, store_drv_from_store_path};
+use crate::nix_cxx::DrvClosure;
+pub use crate::nix_cxx::{BuildPlan, DrvBuildResult};
 use crate::{copy_nix_str, with_store_context};
 
 fn store_dir() -> Result<String> {
@@ -23,128 +26,191 @@ fn to_absolute_store_path(store_dir: &str, path: &str) -> String {
 	}
 }
 
-pub struct Derivation(*mut crate::nix_raw::derivation);
-unsafe impl Send for Derivation {}
-
-impl Derivation {
-	pub fn from_path(drv_path: &str) -> Result<Self> {
-		let path_c = CString::new(drv_path)?;
-		let store_path = with_store_context(|c, store, _| unsafe {
-			crate::nix_raw::store_parse_path(c, store, path_c.as_ptr())
-		})?;
-		let drv = with_store_context(|c, store, _| unsafe {
-			store_drv_from_store_path(c, store, store_path)
-		});
-		unsafe { crate::nix_raw::store_path_free(store_path) };
-		let drv = drv?;
-		if drv.is_null() {
-			bail!("failed to read derivation from {drv_path}");
-		}
-		Ok(Self(drv))
-	}
-
-	pub fn to_json_string(&self) -> Result<String> {
-		let mut out = String::new();
-		with_store_context(|c, _, _| unsafe {
-			derivation_to_json(c, self.0, Some(copy_nix_str), (&raw mut out).cast())
-		})?;
-		Ok(out)
-	}
-
-	pub fn parsed(&self) -> Result<DrvParsed> {
-		let s = self.to_json_string()?;
-		Ok(serde_json::from_str(&s)?)
-	}
+/// Finds what should be built and substituted to get all outputs of `drv_paths`, in a single
+/// store query, so paths shared by several derivations are only counted once.
+pub fn query_missing(drv_paths: &[String]) -> Result<BuildPlan> {
+	Ok(with_store_context(|_, store, _| unsafe {
+		crate::nix_cxx::query_missing(store.cast(), drv_paths)
+	})??)
 }
 
-impl Drop for Derivation {
-	fn drop(&mut self) {
-		unsafe { derivation_free(self.0) };
-	}
+/// Builds `output` of every derivation in a single store call, so nix schedules them as one job
+/// set: shared dependencies are built once, and builds of all derivations fill the `max-jobs`
+/// slots. Results are in the order of `drv_paths`.
+///
+/// Failed builds don't stop the others if nix `keep-going` setting is set.
+pub fn build_drv_paths(drv_paths: &[String], output: &str) -> Result<Vec<DrvBuildResult>> {
+	Ok(with_store_context(|_, store, _| unsafe {
+		crate::nix_cxx::build_drv_paths(store.cast(), drv_paths, output)
+	})??)
 }
 
-#[derive(Debug, Deserialize)]
-pub struct DrvParsed {
-	pub inputs: DrvInputs,
-	pub outputs: HashMap<String, serde_json::Value>,
-}
-
-#[derive(Debug, Deserialize)]
-pub struct DrvInputs {
-	#[serde(default)]
-	pub srcs: Vec<String>,
-	#[serde(default)]
-	pub drvs: HashMap<String, DrvInputEntry>,
+impl DrvBuildResult {
+	pub fn out_path(&self) -> Result<PathBuf> {
+		if !self.error.is_empty() {
+			bail!("failed to build {}: {}", self.drv_path, self.error);
+		}
+		Ok(PathBuf::from(&self.out_path))
+	}
 }
 
-#[derive(Debug, Deserialize)]
-pub struct DrvInputEntry {
-	pub outputs: Vec<String>,
+/// Copies closures to other stores, like `nix copy --to`, but in-process.
+///
+/// Destination stores are opened once per uri, and reused by later copies until the last clone
+/// of the copier is dropped, so a copier should live as long as a single deploy.
+#[derive(Clone)]
+pub struct ClosureCopier(Arc<CopierState>);
+struct CopierState {
+	stores: cxx::UniquePtr<crate::nix_cxx::CopyStores>,
+	permits: Semaphore,
+	repair: bool,
 }
+// Stores are locked by lib.cc
+unsafe impl Send for CopierState {}
+unsafe impl Sync for CopierState {}
+
+impl ClosureCopier {
+	/// Copies up to `concurrency` closures at once, every copy also copies paths in parallel.
+	/// With `repair`, paths which are corrupted or missing on the destination are copied again.
+	pub fn new(concurrency: usize, repair: bool) -> Self {
+		Self(Arc::new(CopierState {
+			stores: crate::nix_cxx::new_copy_stores(),
+			permits: Semaphore::new(concurrency.max(1)),
+			repair,
+		}))
+	}
 
-#[derive(Debug)]
-pub struct DrvGraph {
-	pub root: String,
-	pub nodes: HashMap<String, DrvNode>,
+	/// Copies closure of `paths` to the store at `uri` (`ssh-ng://host`...).
+	///
+	/// Progress is logged in the current span, and copy activities are owned by `owner`, see
+	/// [`crate::logging::build_log_owner`].
+	pub async fn copy_closure(
+		&self,
+		uri: String,
+		paths: Vec<String>,
+		substitute: bool,
+		check_sigs: bool,
+		owner: String,
+	) -> Result<()> {
+		let _permit = self
+			.0
+			.permits
+			.acquire()
+			.await
+			.expect("copy semaphore is never closed");
+		let span = Span::current();
+		let state = self.0.clone();
+		spawn_blocking(move || {
+			let _span = span.enter();
+			let _owner = crate::logging::build_log_owner(&owner);
+			Ok(with_store_context(|_, store, _| unsafe {
+				crate::nix_cxx::copy_closure(
+					store.cast(),
+					&state.stores,
+					&uri,
+					&paths,
+					substitute,
+					check_sigs,
+					state.repair,
+				)
+			})??)
+		})
+		.await
+		.expect("closure copy should not panic")
+	}
 }
 
-#[derive(Debug)]
-pub struct DrvNode {
-	pub name: String,
-	pub input_drvs: HashMap<String, Vec<String>>,
-	pub input_srcs: Vec<String>,
-	pub outputs: Vec<String>,
-}
+/// Derivation closure, nodes are numbered in discovery order, and the root is [`DrvGraph::ROOT`].
+///
+/// Paths and edges are stored in a few flat buffers, as NixOS systems have closures of thousands
+/// of derivations.
+#[derive(Debug, Default)]
+pub struct DrvGraph(DrvClosure);
 
 impl DrvGraph {
+	pub const ROOT: u32 = 0;
+
+	/// Reads the closure of `drv_path` from the store, with a thread per core.
 	pub fn resolve(drv_path: &str) -> Result<Self> {
-		let sd = store_dir()?;
-		let root = to_absolute_store_path(&sd, drv_path);
-
-		let mut nodes = HashMap::new();
-		let mut queue = VecDeque::new();
-		let mut visited = HashSet::new();
-		queue.push_back(root.clone());
-		visited.insert(root.clone());
-
-		while let Some(path) = queue.pop_front() {
-			let drv = Derivation::from_path(&path)?;
-			let parsed = drv.parsed()?;
-
-			let input_drvs: HashMap<String, Vec<String>> = parsed
-				.inputs
-				.drvs
-				.into_iter()
-				.map(|(k, v)| (to_absolute_store_path(&sd, &k), v.outputs))
-				.collect();
-
-			for dep_path in input_drvs.keys() {
-				if visited.insert(dep_path.clone()) {
-					queue.push_back(dep_path.clone());
-				}
-			}
-
-			nodes.insert(
-				path.clone(),
-				DrvNode {
-					name: extract_drv_name(&path),
-					input_drvs,
-					input_srcs: parsed.inputs.srcs,
-					outputs: parsed.outputs.into_keys().collect(),
-				},
-			);
-		}
+		Self::resolve_with_threads(drv_path, 0)
+	}
+	/// Reads the closure of `drv_path` from the store, with up to `threads` concurrent reads, or a
+	/// thread per core if zero.
+	pub fn resolve_with_threads(drv_path: &str, threads: u32) -> Result<Self> {
+		let root = to_absolute_store_path(&store_dir()?, drv_path);
+		let closure = with_store_context(|_, store, _| unsafe {
+			crate::nix_cxx::read_drv_closure(store.cast(), &root, threads)
+		})??;
+		Ok(Self(closure))
+	}
 
-		Ok(Self { root, nodes })
+	/// Adds a derivation, and returns its node. `inputs` may refer to nodes, which are not added
+	/// yet. Only used to build synthetic graphs.
+	#[cfg(any(test, feature = "bench"))]
+	pub fn push(&mut self, path: &str, inputs: &[u32], outputs: &[&str]) -> u32 {
+		let c = &mut self.0;
+		let id = c.nodes.len() as u32;
+		let path_start = c.strings.len() as u32;
+		c.strings.push_str(path);
+		let outputs_start = c.strings.len() as u32;
+		c.strings.push_str(&outputs.join(" "));
+		let inputs_start = c.inputs.len() as u32;
+		c.inputs.extend_from_slice(inputs);
+		c.nodes.push(crate::nix_cxx::DrvClosureNode {
+			path_start,
+			path_end: outputs_start,
+			inputs_start,
+			inputs_end: c.inputs.len() as u32,
+			outputs_start,
+			outputs_end: c.strings.len() as u32,
+			out_paths_start: c.strings.len() as u32,
+			out_paths_end: c.strings.len() as u32,
+		});
+		id
+	}
+
+	pub fn len(&self) -> usize {
+		self.0.nodes.len()
+	}
+	pub fn is_empty(&self) -> bool {
+		self.0.nodes.is_empty()
+	}
+
+	fn str(&self, start: u32, end: u32) -> &str {
+		&self.0.strings[start as usize..end as usize]
+	}
+	pub fn path(&self, node: u32) -> &str {
+		let n = &self.0.nodes[node as usize];
+		self.str(n.path_start, n.path_end)
+	}
+	pub fn name(&self, node: u32) -> &str {
+		extract_drv_name(self.path(node))
+	}
+	/// Input derivations of the node
+	pub fn inputs(&self, node: u32) -> &[u32] {
+		let n = &self.0.nodes[node as usize];
+		&self.0.inputs[n.inputs_start as usize..n.inputs_end as usize]
+	}
+	pub fn outputs(&self, node: u32) -> impl Iterator<Item = &str> {
+		let n = &self.0.nodes[node as usize];
+		self.str(n.outputs_start, n.outputs_end)
+			.split(' ')
+			.filter(|o| !o.is_empty())
+	}
+	/// Output paths of the node, content-addressed outputs are only known after the build.
+	pub fn out_paths(&self, node: u32) -> impl Iterator<Item = &str> {
+		let n = &self.0.nodes[node as usize];
+		self.str(n.out_paths_start, n.out_paths_end)
+			.split(' ')
+			.filter(|o| !o.is_empty())
 	}
 }
 
-fn extract_drv_name(drv_path: &str) -> String {
+fn extract_drv_name(drv_path: &str) -> &str {
 	drv_path
 		.rsplit('/')
 		.next()
 		.and_then(|f| f.strip_suffix(".drv"))
 		.and_then(|f| f.split_once('-').map(|(_, name)| name))
 		.unwrap_or(drv_path)
-		.to_owned()
 }
@@ -1,17 +1,471 @@
 #include "nix-eval/src/lib.rs"
 #include "lib.hh"
+#include <nix/expr/eval-inline.hh>
 #include <nix/fetchers/fetch-settings.hh>
+#include <nix/flake/flake.hh>
+#include <nix/store/derivations.hh>
+#include <nix/store/derived-path.hh>
+#include <nix/store/store-api.hh>
+#include <nix/util/config-global.hh>
 #include <nix/util/ref.hh>
+#include <nix/util/sync.hh>
+#include <nix/util/thread-pool.hh>
+#include <nix_api_expr_internal.h>
 #include <nix_api_fetchers.h>
+#include <nix_api_store_internal.h>
+#include <nix_api_value.h>
+
+#include <bit>
+#include <deque>
+#include <functional>
+#include <map>
+#include <unordered_map>
 
 struct nix_fetchers_settings {
   nix::ref<nix::fetchers::Settings> settings;
 };
+struct nix_locked_flake {
+  nix::ref<nix::flake::LockedFlake> lockedFlake;
+};
+
+// Applies every setting to the first of fetcher, eval and global (store, file
+// transfer...) settings, which knows its name. Returns unknown settings with
+// an empty error, and settings with invalid values.
+rust::Vec<RejectedSetting>
+apply_settings(nix_fetchers_settings *fetchers, nix_eval_state_builder *builder,
+               bool global, rust::Slice<const NixSetting> settings) {
+  rust::Vec<RejectedSetting> rejected;
+  for (auto &setting : settings) {
+    std::string name(setting.name);
+    std::string value(setting.value);
+    try {
+      bool applied = (fetchers && fetchers->settings->set(name, value)) ||
+                     (builder && (builder->settings.set(name, value) ||
+                                  builder->fetchSettings.set(name, value))) ||
+                     (global && nix::globalConfig.set(name, value));
+      if (!applied) {
+        rejected.push_back(RejectedSetting{.name = setting.name});
+      }
+    } catch (nix::Error &e) {
+      rejected.push_back(RejectedSetting{
+          .name = setting.name,
+          .error = rust::String::lossy(e.info().msg.str()),
+      });
+    } catch (std::exception &e) {
+      rejected.push_back(RejectedSetting{
+          .name = setting.name,
+          .error = rust::String::lossy(e.what()),
+      });
+    }
+  }
+  return rejected;
+}
+
+// Lists attributes of a forced attribute set in bindings order. Names point
+// into the symbol table, which lives as long as the evaluator. With `values`,
+// attribute values are forced and referenced, like by nix_get_attr_byname.
+rust::Vec<AttrEntry> list_attrs(EvalState *state, nix_value *value,
+                                bool values) {
+  auto &v = *reinterpret_cast<nix::Value *>(value);
+  if (v.type() != nix::nAttrs) {
+    throw nix::Error("value is not an attribute set");
+  }
+  auto &attrs = *v.attrs();
+  if (values) {
+    // Every value is forced before any reference is taken, so a failure
+    // doesn't leak references
+    for (auto &attr : attrs) {
+      state->state.forceValue(*attr.value, attr.pos);
+    }
+  }
+  rust::Vec<AttrEntry> out;
+  out.reserve(attrs.size());
+  for (auto &attr : attrs) {
+    std::string_view name = state->state.symbols[attr.name];
+    if (values) {
+      nix_gc_incref(nullptr, attr.value);
+    }
+    out.push_back(AttrEntry{
+        .name = reinterpret_cast<size_t>(name.data()),
+        .name_len = name.size(),
+        .value = values ? reinterpret_cast<size_t>(attr.value) : 0,
+    });
+  }
+  return out;
+}
+
+namespace {
+// Flattens a value into tokens in the visiting order, forcing it deeply.
+// Conversions match builtins.toJSON: paths are copied to the store, and
+// attribute sets with __toString or outPath are converted to strings.
+struct ValueWalker {
+  nix::EvalState &state;
+  ValueTokens out;
+  nix::NixStringContext context;
+
+  void push(ValueTokenKind kind, size_t len = 0, uint64_t data = 0) {
+    out.tokens.push_back(ValueToken{.kind = kind, .len = len, .data = data});
+  }
+  // String is owned by the value, or by the symbol table
+  void string(std::string_view s) {
+    push(ValueTokenKind::String, s.size(),
+         reinterpret_cast<uint64_t>(s.data()));
+  }
+  void ownedString(const std::string &s) {
+    push(ValueTokenKind::OwnedString, 0, out.strings.size());
+    out.strings.push_back(rust::String::lossy(s));
+  }
+
+  void walk(nix::Value &v, nix::PosIdx pos) {
+    state.forceValue(v, pos);
+    switch (v.type()) {
+    case nix::nNull:
+      push(ValueTokenKind::Null);
+      break;
+    case nix::nBool:
+      push(ValueTokenKind::Bool, 0, v.boolean());
+      break;
+    case nix::nInt:
+      push(ValueTokenKind::Int, 0, static_cast<uint64_t>(v.integer().value));
+      break;
+    case nix::nFloat:
+      push(ValueTokenKind::Float, 0, std::bit_cast<uint64_t>(v.fpoint()));
+      break;
+    case nix::nString:
+      string(v.string_view());
+      break;
+    case nix::nPath:
+      ownedString(state.store->printStorePath(
+          state.copyPathToStore(context, v.path())));
+      break;
+    case nix::nList:
+      push(ValueTokenKind::List, v.listSize());
+      for (auto *elem : v.listItems()) {
+        walk(*elem, pos);
+      }
+      break;
+    case nix::nAttrs: {
+      if (auto s = state.tryAttrsToString(pos, v, context, false, false)) {
+        ownedString(*s);
+        break;
+      }
+      if (auto *outPath = v.attrs()->get(state.sOutPath)) {
+        walk(*outPath->value, outPath->pos);
+        break;
+      }
+      auto attrs = v.attrs()->lexicographicOrder(state.symbols);
+      push(ValueTokenKind::Attrs, attrs.size());
+      for (auto *attr : attrs) {
+        string(state.symbols[attr->name]);
+        walk(*attr->value, attr->pos);
+      }
+      break;
+    }
+    default:
+      state
+          .error<nix::TypeError>("cannot convert %1% to JSON",
+                                 nix::showType(v))
+          .atPos(pos)
+          .debugThrow();
+    }
+  }
+};
+} // namespace
+
+ValueTokens walk_value(EvalState *state, nix_value *value) {
+  ValueWalker walker{.state = state->state};
+  walker.walk(*reinterpret_cast<nix::Value *>(value), nix::noPos);
+  return std::move(walker.out);
+}
 
-extern "C" {
-void set_fetcher_setting(nix_fetchers_settings *settings_struct,
-                         const char *setting, const char *value) {
-  auto &settings_ref = settings_struct->settings;
-  bool result = settings_ref->set(setting, value);
+namespace {
+std::vector<nix::DerivedPath>
+drvTargets(nix::Store &s, rust::Slice<const rust::String> drvPaths,
+           nix::OutputsSpec outputs) {
+  std::vector<nix::DerivedPath> targets;
+  targets.reserve(drvPaths.size());
+  for (auto &path : drvPaths) {
+    targets.push_back(nix::DerivedPath::Built{
+        .drvPath = nix::makeConstantStorePathRef(
+            s.parseStorePath(std::string(path))),
+        .outputs = outputs,
+    });
+  }
+  return targets;
 }
+} // namespace
+
+BuildPlan query_missing(Store *store,
+                        rust::Slice<const rust::String> drvPaths) {
+  auto &s = *store->ptr;
+  auto targets = drvTargets(s, drvPaths, nix::OutputsSpec::All{});
+
+  nix::StorePathSet willBuild, willSubstitute, unknown;
+  BuildPlan plan;
+  s.queryMissing(targets, willBuild, willSubstitute, unknown,
+                 plan.download_size, plan.nar_size);
+  auto fill = [&](rust::Vec<rust::String> &out, const nix::StorePathSet &in) {
+    out.reserve(in.size());
+    for (auto &path : in) {
+      out.push_back(s.printStorePath(path));
+    }
+  };
+  fill(plan.will_build, willBuild);
+  fill(plan.will_substitute, willSubstitute);
+  fill(plan.unknown, unknown);
+  return plan;
+}
+
+// Builds `output` of every derivation with a single worker, so nix schedules
+// them as one job set: shared dependencies are built once, and builds of
+// different derivations fill all `max-jobs` slots. Failures are returned per
+// derivation, with `keep-going` unset the first one cancels the rest.
+rust::Vec<DrvBuildResult>
+build_drv_paths(Store *store, rust::Slice<const rust::String> drvPaths,
+                rust::Str output) {
+  auto &s = *store->ptr;
+  auto targets = drvTargets(s, drvPaths,
+                            nix::OutputsSpec::Names{std::string(output)});
+  auto results = s.buildPathsWithResults(targets, nix::bmNormal);
+  if (results.size() != targets.size()) {
+    throw nix::Error("expected %d build results, got %d", targets.size(),
+                     results.size());
+  }
+
+  rust::Vec<DrvBuildResult> out;
+  out.reserve(results.size());
+  for (size_t i = 0; i < results.size(); i++) {
+    auto &result = results[i];
+    DrvBuildResult r{.drv_path = drvPaths[i]};
+    if (!result.success()) {
+      r.error = rust::String::lossy(
+          result.errorMsg.empty() ? result.toString() : result.errorMsg);
+    } else if (auto built = result.builtOutputs.find(std::string(output));
+               built != result.builtOutputs.end()) {
+      r.out_path = s.printStorePath(built->second.outPath);
+    } else {
+      r.error = "output was not built";
+    }
+    out.push_back(std::move(r));
+  }
+  return out;
+}
+
+std::unique_ptr<CopyStores> new_copy_stores() {
+  return std::make_unique<CopyStores>();
+}
+
+namespace {
+nix::ref<nix::Store> openCopyStore(const CopyStores &copyStores,
+                                   const std::string &uri) {
+  if (auto stores(copyStores.stores.lock()); stores->contains(uri)) {
+    return stores->at(uri);
+  }
+  // Opening may connect to the host, other stores are not blocked meanwhile
+  auto store = nix::openStore(uri);
+  return copyStores.stores.lock()->try_emplace(uri, store).first->second;
+}
+} // namespace
+
+// In-process `nix copy --to <uri>`, progress is reported through the
+// installed logger, as copy activities of the calling thread.
+void copy_closure(Store *store, const CopyStores &stores, rust::Str uri,
+                  rust::Slice<const rust::String> paths, bool substitute,
+                  bool checkSigs, bool repair) {
+  auto &s = *store->ptr;
+  auto dst = openCopyStore(stores, std::string(uri));
+  nix::StorePathSet storePaths;
+  for (auto &path : paths) {
+    storePaths.insert(s.parseStorePath(std::string(path)));
+  }
+  nix::copyClosure(s, *dst, storePaths, repair ? nix::Repair : nix::NoRepair,
+                   checkSigs ? nix::CheckSigs : nix::NoCheckSigs,
+                   substitute ? nix::Substitute : nix::NoSubstitute);
+}
+
+namespace {
+struct ClosureNode {
+  nix::StorePath path;
+  std::vector<uint32_t> inputs;
+  std::vector<std::string> outputs;
+  std::vector<std::string> outPaths;
+};
+struct ClosureState {
+  std::unordered_map<nix::StorePath, uint32_t> ids;
+  // Indexed by id, deque keeps references stable while nodes are added
+  std::deque<ClosureNode> nodes;
+
+  // Returns the id of `path`, and whether it was just added
+  std::pair<uint32_t, bool> add(const nix::StorePath &path) {
+    auto [it, added] = ids.try_emplace(path, nodes.size());
+    if (added) {
+      nodes.push_back(ClosureNode{.path = path});
+    }
+    return {it->second, added};
+  }
+};
+} // namespace
+
+DrvClosure read_drv_closure(Store *store, rust::Str root, uint32_t threads) {
+  auto &s = *store->ptr;
+  auto rootPath = s.parseStorePath(std::string(root));
+  nix::Sync<ClosureState> state_;
+  state_.lock()->add(rootPath);
+
+  // Derivations are read by the pool, every newly seen input is queued
+  nix::ThreadPool pool(threads);
+  std::function<void(uint32_t, nix::StorePath)> read =
+      [&](uint32_t id, nix::StorePath path) {
+        auto drv = s.readDerivation(path);
+        std::vector<std::string> outputs;
+        std::vector<std::string> outPaths;
+        for (auto &[name, output] : drv.outputs) {
+          outputs.push_back(name);
+          // Unknown for content-addressed outputs
+          if (auto outPath = output.path(s, drv.name, name)) {
+            outPaths.push_back(s.printStorePath(*outPath));
+          }
+        }
+        std::vector<uint32_t> inputs;
+        std::vector<std::pair<uint32_t, nix::StorePath>> added;
+        {
+          auto state(state_.lock());
+          for (auto &[input, _] : drv.inputDrvs.map) {
+            auto [inputId, isNew] = state->add(input);
+            inputs.push_back(inputId);
+            if (isNew) {
+              added.emplace_back(inputId, input);
+            }
+          }
+          auto &node = state->nodes[id];
+          node.inputs = std::move(inputs);
+          node.outputs = std::move(outputs);
+          node.outPaths = std::move(outPaths);
+        }
+        for (auto &[inputId, input] : added) {
+          pool.enqueue([&read, inputId, input] { read(inputId, input); });
+        }
+      };
+  pool.enqueue([&] { read(0, rootPath); });
+  pool.process();
+
+  auto state(state_.lock());
+  DrvClosure out;
+  std::string strings;
+  out.nodes.reserve(state->nodes.size());
+  for (auto &node : state->nodes) {
+    DrvClosureNode n;
+    n.path_start = strings.size();
+    strings += s.printStorePath(node.path);
+    n.path_end = strings.size();
+    n.inputs_start = out.inputs.size();
+    for (auto input : node.inputs) {
+      out.inputs.push_back(input);
+    }
+    n.inputs_end = out.inputs.size();
+    n.outputs_start = strings.size();
+    for (auto &name : node.outputs) {
+      if (strings.size() != n.outputs_start) {
+        strings += ' ';
+      }
+      strings += name;
+    }
+    n.outputs_end = strings.size();
+    n.out_paths_start = strings.size();
+    for (auto &path : node.outPaths) {
+      if (strings.size() != n.out_paths_start) {
+        strings += ' ';
+      }
+      strings += path;
+    }
+    n.out_paths_end = strings.size();
+    out.nodes.push_back(n);
+  }
+  out.strings = rust::String(strings);
+  return out;
+}
+
+// Same cache as `nix eval` uses for flake outputs, but with `root` at the top,
+// and the flake fingerprint mixed with `salt`, so entries don't collide with
+// outputs cached by nix itself.
+//
+// Unlike nix, pure evaluation is not required, the caller puts whatever else
+// `root` depends on into `salt`.
+std::unique_ptr<FlakeEvalCache> open_eval_cache(EvalState *state,
+                                                nix_locked_flake *flake,
+                                                nix_value *root,
+                                                rust::Str salt) {
+  auto &s = state->state;
+  std::optional<nix::Hash> key;
+  if (s.settings.useEvalCache) {
+    auto fingerprint =
+        flake->lockedFlake->getFingerprint(s.store, s.fetchSettings);
+    if (fingerprint) {
+      key = nix::hashString(
+          nix::HashAlgorithm::SHA256,
+          fingerprint->to_string(nix::HashFormat::Base16, false) + ";" +
+              std::string(salt));
+    }
+  }
+  auto rootValue = reinterpret_cast<nix::Value *>(root);
+  auto out = std::make_unique<FlakeEvalCache>(s);
+  *out->cache.lock() = std::make_shared<nix::eval_cache::EvalCache>(
+      key ? std::optional(std::cref(*key)) : std::nullopt, s,
+      [rootValue] { return rootValue; });
+  return out;
+}
+
+FlakeEvalCache::~FlakeEvalCache() {
+  // Nix commits on destruction and has no rollback, leaving the transaction
+  // open until exit discards it
+  if (auto evalCache = std::move(*cache.lock())) {
+    new std::shared_ptr(std::move(evalCache));
+  }
+}
+
+namespace {
+nix::ref<nix::eval_cache::AttrCursor>
+findCursor(const FlakeEvalCache &cache, rust::Slice<const rust::String> path) {
+  auto evalCache = *cache.cache.lock();
+  if (!evalCache) {
+    throw nix::Error("evaluation cache is already committed");
+  }
+  auto cursor = evalCache->getRoot();
+  for (auto &name : path) {
+    cursor = cursor->getAttr(std::string_view(name.data(), name.size()));
+  }
+  return cursor;
+}
+} // namespace
+
+rust::Vec<rust::String>
+eval_cache_attr_names(const FlakeEvalCache &cache,
+                      rust::Slice<const rust::String> path) {
+  rust::Vec<rust::String> out;
+  for (auto &name : findCursor(cache, path)->getAttrs()) {
+    std::string_view str = cache.state.symbols[name];
+    out.push_back(rust::String(str.data(), str.size()));
+  }
+  return out;
+}
+
+rust::Vec<rust::String>
+eval_cache_strings(const FlakeEvalCache &cache,
+                   rust::Slice<const rust::String> path) {
+  rust::Vec<rust::String> out;
+  for (auto &str : findCursor(cache, path)->getListOfStrings()) {
+    out.push_back(rust::String::lossy(str));
+  }
+  return out;
+}
+
+rust::String eval_cache_drv_path(const FlakeEvalCache &cache,
+                                 rust::Slice<const rust::String> path) {
+  auto drvPath = findCursor(cache, path)->forceDerivation();
+  return cache.state.store->printStorePath(drvPath);
+}
+
+void commit_eval_cache(const FlakeEvalCache &cache) {
+  // Destroyed outside of the lock, once cursors of running lookups are gone
+  auto evalCache = std::move(*cache.cache.lock());
 }
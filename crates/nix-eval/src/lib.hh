@@ -1,7 +1,58 @@
 #pragma once
+#include "rust/cxx.h"
+
+#include "nix-eval/src/lib.rs"
+#include <nix/expr/eval-cache.hh>
+#include <nix/store/store-api.hh>
+#include <nix/util/sync.hh>
+#include <nix_api_expr.h>
 #include <nix_api_fetchers.h>
+#include <nix_api_flake.h>
+#include <nix_api_store.h>
+#include <nix_api_value.h>
+
+#include <map>
+
+// Nix writes evaluated entries to disk when the cache is destroyed, null after
+// `commit_eval_cache`. An uncommitted cache is leaked to discard its entries.
+struct FlakeEvalCache {
+  nix::EvalState &state;
+  mutable nix::Sync<std::shared_ptr<nix::eval_cache::EvalCache>> cache;
+  ~FlakeEvalCache();
+};
+
+// Destination stores of `copy_closure` by uri, so their connections and path
+// info caches are shared by copies, until the stores are dropped
+struct CopyStores {
+  mutable nix::Sync<std::map<std::string, nix::ref<nix::Store>>> stores;
+};
 
-extern "C" {
-void set_fetcher_setting(nix_fetchers_settings *settings, const char *setting,
-                         const char *value);
-}
+rust::Vec<RejectedSetting>
+apply_settings(nix_fetchers_settings *fetchers, nix_eval_state_builder *builder,
+               bool global, rust::Slice<const NixSetting> settings);
+rust::Vec<AttrEntry> list_attrs(EvalState *state, nix_value *value,
+                                bool values);
+ValueTokens walk_value(EvalState *state, nix_value *value);
+BuildPlan query_missing(Store *store,
+                        rust::Slice<const rust::String> drvPaths);
+rust::Vec<DrvBuildResult>
+build_drv_paths(Store *store, rust::Slice<const rust::String> drvPaths,
+                rust::Str output);
+std::unique_ptr<CopyStores> new_copy_stores();
+void copy_closure(Store *store, const CopyStores &stores, rust::Str uri,
+                  rust::Slice<const rust::String> paths, bool substitute,
+                  bool checkSigs, bool repair);
+DrvClosure read_drv_closure(Store *store, rust::Str root, uint32_t threads);
+std::unique_ptr<FlakeEvalCache> open_eval_cache(EvalState *state,
+                                                nix_locked_flake *flake,
+                                                nix_value *root,
+                                                rust::Str salt);
+rust::Vec<rust::String>
+eval_cache_attr_names(const FlakeEvalCache &cache,
+                      rust::Slice<const rust::String> path);
+rust::Vec<rust::String>
+eval_cache_strings(const FlakeEvalCache &cache,
+                   rust::Slice<const rust::String> path);
+rust::String eval_cache_drv_path(const FlakeEvalCache &cache,
+                                 rust::Slice<const rust::String> path);
+void commit_eval_cache(const FlakeEvalCache &cache);
@@ -2,7 +2,7 @@ use std::borrow::Cow;
 use std::cell::RefCell;
 use std::ffi::{CStr, CString, c_char, c_int, c_uint, c_void};
 use std::ptr::{null, null_mut};
-use std::sync::{Arc, LazyLock, OnceLock};
+use std::sync::{Arc, OnceLock};
 use std::{array, fmt, slice};
 use std::{collections::HashMap, path::PathBuf};
 
@@ -16,7 +16,7 @@ pub use anyhow::Result;
 use tracing::{Span, instrument, warn};
 
 use self::logging::{ErrorInfoBuilder, nix_logging_cxx};
-use self::nix_cxx::set_fetcher_setting;
+use self::nix_cxx::{AttrEntry, NixSetting, apply_settings, list_attrs, walk_value};
 use self::nix_raw::{
 	BindingsBuilder as c_bindings_builder, EvalState as c_eval_state, GC_SUCCESS,
 	GC_allow_register_threads, GC_get_stack_base, GC_register_my_thread, GC_stack_base,
@@ -25,14 +25,13 @@ use self::nix_raw::{
 	bindings_builder_free, bindings_builder_insert, c_context, c_context_create, c_context_free,
 	clear_err, copy_value, err_NIX_ERR_KEY, err_NIX_ERR_NIX_ERROR, err_NIX_ERR_OVERFLOW,
 	err_NIX_ERR_UNKNOWN, err_code, err_info_msg, err_msg, eval_state_build,
-	eval_state_builder_load, eval_state_builder_new, eval_state_builder_set_eval_setting,
-	expr_eval_from_string, fetchers_settings,
+	eval_state_builder_load, eval_state_builder_new, expr_eval_from_string, fetchers_settings,
 	fetchers_settings_free, fetchers_settings_new, flake_lock, flake_lock_flags,
 	flake_lock_flags_free, flake_lock_flags_new, flake_reference,
 	flake_reference_and_fragment_from_string, flake_reference_parse_flags,
 	flake_reference_parse_flags_free, flake_reference_parse_flags_new,
 	flake_reference_parse_flags_set_base_directory, flake_settings, flake_settings_free,
-	flake_settings_new, gc_now as gc_now_raw, get_attr_byname, get_attr_name_byidx, get_attrs_size,
+	flake_settings_new, gc_now as gc_now_raw, get_attr_byname, get_bool, get_float, get_int,
 	get_list_byidx, get_list_size, get_string, get_type, has_attr_byname, init_bool, init_int,
 	init_primop, init_string, libexpr_init, libstore_init, libutil_init, list_builder_free,
 	list_builder_insert, locked_flake, locked_flake_free, locked_flake_get_output_attrs,
@@ -44,10 +43,18 @@ use self::nix_raw::{
 };
 
 // Contains macros helpers
+mod activity_text;
+mod ansi;
+pub mod build_logs;
+pub mod de;
 pub mod drv;
 pub mod logging;
+#[cfg(feature = "bench")]
+#[doc(hidden)]
+pub mod logging_bench;
 #[doc(hidden)]
 pub mod macros;
+pub mod recording;
 
 #[doc(hidden)]
 pub mod __macro_support {
@@ -69,19 +76,201 @@ mod nix_raw {
 }
 #[cxx::bridge]
 pub mod nix_cxx {
+	#[derive(Clone)]
+	struct NixSetting {
+		name: String,
+		value: String,
+	}
+	/// Setting, which was not applied by `apply_settings`
+	struct RejectedSetting {
+		name: String,
+		/// Empty if there is no setting with this name
+		error: String,
+	}
+	/// Attribute returned by `list_attrs`, pointers are passed as integers
+	struct AttrEntry {
+		/// Name in the nix symbol table, not NUL-terminated
+		name: usize,
+		name_len: usize,
+		/// Referenced `nix_value`, or 0 if values weren't requested
+		value: usize,
+	}
+	#[repr(u8)]
+	enum ValueTokenKind {
+		Null,
+		Bool,
+		Int,
+		Float,
+		/// Owned by the value or by the symbol table, `data` is the pointer
+		String,
+		/// Produced by the conversion, `data` is the index in `ValueTokens::strings`
+		OwnedString,
+		/// Followed by `len` values
+		List,
+		/// Followed by `len` pairs of name string and value
+		Attrs,
+	}
+	struct ValueToken {
+		kind: ValueTokenKind,
+		len: usize,
+		/// Bool, int, float bits, or string reference
+		data: u64,
+	}
+	/// Value, flattened by `walk_value`
+	struct ValueTokens {
+		tokens: Vec<ValueToken>,
+		strings: Vec<String>,
+	}
+	/// Work needed to get outputs of a set of derivations, see [`crate::drv::query_missing`]
+	#[derive(Debug)]
+	struct BuildPlan {
+		/// Derivations to build
+		will_build: Vec<String>,
+		/// Paths to fetch from substituters
+		will_substitute: Vec<String>,
+		/// Paths, which are neither built nor substitutable
+		unknown: Vec<String>,
+		/// Compressed size of substituted paths
+		download_size: u64,
+		/// Unpacked size of substituted paths
+		nar_size: u64,
+	}
+	/// Derivation built by `build_drv_paths`, see [`crate::drv::build_drv_paths`]
+	#[derive(Debug)]
+	struct DrvBuildResult {
+		drv_path: String,
+		/// Path of the requested output, empty if the build failed
+		out_path: String,
+		/// Empty if the build succeeded
+		error: String,
+	}
+	/// Derivation in a `DrvClosure`, ranges are half-open
+	#[derive(Clone, Copy, Debug)]
+	struct DrvClosureNode {
+		/// Store path in `DrvClosure::strings`
+		path_start: u32,
+		path_end: u32,
+		/// Input derivations in `DrvClosure::inputs`
+		inputs_start: u32,
+		inputs_end: u32,
+		/// Space-separated output names in `DrvClosure::strings`
+		outputs_start: u32,
+		outputs_end: u32,
+		/// Space-separated output paths in `DrvClosure::strings`, which are known before the
+		/// build
+		out_paths_start: u32,
+		out_paths_end: u32,
+	}
+	/// Derivation closure, read by `read_drv_closure`, node 0 is the root
+	#[derive(Debug, Default)]
+	struct DrvClosure {
+		nodes: Vec<DrvClosureNode>,
+		/// Node ids of input derivations of all nodes
+		inputs: Vec<u32>,
+		/// Paths, output names and output paths of all nodes
+		strings: String,
+	}
 	unsafe extern "C++" {
 		type nix_fetchers_settings;
+		type nix_eval_state_builder;
+		type EvalState;
+		type nix_value;
+		type Store;
+		type nix_locked_flake;
+		/// Nix evaluation cache, opened by `open_eval_cache`
+		type FlakeEvalCache;
+		/// Destination stores of `copy_closure`, closed on drop
+		type CopyStores;
 		include!("nix-eval/src/lib.hh");
 
 		#[allow(clippy::missing_safety_doc)]
-		unsafe fn set_fetcher_setting(
-			settings: *mut nix_fetchers_settings,
-			setting: *const c_char,
-			value: *const c_char,
-		);
+		unsafe fn apply_settings(
+			fetchers: *mut nix_fetchers_settings,
+			builder: *mut nix_eval_state_builder,
+			global: bool,
+			settings: &[NixSetting],
+		) -> Vec<RejectedSetting>;
+		#[allow(clippy::missing_safety_doc)]
+		unsafe fn list_attrs(
+			state: *mut EvalState,
+			value: *mut nix_value,
+			values: bool,
+		) -> Result<Vec<AttrEntry>>;
+		#[allow(clippy::missing_safety_doc)]
+		unsafe fn walk_value(state: *mut EvalState, value: *mut nix_value) -> Result<ValueTokens>;
+		#[allow(clippy::missing_safety_doc)]
+		unsafe fn query_missing(store: *mut Store, drv_paths: &[String]) -> Result<BuildPlan>;
+		#[allow(clippy::missing_safety_doc)]
+		unsafe fn build_drv_paths(
+			store: *mut Store,
+			drv_paths: &[String],
+			output: &str,
+		) -> Result<Vec<DrvBuildResult>>;
+		fn new_copy_stores() -> UniquePtr<CopyStores>;
+		#[allow(clippy::missing_safety_doc)]
+		unsafe fn copy_closure(
+			store: *mut Store,
+			stores: &CopyStores,
+			uri: &str,
+			paths: &[String],
+			substitute: bool,
+			check_sigs: bool,
+			repair: bool,
+		) -> Result<()>;
+		#[allow(clippy::missing_safety_doc)]
+		unsafe fn read_drv_closure(
+			store: *mut Store,
+			root: &str,
+			threads: u32,
+		) -> Result<DrvClosure>;
+		#[allow(clippy::missing_safety_doc)]
+		unsafe fn open_eval_cache(
+			state: *mut EvalState,
+			flake: *mut nix_locked_flake,
+			root: *mut nix_value,
+			salt: &str,
+		) -> Result<UniquePtr<FlakeEvalCache>>;
+		fn eval_cache_attr_names(cache: &FlakeEvalCache, path: &[String]) -> Result<Vec<String>>;
+		fn eval_cache_strings(cache: &FlakeEvalCache, path: &[String]) -> Result<Vec<String>>;
+		fn eval_cache_drv_path(cache: &FlakeEvalCache, path: &[String]) -> Result<String>;
+		fn commit_eval_cache(cache: &FlakeEvalCache);
+	}
+}
+
+/// Nix setting, which was not applied.
+#[derive(Debug)]
+pub struct RejectedSetting {
+	pub name: String,
+	/// Why the value was rejected, `None` if there is no setting with this name.
+	pub error: Option<String>,
+}
+impl From<nix_cxx::RejectedSetting> for RejectedSetting {
+	fn from(r: nix_cxx::RejectedSetting) -> Self {
+		Self {
+			name: r.name,
+			error: (!r.error.is_empty()).then_some(r.error),
+		}
+	}
+}
+impl fmt::Display for RejectedSetting {
+	fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+		match &self.error {
+			Some(error) => write!(f, "invalid value of nix setting {:?}: {error}", self.name),
+			None => write!(f, "unknown nix setting {:?}", self.name),
+		}
 	}
 }
 
+fn nix_settings<'s>(settings: impl IntoIterator<Item = (&'s str, &'s str)>) -> Vec<NixSetting> {
+	settings
+		.into_iter()
+		.map(|(name, value)| NixSetting {
+			name: name.to_owned(),
+			value: value.to_owned(),
+		})
+		.collect()
+}
+
 #[derive(Debug, PartialEq, Eq)]
 pub enum NixType {
 	Thunk,
@@ -229,19 +418,11 @@ impl NixContext {
 
 	fn bail_if_error(&self) -> Result<()> {
 		if let Some((err, stack)) = self.error() {
-			let mut e = Err(anyhow!("{err}"));
-			if let Some(stack) = stack {
-				for ele in stack.stack_frames {
-					e = e.with_context(|| {
-						if ele.pos.is_empty() {
-							ele.msg
-						} else {
-							format!("{} at {}", ele.msg, ele.pos)
-						}
-					})
-				}
-			}
-			return e.context("<nix frames>");
+			let e = match stack {
+				Some(stack) => stack.into_error(&err),
+				None => anyhow!("{err}"),
+			};
+			return Err(e.context("<nix frames>"));
 		};
 		Ok(())
 	}
@@ -272,9 +453,27 @@ struct GlobalState {
 	#[allow(dead_code)]
 	store: Store,
 	state: EvalState,
+	/// Accepted fetcher settings, applied to every [`FetchSettings`].
+	fetcher_settings: Vec<NixSetting>,
 }
 impl GlobalState {
-	fn new() -> Result<Self> {
+	/// Settings are applied in a single call per scope, first global ones (store settings are
+	/// read when the store is opened), then eval and fetcher ones.
+	///
+	/// Settings are rejected once no scope accepts them, fetcher ones are also accepted by the
+	/// evaluator, so they are collected by applying eval ones to a standalone fetcher settings.
+	fn new(settings: Vec<NixSetting>) -> Result<(Self, Vec<RejectedSetting>)> {
+		let not_global = unsafe { apply_settings(null_mut(), null_mut(), true, &settings) };
+		let mut rejected = Vec::new();
+		let mut evaluator = nix_settings([("lazy-trees", "true"), ("lazy-locks", "true")]);
+		for r in not_global {
+			if r.error.is_empty() {
+				evaluator.extend(settings.iter().filter(|s| s.name == r.name).cloned());
+			} else {
+				rejected.push(r.into());
+			}
+		}
+
 		let mut ctx = NixContext::new();
 		let store = ctx
 			.run_in_context(|c| unsafe { store_open(c, c"auto".as_ptr(), null_mut()) })
@@ -282,27 +481,28 @@ impl GlobalState {
 
 		let builder = ctx.run_in_context(|c| unsafe { eval_state_builder_new(c, store.0) })?;
 		ctx.run_in_context(|c| unsafe { eval_state_builder_load(c, builder) })?;
-		ctx.run_in_context(|c| unsafe {
-			eval_state_builder_set_eval_setting(
-				c,
-				builder,
-				c"lazy-trees".as_ptr(),
-				c"true".as_ptr(),
-			)
-		})?;
-		ctx.run_in_context(|c| unsafe {
-			eval_state_builder_set_eval_setting(
-				c,
-				builder,
-				c"lazy-locks".as_ptr(),
-				c"true".as_ptr(),
-			)
-		})?;
+		let not_evaluator =
+			unsafe { apply_settings(null_mut(), builder.cast(), false, &evaluator) };
+		evaluator.retain(|s| !not_evaluator.iter().any(|r| r.name == s.name));
+		rejected.extend(not_evaluator.into_iter().map(RejectedSetting::from));
 		let state = ctx
 			.run_in_context(|c| unsafe { eval_state_build(c, builder) })
 			.map(EvalState)?;
 
-		Ok(Self { store, state })
+		let fetchers = ctx.run_in_context(|c| unsafe { fetchers_settings_new(c) })?;
+		let not_fetcher = unsafe { apply_settings(fetchers.cast(), null_mut(), false, &evaluator) };
+		unsafe { fetchers_settings_free(fetchers) };
+		let mut fetcher_settings = evaluator;
+		fetcher_settings.retain(|s| !not_fetcher.iter().any(|r| r.name == s.name));
+
+		Ok((
+			Self {
+				store,
+				state,
+				fetcher_settings,
+			},
+			rejected,
+		))
 	}
 }
 
@@ -317,14 +517,36 @@ impl ThreadState {
 	}
 }
 
-static GLOBAL_STATE: LazyLock<GlobalState> =
-	LazyLock::new(|| GlobalState::new().expect("global state init shouldn't fail"));
+static GLOBAL_STATE: OnceLock<GlobalState> = OnceLock::new();
+fn global_state() -> &'static GlobalState {
+	GLOBAL_STATE.get_or_init(|| {
+		let (state, _) = GlobalState::new(vec![]).expect("global state init shouldn't fail");
+		state
+	})
+}
+
+/// Applies nix settings (store, fetcher, eval and any other ones known to nix) and initializes
+/// the evaluator with them, should be called before anything is evaluated.
+///
+/// Returns settings, which are unknown or have invalid values.
+pub fn init_settings<'s>(
+	settings: impl IntoIterator<Item = (&'s str, &'s str)>,
+) -> Result<Vec<RejectedSetting>> {
+	if GLOBAL_STATE.get().is_some() {
+		bail!("nix settings should be applied before the evaluator is initialized");
+	}
+	let (state, rejected) = GlobalState::new(nix_settings(settings))?;
+	if GLOBAL_STATE.set(state).is_err() {
+		bail!("nix evaluator was initialized concurrently with settings");
+	}
+	Ok(rejected)
+}
 
 thread_local! {
 	static THREAD_STATE: RefCell<ThreadState> = RefCell::new(ThreadState::new().expect("thread state init shouldn't fail"));
 }
 pub(crate) fn with_default_context<T>(f: impl FnOnce(*mut c_context, *mut c_eval_state) -> T) -> Result<T> {
-	let global = &GLOBAL_STATE.state;
+	let global = &global_state().state;
 	let (ctx, state) = THREAD_STATE.with_borrow_mut(|w| (w.ctx.0, global.0));
 	let mut ctx = NixContext(ctx);
 	let v = ctx.run_in_context(|c| f(c, state));
@@ -338,7 +560,7 @@ pub(crate) fn with_default_context<T>(f: impl FnOnce(*mut c_context, *mut c_eval
 pub(crate) fn with_store_context<T>(
 	f: impl FnOnce(*mut c_context, *mut c_store, *mut c_eval_state) -> T,
 ) -> Result<T> {
-	let global = &GLOBAL_STATE;
+	let global = global_state();
 	let (ctx, store, state) =
 		THREAD_STATE.with_borrow_mut(|w| (w.ctx.0, global.store.0, global.state.0));
 	let mut ctx = NixContext(ctx);
@@ -357,12 +579,30 @@ impl FetchSettings {
 		Self::try_new().expect("allocation should not fail")
 	}
 	fn try_new() -> Result<Self> {
-		with_default_context(|c, _| unsafe { fetchers_settings_new(c) }).map(Self)
+		let out = with_default_context(|c, _| unsafe { fetchers_settings_new(c) }).map(Self)?;
+		let settings = &global_state().fetcher_settings;
+		// Every setting was accepted by the same kind of object in init_settings
+		for rejected in unsafe { apply_settings(out.0.cast(), null_mut(), false, settings) } {
+			warn!("{}", RejectedSetting::from(rejected));
+		}
+		Ok(out)
 	}
 	pub fn set(&mut self, setting: &CStr, value: &CStr) {
-		unsafe {
-			set_fetcher_setting(self.0.cast(), setting.as_ptr(), value.as_ptr());
-		};
+		let (setting, value) = (setting.to_string_lossy(), value.to_string_lossy());
+		for rejected in self.apply([(&*setting, &*value)]) {
+			warn!("{rejected}");
+		}
+	}
+	/// Applies fetcher settings in a single call, and returns the rejected ones.
+	pub fn apply<'s>(
+		&mut self,
+		settings: impl IntoIterator<Item = (&'s str, &'s str)>,
+	) -> Vec<RejectedSetting> {
+		let settings = nix_settings(settings);
+		unsafe { apply_settings(self.0.cast(), null_mut(), false, &settings) }
+			.into_iter()
+			.map(RejectedSetting::from)
+			.collect()
 	}
 }
 unsafe impl Send for FetchSettings {}
@@ -521,6 +761,22 @@ impl LockedFlake {
 		})
 		.map(Value)
 	}
+	/// Opens the nix evaluation cache for `root`, a value computed from outputs of this flake.
+	///
+	/// The cache is keyed by the flake fingerprint and `salt`, which should identify everything
+	/// else `root` depends on. Flakes without a fingerprint (with uncommitted changes) and
+	/// disabled `eval-cache` setting make every lookup evaluate `root`.
+	///
+	/// Evaluated entries are only written by [`EvalCache::commit`].
+	pub fn eval_cache(&self, root: &Value, salt: &str) -> Result<EvalCache> {
+		let cache = with_default_context(|_, es| unsafe {
+			nix_cxx::open_eval_cache(es.cast(), self.0.cast(), root.0.cast(), salt)
+		})??;
+		Ok(EvalCache {
+			cache,
+			_root: root.clone(),
+		})
+	}
 }
 unsafe impl Send for LockedFlake {}
 unsafe impl Sync for LockedFlake {}
@@ -532,6 +788,49 @@ impl Drop for LockedFlake {
 	}
 }
 
+/// Attributes under a cached root, see [`LockedFlake::eval_cache`]. Lookups are answered from
+/// the cache, and only evaluate the root on a miss.
+pub struct EvalCache {
+	cache: cxx::UniquePtr<nix_cxx::FlakeEvalCache>,
+	/// Evaluated by the cache on misses
+	_root: Value,
+}
+unsafe impl Send for EvalCache {}
+unsafe impl Sync for EvalCache {}
+impl EvalCache {
+	fn path(path: &[&str]) -> Vec<String> {
+		path.iter().map(|&p| p.to_owned()).collect()
+	}
+	/// Names of the attribute set at `path`, sorted.
+	pub fn attr_names(&self, path: &[&str]) -> Result<Vec<String>> {
+		let path = Self::path(path);
+		Ok(with_default_context(|_, _| {
+			nix_cxx::eval_cache_attr_names(&self.cache, &path)
+		})??)
+	}
+	/// Value of the list of strings at `path`.
+	pub fn strings(&self, path: &[&str]) -> Result<Vec<String>> {
+		let path = Self::path(path);
+		Ok(with_default_context(|_, _| {
+			nix_cxx::eval_cache_strings(&self.cache, &path)
+		})??)
+	}
+	/// Store path of the derivation at `path`, written to the store if it was garbage collected.
+	pub fn drv_path(&self, path: &[&str]) -> Result<String> {
+		let path = Self::path(path);
+		Ok(with_default_context(|_, _| {
+			nix_cxx::eval_cache_drv_path(&self.cache, &path)
+		})??)
+	}
+	/// Writes entries evaluated so far to disk, lookups fail afterwards.
+	///
+	/// Entries of a cache dropped without commit are discarded, so results which turned out to
+	/// be inconsistent with the salt aren't stored.
+	pub fn commit(&self) {
+		nix_cxx::commit_eval_cache(&self.cache);
+	}
+}
+
 type FieldName = [u8; 64];
 fn init_field_name(v: &str) -> FieldName {
 	let mut f = [0; 64];
@@ -727,10 +1026,6 @@ impl Value {
 			.expect("get_type should not fail");
 		NixType::from_int(ty)
 	}
-	fn builtin_to_string(&self) -> Result<Self> {
-		let builtin = Self::eval("builtins.toString")?;
-		builtin.call(self.clone())
-	}
 	fn force(&mut self, s: *mut nix_raw::EvalState) -> Result<()> {
 		with_default_context(|c, _| unsafe { value_force(c, s, self.0) })?;
 		Ok(())
@@ -747,6 +1042,27 @@ impl Value {
 
 		Ok(str_out)
 	}
+	pub fn to_bool(&self) -> Result<bool> {
+		let ty = self.type_of();
+		if !matches!(ty, NixType::Bool) {
+			bail!("unexpected type: {ty:?}, expected bool");
+		}
+		with_default_context(|c, _| unsafe { get_bool(c, self.0) })
+	}
+	pub fn to_int(&self) -> Result<i64> {
+		let ty = self.type_of();
+		if !matches!(ty, NixType::Int) {
+			bail!("unexpected type: {ty:?}, expected int");
+		}
+		with_default_context(|c, _| unsafe { get_int(c, self.0) })
+	}
+	pub fn to_float(&self) -> Result<f64> {
+		let ty = self.type_of();
+		if !matches!(ty, NixType::Float) {
+			bail!("unexpected type: {ty:?}, expected float");
+		}
+		with_default_context(|c, _| unsafe { get_float(c, self.0) })
+	}
 	pub fn to_realised_string(&self) -> Result<RealisedString> {
 		with_default_context(|c, es| unsafe { string_realise(c, es, self.0, false) })
 			.map(RealisedString)
@@ -771,21 +1087,42 @@ impl Value {
 	// pub fn derivation_path(&self) {
 	// 	nix_raw::real
 	// }
-	pub fn list_fields(&self) -> Result<Vec<String>> {
+	/// Names and (with `values`) forced values of all attributes, in a single FFI call.
+	fn attr_entries(&self, values: bool) -> Result<Vec<AttrEntry>> {
 		if !matches!(self.type_of(), NixType::Attrs) {
 			bail!("invalid type: expected attrs");
 		}
-
-		let len = with_default_context(|c, _| unsafe { get_attrs_size(c, self.0) })?;
-		let mut out = Vec::with_capacity(len as usize);
-
-		for i in 0..len {
-			let name =
-				with_default_context(|c, es| unsafe { get_attr_name_byidx(c, self.0, es, i) })?;
-			let c = unsafe { CStr::from_ptr(name) };
-			out.push(c.to_str().expect("nix field names are utf-8").to_owned());
+		Ok(with_default_context(|_, es| unsafe {
+			list_attrs(es.cast(), self.0.cast(), values)
+		})??)
+	}
+	fn attr_name(entry: &AttrEntry) -> String {
+		let name = unsafe { slice::from_raw_parts(entry.name as *const u8, entry.name_len) };
+		std::str::from_utf8(name)
+			.expect("nix field names are utf-8")
+			.to_owned()
+	}
+	pub fn list_fields(&self) -> Result<Vec<String>> {
+		Ok(self
+			.attr_entries(false)?
+			.iter()
+			.map(Self::attr_name)
+			.collect())
+	}
+	/// Attribute names with their values, cheaper than [`Self::list_fields`] followed by
+	/// [`Self::get_field`] for each name.
+	pub fn list_attrs(&self) -> Result<Vec<(String, Value)>> {
+		Ok(self
+			.attr_entries(true)?
+			.iter()
+			.map(|e| (Self::attr_name(e), Self(e.value as *mut value)))
+			.collect())
+	}
+	pub fn list_len(&self) -> Result<usize> {
+		if !matches!(self.type_of(), NixType::List) {
+			bail!("invalid type: expected list");
 		}
-		Ok(out)
+		Ok(with_default_context(|c, _| unsafe { get_list_size(c, self.0) })? as usize)
 	}
 	pub fn get_elem(&self, v: usize) -> Result<Self> {
 		if !matches!(self.type_of(), NixType::List) {
@@ -876,18 +1213,29 @@ impl Value {
 			.context("getting drvPath")?
 			.to_string()?;
 		let graph = drv::DrvGraph::resolve(&drv_path)?;
-		let _guard = logging::register_build_graph(&Span::current(), &graph);
+		let _guard = logging::register_build_graph(&Span::current(), None, &graph);
 
-		// to_string here blocks until the path is built
-		let s = v.builtin_to_string()?;
-		let rs = s.to_realised_string()?;
-		let out_path = rs.as_str().to_owned();
-		Ok(PathBuf::from(out_path))
+		let mut results = drv::build_drv_paths(&[drv_path], output)?;
+		results.pop().expect("one result per derivation").out_path()
 	}
+	/// Deserializes the value as if it was converted with `builtins.toJSON`, without producing
+	/// the JSON text.
 	pub fn as_json<T: DeserializeOwned>(&self) -> Result<T> {
-		let to_json = Self::eval("builtins.toJSON")?;
-		let s = to_json.call(self.clone())?.to_string()?;
-		Ok(serde_json::from_str(&s)?)
+		let tokens = self.walk()?;
+		Ok(T::deserialize(&mut de::TokenDeserializer::new(&tokens))?)
+	}
+	/// Same as [`Self::as_json`], but only forces the parts of the value, which are needed for
+	/// `T`: struct fields are looked up by name, and ignored values are never forced.
+	///
+	/// Slower than [`Self::as_json`] if the whole value is needed. Unknown attributes are not
+	/// visited, so `deny_unknown_fields` has no effect.
+	pub fn as_lazy<T: DeserializeOwned>(&self) -> Result<T> {
+		Ok(T::deserialize(de::LazyDeserializer::new(self.clone()))?)
+	}
+	fn walk(&self) -> Result<nix_cxx::ValueTokens> {
+		Ok(with_default_context(|_, es| unsafe {
+			walk_value(es.cast(), self.0.cast())
+		})??)
 	}
 	pub fn serialized<T: Serialize>(v: &T) -> Result<Self> {
 		Self::eval(&nixlike::serialize(v)?)
@@ -984,6 +1332,7 @@ pub fn init_libraries() {
 		.expect("expr init should not fail");
 
 	nix_logging_cxx::apply_tracing_logger();
+	logging::refresh_log_filter();
 }
 
 pub fn init_tokio_for_nix(tokio: Arc<tokio::runtime::Runtime>) {
@@ -1133,11 +1482,12 @@ fn test_native() -> Result<()> {
 	let graph = drv::DrvGraph::resolve(&drv_path)?;
 	eprintln!(
 		"fleet-install-secrets dependency graph: {} nodes",
-		graph.nodes.len()
+		graph.len()
 	);
-	for (path, node) in &graph.nodes {
-		if !node.input_drvs.is_empty() {
-			eprintln!("  {} ({} deps)", node.name, node.input_drvs.len());
+	for node in 0..graph.len() as u32 {
+		let inputs = graph.inputs(node);
+		if !inputs.is_empty() {
+			eprintln!("  {} ({} deps)", graph.name(node), inputs.len());
 		}
 	}
 
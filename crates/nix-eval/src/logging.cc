@@ -1,103 +1,333 @@
-#include "logging.hh"
-#include <nix/util/logging.hh>
+#include "logging_internal.hh"
 #include <nix/util/position.hh>
 
+#include <sstream>
+
 using namespace nix;
+using namespace fleet_logging;
+
+struct ErrorTrace::Frame {
+  std::shared_ptr<Pos> pos;
+  HintFmt hint;
+  size_t repeats;
+};
+
+namespace {
+// Maximum number of frames kept in error traces, 0 keeps all of them
+std::atomic<size_t> errorTraceDepth = 64;
+
+bool sameFrame(const Trace &a, const Trace &b) {
+  if (a.pos != b.pos && (!a.pos || !b.pos || !(*a.pos == *b.pos))) {
+    return false;
+  }
+  // Hints are only rendered for frames at the same position
+  return a.hint.str() == b.hint.str();
+}
+} // namespace
+
+ErrorTrace::ErrorTrace(const ErrorInfo &ei) {
+  // Nix prepends frames while unwinding, so the innermost one is the last
+  std::vector<std::pair<const Trace *, size_t>> unique;
+  for (auto it = ei.traces.rbegin(); it != ei.traces.rend(); ++it) {
+    if (!unique.empty() && sameFrame(*unique.back().first, *it)) {
+      ++unique.back().second;
+    } else {
+      unique.emplace_back(&*it, 1);
+    }
+  }
+
+  // Frames next to the error and the outermost ones are kept
+  size_t depth = errorTraceDepth.load(std::memory_order_relaxed);
+  if (depth != 0 && unique.size() > depth) {
+    omittedIndex = (depth + 1) / 2;
+    omittedCount = unique.size() - depth;
+    unique.erase(unique.begin() + omittedIndex,
+                 unique.begin() + omittedIndex + omittedCount);
+  }
+
+  frames.reserve(unique.size());
+  for (auto [trace, repeats] : unique) {
+    frames.push_back(Frame{trace->pos, trace->hint, repeats});
+  }
+}
+ErrorTrace::~ErrorTrace() = default;
+
+rust::String ErrorTrace::message(size_t i) const {
+  return rust::String::lossy(frames.at(i).hint.str());
+}
+rust::String ErrorTrace::position(size_t i) const {
+  auto &pos = frames.at(i).pos;
+  if (!pos) {
+    return {};
+  }
+  std::ostringstream oss;
+  pos->print(oss, true);
+  return rust::String::lossy(oss.str());
+}
+// Out of line, as Frame is incomplete in other translation units
+size_t ErrorTrace::size() const { return frames.size(); }
+size_t ErrorTrace::repeats(size_t i) const { return frames.at(i).repeats; }
 
 rust::Box<ErrorInfoBuilder> copy_error_info(const ErrorInfo &ei) {
   auto s = ei.msg.str();
   rust::Slice<const unsigned char> str(
       reinterpret_cast<const unsigned char *>(s.data()), s.size());
-  auto b = new_error_info(ei.level, str);
-  if (!ei.traces.empty()) {
-    for (auto iter = ei.traces.rbegin(); iter != ei.traces.rend(); ++iter) {
-      auto msg = iter->hint.str();
+  return new_error_info(ei.level, str, std::make_unique<ErrorTrace>(ei));
+}
 
-      rust::Slice<const unsigned char> msgv(
-          reinterpret_cast<const unsigned char *>(msg.data()), msg.size());
+namespace {
+// Store paths and host names are repeated by every activity working with
+// them, they are passed to Rust once, and then referenced by handle.
+// Interned strings are never freed.
+class StringInterner {
+public:
+  uint64_t intern(std::string_view s) {
+    auto &shard = shards[StringHash{}(s) % shards.size()];
+    std::lock_guard lock(shard.mutex);
+    if (auto it = shard.handles.find(s); it != shard.handles.end()) {
+      return it->second;
+    }
+    // Registered under the lock, so the handle is never seen by Rust before
+    // its string
+    uint64_t handle = fleet_nix_intern(s.data(), s.size());
+    shard.handles.emplace(s, handle);
+    return handle;
+  }
 
-      std::ostringstream oss;
-      if (iter->pos) {
-        iter->pos->print(oss, true);
-      }
-      std::string pos = oss.str();
+private:
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::unordered_map<std::string, uint64_t, StringHash, std::equal_to<>>
+        handles;
+  };
+  std::array<Shard, 16> shards;
+};
+StringInterner &stringInterner = *new StringInterner;
 
-      rust::Slice<const unsigned char> posv(
-          reinterpret_cast<const unsigned char *>(pos.data()), pos.size());
+// Fleet host, for which the current thread is building
+thread_local std::string buildLogOwner;
 
-      b->push_stack_frame(msgv, posv);
-    }
+// Fleet hosts of a build or substitution of `path`: the owner of the current
+// thread, or owners of registered build graphs including it.
+std::vector<std::string> ownersOf(std::string_view path) {
+  if (!buildLogOwner.empty()) {
+    return {buildLogOwner};
+  }
+  std::vector<std::string> out;
+  if (path.empty()) {
+    return out;
+  }
+  for (auto &owner : build_graph_owners(rust::Str(path.data(), path.size()))) {
+    out.push_back(std::string(owner));
+  }
+  return out;
+}
+
+// Owners of a starting activity. Only builds and substitutions are looked up
+// in the build graphs, other activities are owned by the current thread.
+std::vector<std::string> activityOwners(ActivityType type,
+                                        const Logger::Fields &fields) {
+  bool ofPath = (type == actBuild || type == actSubstitute) &&
+                !fields.empty() && fields[0].type == Logger::Field::tString;
+  return ownersOf(ofPath ? std::string_view(fields[0].s) : std::string_view());
+}
+} // namespace
+
+namespace fleet_logging {
+LogFilter logFilter;
+
+uint64_t internString(std::string_view s) {
+  return stringInterner.intern(s);
+}
+bool internedFields(ActivityType type) {
+  return type == actQueryPathInfo || type == actSubstitute ||
+         type == actCopyPath || type == actBuild;
+}
+
+void emitIntResult(ActivityId act, ResultType type,
+                   std::span<const uint64_t> values) {
+  NixField views[4];
+  for (size_t i = 0; i < values.size(); ++i) {
+    views[i] = NixField{FIELD_INT, values[i], nullptr, 0};
   }
-  return b;
-}
-
-struct TracingLogger : Logger {
-  TracingLogger() {}
-
-  bool isVerbose() override { return true; }
-  void log(Verbosity lvl, std::string_view s) override {
-    rust::Slice<const unsigned char> str(
-        reinterpret_cast<const unsigned char *>(s.data()), s.size());
-    emit_log(lvl, str);
-  }
-  void logEI(const ErrorInfo &ei) override {
-    auto b = copy_error_info(ei);
-    b->emit_error_info();
-  }
-
-  void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
-                     const std::string &s, const Fields &fields,
-                     ActivityId parent) override {
-    auto b = new_start_activity(act, lvl, type);
-    for (auto &f : fields) {
-      if (f.type == Logger::Field::tInt) {
-        b->add_int_field(f.i);
-      } else if (f.type == Logger::Field::tString) {
-        auto s = &f.s;
-        rust::Slice<const unsigned char> str(
-            reinterpret_cast<const unsigned char *>(s->data()), s->size());
-        b->add_string_field(str);
-      } else {
-        unreachable();
-      }
+  fleet_nix_emit_result(act, type, views, values.size());
+}
+
+TracingLogger::~TracingLogger() {
+  // Waits for a concurrent start, and prevents later ones
+  std::call_once(progressStarted, [] {});
+  if (progressThread.joinable()) {
+    {
+      std::lock_guard lock(progressMutex);
+      progressStopping = true;
     }
-    b->emit(parent, s);
-  };
+    progressCv.notify_one();
+    progressThread.join();
+  }
+}
 
-  void stopActivity(ActivityId act) override { emit_stop(act); };
-
-  void result(ActivityId act, ResultType type, const Fields &fields) override {
-    auto b = new_start_activity(act, 0, type);
-    for (auto &f : fields) {
-      if (f.type == Logger::Field::tInt) {
-        b->add_int_field(f.i);
-      } else if (f.type == Logger::Field::tString) {
-        auto s = &f.s;
-        rust::Slice<const unsigned char> str(
-            reinterpret_cast<const unsigned char *>(s->data()), s->size());
-        b->add_string_field(str);
-      } else {
-        unreachable();
-      }
+// Nix only includes the log tail into build errors for non-verbose loggers
+bool TracingLogger::isVerbose() {
+  if (buildLogTailOnFailure()) {
+    return false;
+  }
+  return resultEnabled(resBuildLogLine);
+}
+void TracingLogger::log(Verbosity lvl, std::string_view s) {
+  if (!logEnabled(lvl)) {
+    return;
+  }
+  rust::Slice<const unsigned char> str(
+      reinterpret_cast<const unsigned char *>(s.data()), s.size());
+  emit_log(lvl, str);
+}
+void TracingLogger::logEI(const ErrorInfo &ei) {
+  auto b = copy_error_info(ei);
+  b->emit_error_info();
+}
+
+void TracingLogger::startActivity(ActivityId act, Verbosity lvl,
+                                  ActivityType type, const std::string &s,
+                                  const Fields &fields, ActivityId parent) {
+  recordStart(act, lvl, type, s, fields, parent);
+  bool stored = type == actBuild && buildLogsStored();
+  bool timed = activitiesTimed();
+  // Owners are resolved once, lookup takes the build graph lock in Rust
+  std::vector<std::string> owners;
+  if (stored || timed) {
+    owners = activityOwners(type, fields);
+  }
+  if (stored) {
+    storeBuildStart(act, fields, owners);
+  }
+  if (timed) {
+    timeStart(act, type, s, fields, parent, std::move(owners));
+  }
+  measureStart(act, type, fields);
+  if (!activityEnabled(lvl, type, s)) {
+    return;
+  }
+  forwardStart(act, lvl, type, s, fields, parent);
+}
+
+void TracingLogger::stopActivity(ActivityId act) {
+  recordStop(act);
+  timeStop(act);
+  measureStop(act);
+  // Only the tail of stored build logs is shown
+  for (auto &line : storeBuildStop(act)) {
+    if (resultEnabled(resBuildLogLine)) {
+      forwardResult(act, resBuildLogLine, Fields{line});
     }
-    b->emit_result(type);
-  };
+  }
+  forwardStop(act);
+}
 
-  void writeToStdout(std::string_view s) override {
-    emit_warn("writeToStdout() called, but unsupported");
+void TracingLogger::result(ActivityId act, ResultType type,
+                           const Fields &fields) {
+  recordResult(act, type, fields);
+  if (type == resProgress) {
+    measureProgress(act, fields);
+  }
+  if (type == resSetPhase && fields.size() == 1 &&
+      fields[0].type == Field::tString) {
+    timePhase(act, fields[0].s);
+  }
+  if (type == resBuildLogLine && fields.size() == 1 &&
+      fields[0].type == Field::tString && storeBuildLine(act, fields[0].s)) {
+    return;
+  }
+  // Nix keeps the tail itself, and includes it into the build error
+  if (type == resBuildLogLine && buildLogTailOnFailure()) {
+    return;
   }
-  void warn(const std::string &msg) override { emit_warn(msg); }
+  if (!resultEnabled(type)) {
+    return;
+  }
+  if (ProgressTable::coalesced(type) && progress.update(act, type, fields)) {
+    startProgressThread();
+    return;
+  }
+  forwardResult(act, type, fields);
+}
 
-  virtual std::optional<char> ask(std::string_view s) {
-    emit_warn("ask() called, but unsupported");
-    return {};
+void TracingLogger::writeToStdout(std::string_view s) {
+  emit_warn("writeToStdout() called, but unsupported");
+}
+void TracingLogger::warn(const std::string &msg) { emit_warn(msg); }
+
+std::optional<char> TracingLogger::ask(std::string_view s) {
+  emit_warn("ask() called, but unsupported");
+  return {};
+}
+
+void TracingLogger::forwardStart(ActivityId act, Verbosity lvl,
+                                 ActivityType type, const std::string &s,
+                                 const Fields &fields, ActivityId parent) {
+  withFieldViews(fields, internedFields(type),
+                 [&](const NixField *views, size_t len) {
+    fleet_nix_emit_start(act, lvl, type, views, len, parent, s.data(),
+                         s.size());
+  });
+}
+void TracingLogger::forwardStop(ActivityId act) {
+  progress.remove(act, emitIntResult);
+  emit_stop(act);
+}
+void TracingLogger::forwardResult(ActivityId act, ResultType type,
+                                  const Fields &fields) {
+  withFieldViews(fields, false, [&](const NixField *views, size_t len) {
+    fleet_nix_emit_result(act, type, views, len);
+  });
+}
+
+// Flush thread is only started once there is progress to flush
+void TracingLogger::startProgressThread() {
+  if (!flushThread) {
+    return;
   }
-};
+  std::call_once(progressStarted, [this] {
+    progressThread = std::thread([this] { progressLoop(); });
+  });
+}
+
+void TracingLogger::progressLoop() {
+  std::unique_lock lock(progressMutex);
+  while (!progressCv.wait_for(lock, progressFlushInterval,
+                              [&] { return progressStopping; })) {
+    lock.unlock();
+    progress.flush(emitIntResult);
+    lock.lock();
+  }
+}
+} // namespace fleet_logging
 
 extern "C" {
-void apply_tracing_logger() {
-  logger = std::make_unique<TracingLogger>();
-  // verbosity = lvlVomit;
+void apply_tracing_logger() { logger = std::make_unique<TracingLogger>(); }
+void set_log_filter(uint8_t logs, uint8_t actions, uint64_t activities,
+                    uint64_t generic, uint64_t results) {
+  logFilter.logs.store(logs, std::memory_order_relaxed);
+  logFilter.actions.store(actions, std::memory_order_relaxed);
+  logFilter.activities.store(activities, std::memory_order_relaxed);
+  logFilter.generic.store(generic, std::memory_order_relaxed);
+  logFilter.results.store(results, std::memory_order_relaxed);
+  // Messages above nix verbosity are not even formatted
+  verbosity = logs ? static_cast<Verbosity>(std::bit_width(logs) - 1)
+                   : lvlError;
+}
+// Nix verbosity is kept, it is only changed when the new filter is known
+void reset_log_filter() {
+  logFilter.logs.store(0xff, std::memory_order_relaxed);
+  logFilter.actions.store(0xff, std::memory_order_relaxed);
+  logFilter.activities.store(UINT64_MAX, std::memory_order_relaxed);
+  logFilter.generic.store(UINT64_MAX, std::memory_order_relaxed);
+  logFilter.results.store(UINT64_MAX, std::memory_order_relaxed);
+}
+void set_build_log_owner(rust::Str owner) {
+  buildLogOwner = std::string(owner);
+}
+void set_error_trace_depth(size_t depth) {
+  errorTraceDepth.store(depth, std::memory_order_relaxed);
 }
 rust::Box<ErrorInfoBuilder>
 extract_error_info(const nix_c_context *read_context) {
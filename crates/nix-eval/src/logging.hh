@@ -1,12 +1,95 @@
 #pragma once
-#include "nix-eval/src/logging.rs"
 #include "rust/cxx.h"
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace nix {
+struct ErrorInfo;
+}
+
+// Trace of a nix error, innermost frame first. Consecutive duplicate frames
+// are merged, and frames are only rendered when requested.
+class ErrorTrace {
+public:
+  explicit ErrorTrace(const nix::ErrorInfo &ei);
+  ~ErrorTrace();
+
+  size_t size() const;
+  rust::String message(size_t i) const;
+  rust::String position(size_t i) const;
+  // How many times the frame was repeated in a row
+  size_t repeats(size_t i) const;
+  // Frames, which were removed by the depth limit
+  size_t omitted() const { return omittedCount; }
+  // Omitted frames were located after this many frames
+  size_t omittedAfter() const { return omittedIndex; }
+
+private:
+  struct Frame;
+  std::vector<Frame> frames;
+  size_t omittedCount = 0;
+  size_t omittedIndex = 0;
+};
+
+// Decompressing reader of a build log, stored by the build log store.
+class BuildLogReader {
+public:
+  explicit BuildLogReader(const std::string &path);
+  ~BuildLogReader();
+
+  // Next decompressed chunk, empty at the end of the log. It points into the
+  // reader, and is only valid until the next call.
+  rust::Slice<const uint8_t> read();
+
+private:
+  struct Stream;
+  std::unique_ptr<Stream> stream;
+};
+
+#include "nix-eval/src/logging.rs"
 #include <nix_api_util.h>
 #include <nix_api_util_internal.h>
 
 struct ErrorInfoBuilder;
 
+// Borrowed view of nix::Logger::Field, see NixField in logging.rs
+struct NixField {
+  uint8_t type;
+  uint64_t i;
+  const char *ptr;
+  size_t len;
+};
+
+// Implemented in logging.rs
+extern "C" {
+void fleet_nix_emit_start(uint64_t act, uint32_t lvl, uint32_t type,
+                          const NixField *fields, size_t fields_len,
+                          uint64_t parent, const char *s, size_t s_len);
+void fleet_nix_emit_result(uint64_t act, uint32_t type, const NixField *fields,
+                           size_t fields_len);
+uint64_t fleet_nix_intern(const char *s, size_t len);
+}
+
 extern "C" {
 void apply_tracing_logger();
+void apply_buffered_tracing_logger(size_t ring_capacity, uint8_t policy);
+void flush_tracing_logger();
+void set_log_filter(uint8_t logs, uint8_t actions, uint64_t activities,
+                    uint64_t generic, uint64_t results);
+void reset_log_filter();
+void set_error_trace_depth(size_t depth);
+void start_activity_recording(rust::Str path, uint64_t capacity);
+uint64_t stop_activity_recording();
+void open_build_log_store(rust::Str dir, size_t tail_lines);
+void close_build_log_store();
+void set_build_log_tail_on_failure(bool enabled);
+void set_build_log_owner(rust::Str owner);
+void start_activity_timings(size_t slowest_phases);
+TimingsSummary take_activity_timings();
+void start_transfer_metrics();
+rust::Vec<HostTransfers> take_transfer_metrics();
+std::unique_ptr<BuildLogReader> open_build_log(rust::Str path);
 rust::Box<ErrorInfoBuilder> extract_error_info(const nix_c_context *ctx);
 }
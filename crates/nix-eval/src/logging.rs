@@ -1,18 +1,30 @@
-use std::collections::{HashMap, VecDeque};
-use std::fmt::Arguments;
-use std::sync::{LazyLock, Mutex};
+use std::borrow::Cow;
+use std::collections::{BTreeMap, HashMap, VecDeque};
+use std::fmt::{self, Arguments, Display};
+use std::ops::{Deref, Range};
+use std::path::Path;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, LazyLock, Mutex, MutexGuard, Once, RwLock};
+use std::time::{Duration, Instant};
+use std::{array, slice};
 
-use cxx::ExternType;
+use anyhow::anyhow;
+use cxx::{ExternType, UniquePtr};
+use tracing::callsite::{Callsite, Identifier};
+use tracing::field::FieldSet;
+use tracing::span::Id;
+use tracing::subscriber::Interest;
 use tracing::{
-	Level, Span, debug, debug_span, error, error_span, info, info_span, trace, trace_span, warn,
-	warn_span,
+	Level, Metadata, Span, debug, debug_span, dispatcher, error, error_span, info, info_span,
+	trace, trace_span, warn, warn_span,
 };
 #[cfg(feature = "indicatif")]
 use tracing_indicatif::span_ext::IndicatifSpanExt as _;
-use vte::Parser;
 
-#[derive(Debug)]
-enum ActivityType {
+use crate::{activity_text, ansi};
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum ActivityType {
 	Unknown = 0,
 	CopyPath = 100,
 	FileTransfer = 101,
@@ -33,11 +45,11 @@ fn strip_prefix_suffix<'s, 'p>(a: &'s str, pref: &'p str, suff: &'p str) -> Opti
 	a.strip_prefix(pref)?.strip_suffix(suff)
 }
 
-fn parse_path(path: &str) -> &str {
+pub(crate) fn parse_path(path: &str) -> &str {
 	strip_prefix_suffix(path, "\x1b[35;1m", "\x1b[0m").unwrap_or(path)
 }
 
-fn parse_drv(drv: &str) -> &str {
+pub(crate) fn parse_drv(drv: &str) -> &str {
 	let drv = parse_path(drv);
 	if let Some(pkg) = drv.strip_prefix("/nix/store/") {
 		let mut it = pkg.splitn(2, '-');
@@ -48,13 +60,64 @@ fn parse_drv(drv: &str) -> &str {
 	}
 	drv
 }
-fn parse_host(host: &str) -> &str {
+/// Derivation path, from the text of `BuildWaiting` activity.
+pub(crate) fn parse_build_waiting(text: &str) -> Option<&str> {
+	let drv = strip_prefix_suffix(text, "waiting for a machine to build '", "'")?;
+	Some(parse_path(drv))
+}
+pub(crate) fn parse_host(host: &str) -> &str {
 	if host.is_empty() || host == "local" {
 		return "local";
 	}
 	// https/ssh is the default
 	host.strip_prefix("https://").unwrap_or(host)
 }
+/// Build phase name without the stdenv `Phase` suffix.
+pub(crate) fn phase_name(phase: &str) -> &str {
+	phase.strip_suffix("Phase").unwrap_or(phase)
+}
+
+/// Fields of build spans, which receive durations of the standard stdenv phases in seconds.
+///
+/// Span fields are fixed on span creation, other phases are only collected by
+/// [`start_activity_timings`].
+const PHASE_FIELDS: &[&str] = &[
+	"phase.unpack",
+	"phase.patch",
+	"phase.configure",
+	"phase.build",
+	"phase.check",
+	"phase.install",
+	"phase.fixup",
+	"phase.installCheck",
+	"phase.dist",
+];
+fn phase_field(phase: &str) -> Option<&'static str> {
+	let name = phase_name(phase);
+	PHASE_FIELDS
+		.iter()
+		.find(|f| f.strip_prefix("phase.") == Some(name))
+		.copied()
+}
+macro_rules! build_span {
+	($($fields:tt)*) => {{
+		use tracing::field::Empty;
+		info_span!(
+			target: "nix::build",
+			"building",
+			$($fields)*,
+			phase.unpack = Empty,
+			phase.patch = Empty,
+			phase.configure = Empty,
+			phase.build = Empty,
+			phase.check = Empty,
+			phase.install = Empty,
+			phase.fixup = Empty,
+			phase.installCheck = Empty,
+			phase.dist = Empty,
+		)
+	}};
+}
 
 impl ActivityType {
 	fn name(&self) -> &'static str {
@@ -81,31 +144,36 @@ impl ActivityType {
 		s: &str,
 		into: impl FnOnce(Arguments<'_>) -> Span,
 	) -> Span {
+		if values.is_empty()
+			&& let Some((pattern, arg)) = activity_text::find(*self, s)
+		{
+			return (pattern.span)(arg);
+		}
 		use FieldValue::*;
 		match (self, values) {
 			(ActivityType::QueryPathInfo, [Str(drv), Str(host)]) => {
-				let drv = parse_drv(drv);
-				let host = parse_host(host);
+				let drv = drv.drv();
+				let host = host.host();
 				debug_span!(target: "nix::query-path-info", "querying", drv, host)
 			}
 			(ActivityType::Substitute, [Str(drv), Str(host)]) => {
-				let drv = parse_drv(drv);
-				let host = parse_host(host);
+				let drv = drv.drv();
+				let host = host.host();
 				debug_span!(target: "nix::substitute", "substituting", drv, host)
 			}
 			(ActivityType::CopyPath, [Str(drv), Str(from), Str(to)]) => {
-				let drv = parse_drv(drv);
-				let from = parse_host(from);
-				let to = parse_host(to);
+				let drv = drv.drv();
+				let from = from.host();
+				let to = to.host();
 				debug_span!(target: "nix::copy-path", "copying", drv, from, to)
 			}
 			(ActivityType::Build, [Str(drv), Str(host), Int(_), Int(_)]) => {
-				let drv = parse_drv(drv);
-				let host = parse_host(host);
-				info_span!(target: "nix::build", "building", drv, host)
+				let drv = drv.drv();
+				let host = host.host();
+				build_span!(drv, host)
 			}
 			(ActivityType::FileTransfer, [Str(file)]) => {
-				info_span!(target: "nix::file-transfer", "downloading", file)
+				info_span!(target: "nix::file-transfer", "downloading", file = &**file)
 			}
 			(ActivityType::Realise, []) => {
 				debug_span!(target: "nix::realise", "realising")
@@ -113,72 +181,10 @@ impl ActivityType {
 			(ActivityType::CopyPaths, []) => {
 				debug_span!(target: "nix::copy-paths", "copying paths")
 			}
-			(ActivityType::Unknown, [])
-				if s.starts_with("copying \"") && s.ends_with("\" to the store") =>
-			{
-				let tree = s
-					.trim_start_matches("copying \"")
-					.trim_end_matches("\" to the store");
-				debug_span!(target: "nix::trees", "copying", tree)
-			}
-			(ActivityType::Unknown, [])
-				if s.starts_with("copying '") && s.ends_with("' to the store") =>
-			{
-				let tree = s
-					.trim_start_matches("copying '")
-					.trim_end_matches("' to the store");
-				debug_span!(target: "nix::trees", "copying", tree)
-			}
-			(ActivityType::Unknown, []) if s.starts_with("hashing '") && s.ends_with("'") => {
-				let tree = s.trim_start_matches("hashing '").trim_end_matches("'");
-				debug_span!(target: "nix::trees", "hashing", tree)
-			}
-			(ActivityType::Unknown, []) if s.starts_with("connecting to '") && s.ends_with("'") => {
-				let host = s
-					.trim_start_matches("connecting to '")
-					.trim_end_matches("'");
-				debug_span!(target: "nix::remote", "connecting", host)
-			}
-			(ActivityType::Unknown, [])
-				if s.starts_with("copying outputs from '") && s.ends_with("'") =>
-			{
-				let host = s
-					.trim_start_matches("copying outputs from '")
-					.trim_end_matches("'");
-				debug_span!(target: "nix::remote", "copying outputs", host)
-			}
-			(ActivityType::Unknown, [])
-				if s.starts_with("copying dependencies to '") && s.ends_with("'") =>
-			{
-				let host = s
-					.trim_start_matches("copying dependencies to '")
-					.trim_end_matches("'");
-				debug_span!(target: "nix::remote", "copying dependencies", host)
-			}
-			(ActivityType::Unknown, [])
-				if s.starts_with("waiting for the upload lock to '") && s.ends_with("'") =>
-			{
-				let host = s
-					.trim_start_matches("waiting for the upload lock to '")
-					.trim_end_matches("'");
-				debug_span!(target: "nix::remote", "waiting for upload lock", host)
-			}
-			(ActivityType::BuildWaiting, [])
-				if s.starts_with("waiting for a machine to build '") && s.ends_with("'") =>
-			{
-				let drv = parse_drv(
-					s.trim_start_matches("waiting for a machine to build '")
-						.trim_end_matches("'"),
-				);
-				debug_span!(target: "nix::build-waiting", "waiting for available builder", drv)
-			}
-			(ActivityType::Unknown, []) if s == "querying info about missing paths" => {
-				debug_span!(target: "nix::remote", "querying")
-			}
 			_ => into(format_args!("{}({values:?})", self.name())),
 		}
 	}
-	fn from_int(v: u32) -> Self {
+	pub(crate) fn from_int(v: u32) -> Self {
 		match v {
 			0 => Self::Unknown,
 			100 => Self::CopyPath,
@@ -282,294 +288,755 @@ impl Verbosity {
 	}
 }
 
-static NIX_SPAN_MAPPING: LazyLock<Mutex<HashMap<u64, Span>>> =
-	LazyLock::new(|| Mutex::new(HashMap::new()));
+/// Bit of nix activity or result type in the filter masks, see `typeBit` in logging_internal.hh
+fn type_bit(ty: u32) -> u64 {
+	if (100..163).contains(&ty) {
+		1 << (ty - 100)
+	} else {
+		1 << 63
+	}
+}
+
+/// Evaluates `tracing::enabled!` for a level only known at runtime.
+macro_rules! enabled_at {
+	($kind:ident, $target:expr, $level:expr) => {{
+		use tracing::metadata::Kind;
+		let level: Level = $level;
+		if level == Level::ERROR {
+			tracing::enabled!(kind: Kind::$kind, target: $target, Level::ERROR)
+		} else if level == Level::WARN {
+			tracing::enabled!(kind: Kind::$kind, target: $target, Level::WARN)
+		} else if level == Level::INFO {
+			tracing::enabled!(kind: Kind::$kind, target: $target, Level::INFO)
+		} else if level == Level::DEBUG {
+			tracing::enabled!(kind: Kind::$kind, target: $target, Level::DEBUG)
+		} else {
+			tracing::enabled!(kind: Kind::$kind, target: $target, Level::TRACE)
+		}
+	}};
+}
+
+/// Which nix events can produce anything in the current subscriber,
+/// everything else is dropped on the C++ side.
+///
+/// Only static filter directives are taken into account, span-scoped directives
+/// are evaluated as if no span is entered.
+#[derive(Debug)]
+struct LogFilter {
+	/// Nix verbosity levels of `log()` calls and activity messages.
+	logs: u8,
+	/// Nix verbosity levels of activities, which are represented by a generic `action` span.
+	actions: u8,
+	/// Activity types, which have their own span enabled.
+	activities: u64,
+	/// Activity types, which may fall back to the generic `action` span.
+	generic: u64,
+	results: u64,
+}
+impl LogFilter {
+	fn current() -> Self {
+		let mut logs = 0;
+		let mut actions = 0;
+		for v in 0..8 {
+			let level: Level = Verbosity::from_int(v).into();
+			if enabled_at!(EVENT, "nix", level) {
+				logs |= 1 << v;
+			}
+			if enabled_at!(SPAN, module_path!(), level) {
+				actions |= 1 << v;
+			}
+		}
+
+		let build_log = enabled_at!(EVENT, module_path!(), Level::INFO);
+		// Catch-all for results, which are only reported as unknown
+		let unknown_result = enabled_at!(EVENT, module_path!(), Level::WARN);
+
+		let span = |ty: ActivityType, enabled: bool| if enabled { type_bit(ty as u32) } else { 0 };
+		let activities = span(
+			ActivityType::QueryPathInfo,
+			enabled_at!(SPAN, "nix::query-path-info", Level::DEBUG),
+		) | span(
+			ActivityType::Substitute,
+			enabled_at!(SPAN, "nix::substitute", Level::DEBUG),
+		) | span(
+			ActivityType::CopyPath,
+			enabled_at!(SPAN, "nix::copy-path", Level::DEBUG),
+		) | span(
+			ActivityType::Build,
+			// Build log lines are only emitted inside of the build span
+			build_log || enabled_at!(SPAN, "nix::build", Level::INFO),
+		) | span(
+			ActivityType::FileTransfer,
+			enabled_at!(SPAN, "nix::file-transfer", Level::INFO),
+		) | span(
+			ActivityType::Realise,
+			enabled_at!(SPAN, "nix::realise", Level::DEBUG),
+		) | span(
+			ActivityType::CopyPaths,
+			enabled_at!(SPAN, "nix::copy-paths", Level::DEBUG),
+		) | span(
+			ActivityType::Unknown,
+			enabled_at!(SPAN, "nix::trees", Level::DEBUG)
+				|| enabled_at!(SPAN, "nix::remote", Level::DEBUG),
+		) | span(
+			ActivityType::BuildWaiting,
+			enabled_at!(SPAN, "nix::build-waiting", Level::DEBUG),
+		) | span(ActivityType::PostBuildHook, unknown_result);
+		let generic = [
+			ActivityType::Unknown,
+			ActivityType::Builds,
+			ActivityType::OptimiseStore,
+			ActivityType::VerifyPaths,
+			ActivityType::PostBuildHook,
+			ActivityType::BuildWaiting,
+			ActivityType::FetchTree,
+		]
+		.into_iter()
+		.fold(0, |mask, ty| mask | type_bit(ty as u32));
+
+		let mut results = if unknown_result { !0 } else { 0 };
+		let mut set = |ty: ResultType, enabled: bool| {
+			let bit = type_bit(ty as u32);
+			if enabled {
+				results |= bit;
+			} else {
+				results &= !bit;
+			}
+		};
+		set(ResultType::BuildLogLine, build_log);
+		// Phase durations are recorded on the build span
+		set(
+			ResultType::SetPhase,
+			activities & type_bit(ActivityType::Build as u32) != 0
+				|| enabled_at!(EVENT, "nix::phase", Level::DEBUG),
+		);
+		set(ResultType::Progress, cfg!(feature = "indicatif"));
+		set(ResultType::SetExpected, false);
+
+		Self {
+			logs,
+			actions,
+			activities,
+			generic,
+			results,
+		}
+	}
+}
+
+/// Set when the subscriber was changed after the last filter update.
+static LOG_FILTER_STALE: AtomicBool = AtomicBool::new(false);
+
+/// Fake callsite, which is notified by tracing whenever the interest cache is rebuilt,
+/// i.e when the global subscriber is set, or its filter is reloaded.
+struct LogFilterProbe;
+static LOG_FILTER_PROBE: LogFilterProbe = LogFilterProbe;
+static LOG_FILTER_PROBE_META: Metadata<'static> = Metadata::new(
+	"nix log filter",
+	module_path!(),
+	Level::TRACE,
+	None,
+	None,
+	None,
+	FieldSet::new(&[], Identifier(&LOG_FILTER_PROBE)),
+	tracing::metadata::Kind::HINT,
+);
+impl Callsite for LogFilterProbe {
+	fn set_interest(&self, _interest: Interest) {
+		// Interest rebuild holds the callsite registry lock, so the filter can't be queried here.
+		// Until the next event reaches Rust, everything is forwarded.
+		nix_logging_cxx::reset_log_filter();
+		LOG_FILTER_STALE.store(true, Ordering::Release);
+	}
+
+	fn metadata(&self) -> &Metadata<'_> {
+		&LOG_FILTER_PROBE_META
+	}
+}
+
+/// Recomputes which nix log messages and activities are passed to tracing,
+/// and sets nix verbosity to the most verbose enabled level.
+///
+/// Filter is refreshed automatically when the subscriber changes, this only needs to be called
+/// if the filter depends on something else.
+pub fn refresh_log_filter() {
+	static REGISTER: Once = Once::new();
+	REGISTER.call_once(|| tracing::callsite::register(&LOG_FILTER_PROBE));
+
+	LOG_FILTER_STALE.store(false, Ordering::Release);
+	let filter = LogFilter::current();
+	nix_logging_cxx::set_log_filter(
+		filter.logs,
+		filter.actions,
+		filter.activities,
+		filter.generic,
+		filter.results,
+	);
+}
+fn refresh_stale_log_filter() {
+	if LOG_FILTER_STALE.load(Ordering::Acquire) {
+		refresh_log_filter();
+	}
+}
+
+/// Identifier of a derivation in [`BUILD_GRAPH`], never reused.
+type DrvId = u64;
 
-struct DrvGraphEntry {
+struct ActivityEntry {
+	span: Span,
+	/// Derivation, which span is used for this activity.
+	drv: Option<DrvId>,
+	/// Span field of the current build phase, and when it started.
+	phase: Option<(Option<&'static str>, Instant)>,
+}
+impl ActivityEntry {
+	fn finish_phase(&mut self) {
+		if let Some((Some(field), started)) = self.phase.take() {
+			self.span.record(field, started.elapsed().as_secs_f64());
+		}
+	}
+}
+
+const ACTIVITY_SHARDS: usize = 64;
+
+/// Live nix activities.
+///
+/// Nix activity ids are `pid << 32 | counter`, so the low bits are dense, and consecutive
+/// activities (which are usually started by different threads) end up in different shards.
+struct ActivityTable {
+	shards: [Mutex<HashMap<u64, ActivityEntry>>; ACTIVITY_SHARDS],
+}
+impl ActivityTable {
+	fn shard(&self, id: u64) -> MutexGuard<'_, HashMap<u64, ActivityEntry>> {
+		self.shards[id as usize % ACTIVITY_SHARDS]
+			.lock()
+			.expect("not poisoned")
+	}
+	fn span(&self, id: u64) -> Option<Span> {
+		self.shard(id).get(&id).map(|e| e.span.clone())
+	}
+	fn insert(&self, id: u64, entry: ActivityEntry) {
+		self.shard(id).insert(id, entry);
+	}
+	fn remove(&self, id: u64) -> Option<ActivityEntry> {
+		self.shard(id).remove(&id)
+	}
+}
+
+static ACTIVITIES: LazyLock<ActivityTable> = LazyLock::new(|| ActivityTable {
+	shards: array::from_fn(|_| Mutex::new(HashMap::new())),
+});
+
+struct DrvGraphNode {
+	path: String,
 	name: String,
-	parent: Option<String>,
-	span: Option<Span>,
+	parent: Option<DrvId>,
+	/// Only locked by activities of this derivation and its dependencies.
+	span: Mutex<Option<Span>>,
 	refcount: usize,
+	/// Fleet hosts of the builds, including this derivation, once per build.
+	owners: Vec<String>,
+	/// Output paths, known before the build.
+	out_paths: Vec<String>,
 }
 
-static DRV_GRAPH: LazyLock<Mutex<HashMap<String, DrvGraphEntry>>> =
-	LazyLock::new(|| Mutex::new(HashMap::new()));
+/// Derivations of all currently running builds, shared between builds.
+///
+/// Only modified when a build starts or finishes, activities take the read lock.
+#[derive(Default)]
+struct BuildGraph {
+	ids: HashMap<String, DrvId>,
+	/// Derivations by their output paths
+	outputs: HashMap<String, DrvId>,
+	nodes: HashMap<DrvId, DrvGraphNode>,
+	next_id: DrvId,
+}
+impl BuildGraph {
+	/// Returns the span of the derivation, creating spans for it and its dependents if needed.
+	fn ensure_span(&self, id: DrvId) -> Option<Span> {
+		let mut chain = vec![];
+		let mut current = Some(id);
+		while let Some(id) = current {
+			let Some(node) = self.nodes.get(&id) else {
+				break;
+			};
+			chain.push(node);
+			if node.span.lock().expect("not poisoned").is_some() {
+				break;
+			}
+			current = node.parent;
+		}
 
-static ACTIVITY_TO_DRV: LazyLock<Mutex<HashMap<u64, String>>> =
-	LazyLock::new(|| Mutex::new(HashMap::new()));
+		let mut parent_span: Option<Span> = None;
+		for node in chain.into_iter().rev() {
+			let mut span = node.span.lock().expect("not poisoned");
+			let span = span.get_or_insert_with(|| {
+				let _enter = parent_span.as_ref().map(|s| s.enter());
+				build_span!(drv = %node.name)
+			});
+			parent_span = Some(span.clone());
+		}
+		parent_span
+	}
+}
+
+static BUILD_GRAPH: LazyLock<RwLock<BuildGraph>> = LazyLock::new(Default::default);
 
 pub struct BuildGraphGuard {
-	paths: Vec<String>,
+	ids: Vec<DrvId>,
+	owner: Option<String>,
 }
 
 impl Drop for BuildGraphGuard {
 	fn drop(&mut self) {
-		let mut drv_graph = DRV_GRAPH.lock().expect("not poisoned");
-		for path in &self.paths {
-			if let Some(entry) = drv_graph.get_mut(path) {
-				entry.refcount -= 1;
-				if entry.refcount == 0 {
-					drv_graph.remove(path);
+		let mut graph = BUILD_GRAPH.write().expect("not poisoned");
+		for id in &self.ids {
+			if let Some(node) = graph.nodes.get_mut(id) {
+				node.refcount -= 1;
+				if let Some(owner) = &self.owner {
+					if let Some(i) = node.owners.iter().position(|o| o == owner) {
+						node.owners.swap_remove(i);
+					}
+				}
+				if node.refcount == 0 {
+					let node = graph.nodes.remove(id).expect("exists");
+					graph.ids.remove(&node.path);
+					for out_path in &node.out_paths {
+						graph.outputs.remove(out_path);
+					}
 				}
 			}
 		}
 	}
 }
 
-pub fn register_build_graph(parent: &Span, graph: &crate::drv::DrvGraph) -> BuildGraphGuard {
-	let mut drv_graph = DRV_GRAPH.lock().expect("not poisoned");
-	let mut paths = Vec::new();
+/// Registers derivations of a build, so their activities are logged in spans under `parent`
+/// until the guard is dropped.
+///
+/// Builds and substitutions of these derivations are attributed to `owner` (fleet host name) in
+/// stored build logs and activity timings, derivations shared between builds are attributed to
+/// owners of all of them.
+pub fn register_build_graph(
+	parent: &Span,
+	owner: Option<&str>,
+	graph: &crate::drv::DrvGraph,
+) -> BuildGraphGuard {
+	let mut build_graph = BUILD_GRAPH.write().expect("not poisoned");
+	let build_graph = &mut *build_graph;
+	let mut ids = Vec::new();
 
-	drv_graph
-		.entry(graph.root.clone())
-		.and_modify(|e| e.refcount += 1)
-		.or_insert_with(|| DrvGraphEntry {
-			name: graph.nodes[&graph.root].name.clone(),
-			parent: None,
-			span: Some(parent.clone()),
-			refcount: 1,
-		});
-	paths.push(graph.root.clone());
+	let mut add = |node: u32, parent: Option<DrvId>, span: Option<Span>| {
+		let path = graph.path(node);
+		let id = match build_graph.ids.get(path) {
+			Some(&id) => {
+				build_graph
+					.nodes
+					.get_mut(&id)
+					.expect("ids and nodes are in sync")
+					.refcount += 1;
+				id
+			}
+			None => {
+				let id = build_graph.next_id;
+				build_graph.next_id += 1;
+				build_graph.ids.insert(path.to_owned(), id);
+				let out_paths = graph.out_paths(node).map(str::to_owned).collect::<Vec<_>>();
+				for out_path in &out_paths {
+					build_graph.outputs.insert(out_path.clone(), id);
+				}
+				build_graph.nodes.insert(id, DrvGraphNode {
+					path: path.to_owned(),
+					name: graph.name(node).to_owned(),
+					parent,
+					span: Mutex::new(span),
+					refcount: 1,
+					owners: vec![],
+					out_paths,
+				});
+				id
+			}
+		};
+		if let Some(owner) = owner {
+			build_graph
+				.nodes
+				.get_mut(&id)
+				.expect("ids and nodes are in sync")
+				.owners
+				.push(owner.to_owned());
+		}
+		id
+	};
+
+	let root_node = crate::drv::DrvGraph::ROOT;
+	let root = add(root_node, None, Some(parent.clone()));
+	ids.push(root);
 
 	let mut queue = VecDeque::new();
-	queue.push_back(graph.root.clone());
+	queue.push_back((root_node, root));
 
-	let mut visited = std::collections::HashSet::new();
-	visited.insert(graph.root.clone());
+	let mut visited = vec![false; graph.len()];
+	visited[root_node as usize] = true;
 
-	while let Some(path) = queue.pop_front() {
-		let Some(node) = graph.nodes.get(&path) else {
-			continue;
-		};
-		for dep_path in node.input_drvs.keys() {
-			if !visited.insert(dep_path.clone()) {
-				continue;
-			}
-			let Some(dep_node) = graph.nodes.get(dep_path) else {
+	while let Some((node, id)) = queue.pop_front() {
+		for &dep_node in graph.inputs(node) {
+			if std::mem::replace(&mut visited[dep_node as usize], true) {
 				continue;
-			};
-			if let Some(entry) = drv_graph.get_mut(dep_path) {
-				entry.refcount += 1;
-			} else {
-				drv_graph.insert(dep_path.clone(), DrvGraphEntry {
-					name: dep_node.name.clone(),
-					parent: Some(path.clone()),
-					span: None,
-					refcount: 1,
-				});
 			}
-			paths.push(dep_path.clone());
-			queue.push_back(dep_path.clone());
+			let dep = add(dep_node, Some(id), None);
+			ids.push(dep);
+			queue.push_back((dep_node, dep));
 		}
 	}
 
-	BuildGraphGuard { paths }
+	BuildGraphGuard {
+		ids,
+		owner: owner.map(str::to_owned),
+	}
 }
 
-fn ensure_drv_span(drv_path: &str) -> Option<Span> {
-	let mut drv_graph = DRV_GRAPH.lock().expect("not poisoned");
+/// Owners of the derivation, or of the derivation producing the output at `path`, see
+/// [`register_build_graph`].
+fn build_graph_owners(path: &str) -> Vec<String> {
+	let graph = BUILD_GRAPH.read().expect("not poisoned");
+	let Some(id) = graph.ids.get(path).or_else(|| graph.outputs.get(path)) else {
+		return vec![];
+	};
+	let mut owners = graph.nodes[id].owners.clone();
+	owners.sort_unstable();
+	owners.dedup();
+	owners
+}
 
-	if let Some(span) = drv_graph.get(drv_path).and_then(|e| e.span.clone()) {
-		return Some(span);
-	}
+/// Returns the derivation id and its span, if the derivation is a part of any running build.
+fn ensure_drv_span(drv_path: &str) -> Option<(DrvId, Span)> {
+	let graph = BUILD_GRAPH.read().expect("not poisoned");
+	let id = *graph.ids.get(drv_path)?;
+	graph.ensure_span(id).map(|span| (id, span))
+}
 
-	let mut chain = vec![];
-	let mut current = drv_path.to_owned();
-	loop {
-		let Some(entry) = drv_graph.get(&current) else {
-			break;
-		};
-		if entry.span.is_some() {
-			chain.push(current);
-			break;
+#[derive(Debug)]
+enum FieldValue<'f> {
+	Int(u64),
+	Str(Text<'f>),
+}
+
+/// String, registered by `StringInterner` in logging.cc. Store paths and hosts are parsed once,
+/// when the string is first seen.
+pub struct Interned {
+	raw: &'static str,
+	path: &'static str,
+	drv: &'static str,
+	host: &'static str,
+}
+
+/// Registers a string, returns the handle passed in interned fields.
+///
+/// # Safety
+/// `s` should point to `len` bytes. Interned strings are leaked.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn fleet_nix_intern(s: *const u8, len: usize) -> u64 {
+	let raw: &'static str = String::from_utf8_lossy(unsafe { raw_bytes(s, len) })
+		.into_owned()
+		.leak();
+	let interned: &'static Interned = Box::leak(Box::new(Interned {
+		raw,
+		path: parse_path(raw),
+		drv: parse_drv(raw),
+		host: parse_host(raw),
+	}));
+	interned as *const Interned as u64
+}
+
+enum Text<'f> {
+	/// Borrowed from the nix logger call, only copied when the value is kept.
+	Borrowed(Cow<'f, str>),
+	Interned(&'static Interned),
+}
+impl Text<'_> {
+	fn path(&self) -> &str {
+		match self {
+			Text::Borrowed(s) => parse_path(s),
+			Text::Interned(i) => i.path,
 		}
-		chain.push(current.clone());
-		match &entry.parent {
-			Some(p) => current = p.clone(),
-			None => break,
+	}
+	fn drv(&self) -> &str {
+		match self {
+			Text::Borrowed(s) => parse_drv(s),
+			Text::Interned(i) => i.drv,
 		}
 	}
-
-	if chain.is_empty() {
-		return None;
+	fn host(&self) -> &str {
+		match self {
+			Text::Borrowed(s) => parse_host(s),
+			Text::Interned(i) => i.host,
+		}
 	}
+}
+impl Deref for Text<'_> {
+	type Target = str;
 
-	for i in (0..chain.len()).rev() {
-		let path = &chain[i];
-		if drv_graph.get(path).unwrap().span.is_some() {
-			continue;
+	fn deref(&self) -> &str {
+		match self {
+			Text::Borrowed(s) => s,
+			Text::Interned(i) => i.raw,
 		}
-		let parent_span = chain
-			.get(i + 1)
-			.and_then(|p| drv_graph.get(p))
-			.and_then(|e| e.span.clone());
-		let name = drv_graph.get(path).unwrap().name.clone();
-		let span = {
-			let _enter = parent_span.as_ref().map(|s| s.enter());
-			info_span!(target: "nix::build", "building", drv = %name)
-		};
-		drv_graph.get_mut(path).unwrap().span = Some(span);
 	}
+}
+impl fmt::Debug for Text<'_> {
+	fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+		fmt::Debug::fmt(&**self, f)
+	}
+}
+impl Display for Text<'_> {
+	fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+		Display::fmt(&**self, f)
+	}
+}
 
-	drv_graph.get(drv_path).and_then(|e| e.span.clone())
+/// Borrowed view of nix `Logger::Field`, see `NixField` in logging.hh
+#[repr(C)]
+pub struct NixField {
+	ty: u8,
+	int: u64,
+	ptr: *const u8,
+	len: usize,
 }
+const NIX_FIELD_INT: u8 = 0;
+const NIX_FIELD_STRING: u8 = 1;
+const NIX_FIELD_INTERNED: u8 = 2;
 
-#[derive(Debug)]
-enum FieldValue {
-	Int(i32),
-	Str(String),
+unsafe fn raw_bytes<'f>(ptr: *const u8, len: usize) -> &'f [u8] {
+	if len == 0 {
+		return &[];
+	}
+	unsafe { slice::from_raw_parts(ptr, len) }
 }
 
-struct StartActivityBuilder {
-	activity_id: u64,
-	verbosity: Verbosity,
-	typ: ActivityType,
-	fields: Vec<FieldValue>,
-}
-impl StartActivityBuilder {
-	fn add_int_field(&mut self, i: i32) {
-		self.fields.push(FieldValue::Int(i));
-	}
-	fn add_string_field(&mut self, v: &[u8]) {
-		let v = String::from_utf8_lossy(v);
-		self.fields.push(FieldValue::Str(v.to_string()));
-	}
-	fn emit(&mut self, parent: u64, s: &str) {
-		let graph_span = if matches!(self.typ, ActivityType::Build) {
-			self.fields.first().and_then(|f| match f {
-				FieldValue::Str(drv_path) => {
-					let clean = parse_path(drv_path);
-					let span = ensure_drv_span(clean);
-					if span.is_some() {
-						ACTIVITY_TO_DRV
-							.lock()
-							.expect("not poisoned")
-							.insert(self.activity_id, clean.to_owned());
-					}
-					span
-				}
-				_ => None,
-			})
+/// Nix activities carry at most a few fields, so they are decoded without allocation.
+const INLINE_FIELDS: usize = 8;
+enum Fields<'f> {
+	Inline([FieldValue<'f>; INLINE_FIELDS], usize),
+	Heap(Vec<FieldValue<'f>>),
+}
+impl<'f> Fields<'f> {
+	unsafe fn from_raw(fields: *const NixField, len: usize) -> Self {
+		let fields = if len == 0 {
+			&[]
 		} else {
-			None
+			unsafe { slice::from_raw_parts(fields, len) }
+		};
+		let decode = |f: &NixField| match f.ty {
+			NIX_FIELD_INT => FieldValue::Int(f.int),
+			NIX_FIELD_STRING => FieldValue::Str(Text::Borrowed(String::from_utf8_lossy(unsafe {
+				raw_bytes(f.ptr, f.len)
+			}))),
+			// Handle is returned by fleet_nix_intern
+			NIX_FIELD_INTERNED => {
+				FieldValue::Str(Text::Interned(unsafe { &*(f.int as *const Interned) }))
+			}
+			ty => unreachable!("unknown nix field type: {ty}"),
 		};
+		if fields.len() > INLINE_FIELDS {
+			return Self::Heap(fields.iter().map(decode).collect());
+		}
+		let mut out = array::from_fn(|_| FieldValue::Int(0));
+		for (out, field) in out.iter_mut().zip(fields) {
+			*out = decode(field);
+		}
+		Self::Inline(out, fields.len())
+	}
+}
+impl<'f> Deref for Fields<'f> {
+	type Target = [FieldValue<'f>];
 
-		let mut mapping = NIX_SPAN_MAPPING.lock().expect("not poisoned");
+	fn deref(&self) -> &Self::Target {
+		match self {
+			Fields::Inline(fields, len) => &fields[..*len],
+			Fields::Heap(fields) => fields,
+		}
+	}
+}
 
-		let span = if let Some(span) = graph_span {
-			#[cfg(feature = "indicatif")]
-			span.pb_start();
-			span
+fn emit_start(
+	activity_id: u64,
+	verbosity: Verbosity,
+	typ: ActivityType,
+	fields: &[FieldValue<'_>],
+	parent: u64,
+	s: &str,
+) {
+	let graph_span = if matches!(typ, ActivityType::Build) {
+		fields.first().and_then(|f| match f {
+			FieldValue::Str(drv_path) => ensure_drv_span(drv_path.path()),
+			_ => None,
+		})
+	} else {
+		None
+	};
+	let drv = graph_span.as_ref().map(|(id, _)| *id);
+
+	let span = if let Some((_, span)) = graph_span {
+		#[cfg(feature = "indicatif")]
+		span.pb_start();
+		span
+	} else {
+		let parent = ACTIVITIES.span(parent);
+		let _in_parent = parent.as_ref().map(|p| p.enter());
+		let level: Level = verbosity.into();
+		if level == Level::ERROR {
+			typ.format(fields, s, |v| error_span!("action", v))
+		} else if level == Level::WARN {
+			typ.format(fields, s, |v| warn_span!("action", v))
+		} else if level == Level::INFO {
+			typ.format(fields, s, |v| info_span!("action", v))
+		} else if level == Level::DEBUG {
+			typ.format(fields, s, |v| debug_span!("action", v))
 		} else {
-			let parent = mapping.get(&parent);
-			let _in_parent = parent.map(|p| p.enter());
-			let level: Level = self.verbosity.into();
-			if level == Level::ERROR {
-				self.typ
-					.format(&self.fields, s, |v| error_span!("action", v))
-			} else if level == Level::WARN {
-				self.typ
-					.format(&self.fields, s, |v| warn_span!("action", v))
-			} else if level == Level::INFO {
-				self.typ
-					.format(&self.fields, s, |v| info_span!("action", v))
-			} else if level == Level::DEBUG {
-				self.typ
-					.format(&self.fields, s, |v| debug_span!("action", v))
-			} else {
-				self.typ
-					.format(&self.fields, s, |v| trace_span!("action", v))
-			}
-		};
-		if !s.trim().is_empty() {
-			let s = ansi_filter(s);
-			#[cfg(feature = "indicatif")]
-			{
-				span.pb_set_message(&s);
-			}
-			let _e = span.enter();
-			let level: Level = self.verbosity.into();
-			if level == Level::ERROR {
-				error!(target: "nix", "{}", s)
-			} else if level == Level::WARN {
-				warn!(target: "nix", "{}", s)
-			} else if level == Level::INFO {
-				info!(target: "nix", "{}", s)
-			} else if level == Level::DEBUG {
-				debug!(target: "nix", "{}", s)
-			} else {
-				trace!(target: "nix", "{}", s)
-			}
+			typ.format(fields, s, |v| trace_span!("action", v))
+		}
+	};
+	if !s.trim().is_empty() {
+		let s = ansi::filter(s);
+		#[cfg(feature = "indicatif")]
+		{
+			span.pb_set_message(&s);
+		}
+		let _e = span.enter();
+		let level: Level = verbosity.into();
+		if level == Level::ERROR {
+			error!(target: "nix", "{}", s)
+		} else if level == Level::WARN {
+			warn!(target: "nix", "{}", s)
+		} else if level == Level::INFO {
+			info!(target: "nix", "{}", s)
+		} else if level == Level::DEBUG {
+			debug!(target: "nix", "{}", s)
 		} else {
-			#[cfg(feature = "indicatif")]
-			{
-				span.pb_start();
-			}
+			trace!(target: "nix", "{}", s)
+		}
+	} else {
+		#[cfg(feature = "indicatif")]
+		{
+			span.pb_start();
 		}
-		mapping.insert(self.activity_id, span);
 	}
-	fn emit_result(&mut self, ty: u32) {
-		let mapping = NIX_SPAN_MAPPING.lock().expect("not poisoned");
+	ACTIVITIES.insert(
+		activity_id,
+		ActivityEntry {
+			span,
+			drv,
+			phase: None,
+		},
+	);
+}
+fn emit_result(activity_id: u64, ty: u32, fields: &[FieldValue<'_>]) {
+	let mut shard = ACTIVITIES.shard(activity_id);
 
-		let Some(parent) = mapping.get(&self.activity_id) else {
-			panic!("unexpected result for dead parent");
-		};
+	// Activity was filtered out on the C++ side
+	let Some(entry) = shard.get_mut(&activity_id) else {
+		return;
+	};
 
-		let _in_parent = parent.enter();
-		let res = ResultType::from_int(ty);
+	let res = ResultType::from_int(ty);
+	use FieldValue::*;
+	if let (ResultType::SetPhase, [Str(phase)]) = (&res, fields) {
+		entry.finish_phase();
+		entry.phase = Some((phase_field(phase), Instant::now()));
+	}
+	let parent = &entry.span;
 
-		use FieldValue::*;
-		match (&res, self.fields.as_slice()) {
-			// ResultType::FileLinked => todo!(),
-			(ResultType::BuildLogLine, [Str(s)]) => {
-				let s = ansi_filter(s);
-				info!("{s}");
-			}
-			// ResultType::UntrustedPath => todo!(),
-			// ResultType::CorruptedPath => todo!(),
-			// ResultType::SetPhase => todo!(),
-			(ResultType::SetExpected, [Int(act_ty), Int(_expected)]) => {
-				let _act_ty = ActivityType::from_int(*act_ty as u32);
-			}
-			(ResultType::SetPhase, [Str(phase)]) => {
-				// parent.pb_set_message(phase);
-				debug!(target: "nix::phase", phase)
-			}
-			(ResultType::Progress, [Int(_done), Int(_expected), Int(_), Int(_)]) => {
-				#[cfg(feature = "indicatif")]
-				{
-					parent.pb_set_length(*_expected as u64);
-					parent.pb_set_position(*_done as u64);
-				}
+	// Progress bars are updated directly, other results are emitted as events inside of the span
+	let is_progress = matches!(res, ResultType::Progress | ResultType::SetExpected);
+	let _in_parent = (!is_progress).then(|| parent.enter());
+
+	match (&res, fields) {
+		// ResultType::FileLinked => todo!(),
+		(ResultType::BuildLogLine, [Str(s)]) => {
+			let s = ansi::filter(s);
+			info!("{s}");
+		}
+		// ResultType::UntrustedPath => todo!(),
+		// ResultType::CorruptedPath => todo!(),
+		// ResultType::SetPhase => todo!(),
+		(ResultType::SetExpected, [Int(act_ty), Int(_expected)]) => {
+			let _act_ty = ActivityType::from_int(*act_ty as u32);
+		}
+		(ResultType::SetPhase, [Str(phase)]) => {
+			// parent.pb_set_message(phase);
+			debug!(target: "nix::phase", phase = %phase)
+		}
+		(ResultType::Progress, [Int(_done), Int(_expected), Int(_), Int(_)]) => {
+			#[cfg(feature = "indicatif")]
+			{
+				parent.pb_set_length(*_expected);
+				parent.pb_set_position(*_done);
 			}
-			_ => warn!("unknown progress report: {:?}({:?})", &res, &self.fields),
 		}
+		_ => warn!("unknown progress report: {:?}({:?})", &res, fields),
 	}
 }
-fn new_start_activity(activity_id: u64, lvl: u32, typ: u32) -> Box<StartActivityBuilder> {
-	Box::new(StartActivityBuilder {
+
+/// Single-call entry point for `Logger::startActivity`.
+///
+/// # Safety
+/// `fields` should point to `fields_len` valid fields, and `s` to `s_len` bytes,
+/// both only need to live for the duration of the call.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn fleet_nix_emit_start(
+	activity_id: u64,
+	lvl: u32,
+	typ: u32,
+	fields: *const NixField,
+	fields_len: usize,
+	parent: u64,
+	s: *const u8,
+	s_len: usize,
+) {
+	refresh_stale_log_filter();
+	let fields = unsafe { Fields::from_raw(fields, fields_len) };
+	let s = String::from_utf8_lossy(unsafe { raw_bytes(s, s_len) });
+	emit_start(
 		activity_id,
-		verbosity: Verbosity::from_int(lvl),
-		typ: ActivityType::from_int(typ),
-		fields: vec![],
-	})
+		Verbosity::from_int(lvl),
+		ActivityType::from_int(typ),
+		&fields,
+		parent,
+		&s,
+	);
+}
+
+/// Single-call entry point for `Logger::result`.
+///
+/// # Safety
+/// `fields` should point to `fields_len` valid fields, which only need to live for the duration of the call.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn fleet_nix_emit_result(
+	activity_id: u64,
+	ty: u32,
+	fields: *const NixField,
+	fields_len: usize,
+) {
+	refresh_stale_log_filter();
+	let fields = unsafe { Fields::from_raw(fields, fields_len) };
+	emit_result(activity_id, ty, &fields);
 }
 
 fn emit_warn(v: &str) {
 	warn!(target: "nix::eval", "{v}")
 }
 fn emit_stop(v: u64) {
-	{
-		let mut mapping = NIX_SPAN_MAPPING.lock().expect("not poisoned");
-		mapping.remove(&v);
-	}
-	if let Some(drv_path) = ACTIVITY_TO_DRV.lock().expect("not poisoned").remove(&v) {
-		if let Some(entry) = DRV_GRAPH.lock().expect("not poisoned").get_mut(&drv_path) {
-			entry.span = None;
+	let Some(mut entry) = ACTIVITIES.remove(v) else {
+		return;
+	};
+	entry.finish_phase();
+	if let Some(drv) = entry.drv {
+		let graph = BUILD_GRAPH.read().expect("not poisoned");
+		if let Some(node) = graph.nodes.get(&drv) {
+			*node.span.lock().expect("not poisoned") = None;
 		}
 	}
 }
 fn emit_log(lvl: u32, v: &[u8]) {
+	refresh_stale_log_filter();
 	let verbosity = Verbosity::from_int(lvl);
 	let level: Level = verbosity.into();
 	let v = String::from_utf8_lossy(v);
@@ -586,123 +1053,547 @@ fn emit_log(lvl: u32, v: &[u8]) {
 	}
 }
 
-struct AnsiFiltered {
-	output: String,
+pub struct ErrorInfoBuilder {
+	level: Level,
+	msg: String,
+	trace: UniquePtr<nix_logging_cxx::ErrorTrace>,
+}
+fn new_error_info(
+	lvl: u32,
+	v: &[u8],
+	trace: UniquePtr<nix_logging_cxx::ErrorTrace>,
+) -> Box<ErrorInfoBuilder> {
+	let verbosity = Verbosity::from_int(lvl);
+	let level: Level = verbosity.into();
+	let v = String::from_utf8_lossy(v);
+	Box::new(ErrorInfoBuilder {
+		level,
+		msg: v.to_string(),
+		trace,
+	})
 }
-impl vte::Perform for AnsiFiltered {
-	fn print(&mut self, c: char) {
-		self.output.push(c);
+impl ErrorInfoBuilder {
+	fn emit_error_info(&mut self) {
+		error!("{}", self.msg);
+		for entry in trace_entries(&self.trace) {
+			error!("  {}", TraceEntry(&self.trace, entry))
+		}
 	}
 
-	fn execute(&mut self, byte: u8) {
-		// We don't want \r, bells, etc
-		if byte == b'\n' {
-			self.output.push('\n');
-		} else if byte == b'\t' {
-			// TODO: align output to the correct multiplier?
-			self.output.push('\t');
+	/// Attaches trace frames to the error message as context, innermost first.
+	///
+	/// Frames are only rendered when the error is displayed.
+	pub(crate) fn into_error(self, msg: &str) -> anyhow::Error {
+		let mut entries = trace_entries(&self.trace).collect::<Vec<_>>();
+		let Some(outermost) = entries.pop() else {
+			return anyhow!("{msg}");
+		};
+		let trace = Arc::new(Mutex::new(self.trace));
+		let mut source: Box<dyn std::error::Error + Send + Sync> = msg.into();
+		for frame in entries {
+			source = Box::new(TraceLink {
+				trace: trace.clone(),
+				frame,
+				source,
+			});
 		}
+		anyhow::Error::new(TraceLink {
+			trace,
+			frame: outermost,
+			source,
+		})
 	}
+}
 
-	fn osc_dispatch(&mut self, _params: &[&[u8]], _bell_terminated: bool) {}
-	fn esc_dispatch(&mut self, _intermediates: &[u8], _ignore: bool, _byte: u8) {}
+unsafe impl Send for nix_logging_cxx::ErrorTrace {}
+
+/// Frame indices of the trace, None stands for the omitted frames.
+fn trace_entries(trace: &nix_logging_cxx::ErrorTrace) -> impl Iterator<Item = Option<usize>> {
+	let after = trace.omitted_after();
+	let omitted = (trace.omitted() != 0).then_some(None);
+	(0..after)
+		.map(Some)
+		.chain(omitted)
+		.chain((after..trace.size()).map(Some))
+}
 
-	fn csi_dispatch(
-		&mut self,
-		params: &vte::Params,
-		_intermediates: &[u8],
-		_ignore: bool,
-		action: char,
-	) {
-		use std::fmt::Write;
-		if action != 'm' {
-			// Only plain colors are enabled, everything other might corrupt the output
-			return;
+struct TraceEntry<'t>(&'t nix_logging_cxx::ErrorTrace, Option<usize>);
+impl Display for TraceEntry<'_> {
+	fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+		let trace = self.0;
+		let Some(i) = self.1 else {
+			return write!(f, "({} frames omitted)", trace.omitted());
+		};
+		let pos = trace.position(i);
+		if pos.is_empty() {
+			write!(f, "{}", trace.message(i))?;
+		} else {
+			write!(f, "{} at {pos}", trace.message(i))?;
 		}
-		self.output.push_str("\x1b[");
-		for (i, par) in params.iter().enumerate() {
-			if i != 0 {
-				let _ = write!(self.output, ";");
-			}
-			for (i, sub) in par.iter().enumerate() {
-				if i != 0 {
-					let _ = write!(self.output, ":");
-				}
-				let _ = write!(self.output, "{sub}");
-			}
+		match trace.repeats(i) {
+			1 => Ok(()),
+			n => write!(f, " ({n} times)"),
 		}
-		self.output.push(action);
 	}
 }
-fn ansi_filter(i: &str) -> String {
-	let mut out = AnsiFiltered {
-		output: String::new(),
-	};
-	let mut parser = Parser::new();
 
-	// For some reason it gets stuck with longer inputs
-	for chunk in i.as_bytes().chunks(50) {
-		parser.advance(&mut out, chunk);
+/// Error trace frame in the anyhow error chain.
+struct TraceLink {
+	trace: Arc<Mutex<UniquePtr<nix_logging_cxx::ErrorTrace>>>,
+	frame: Option<usize>,
+	source: Box<dyn std::error::Error + Send + Sync>,
+}
+impl Display for TraceLink {
+	fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+		let trace = self.trace.lock().expect("not poisoned");
+		TraceEntry(&trace, self.frame).fmt(f)
 	}
+}
+impl fmt::Debug for TraceLink {
+	fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+		Display::fmt(self, f)
+	}
+}
+impl std::error::Error for TraceLink {
+	fn source(&self) -> Option<&(dyn std::error::Error + 'static)> {
+		Some(&*self.source)
+	}
+}
 
-	out.output
+/// Id of the span, which is current on the thread producing a buffered nix
+/// event, 0 if there is none.
+///
+/// The span is kept open by the returned id, until it is passed to
+/// exit_captured_span or release_captured_span.
+fn capture_span() -> u64 {
+	dispatcher::get_default(|d| match d.current_span().id() {
+		Some(id) => d.clone_span(id).into_u64(),
+		None => 0,
+	})
+}
+/// Enters the captured span on the drain thread.
+fn enter_captured_span(id: u64) {
+	dispatcher::get_default(|d| d.enter(&Id::from_u64(id)));
+}
+/// Exits the captured span, and releases it.
+fn exit_captured_span(id: u64) {
+	dispatcher::get_default(|d| {
+		let id = Id::from_u64(id);
+		d.exit(&id);
+		d.try_close(id);
+	});
+}
+/// Releases the captured span of a dropped event.
+fn release_captured_span(id: u64) {
+	dispatcher::get_default(|d| d.try_close(Id::from_u64(id)));
 }
 
-#[derive(Debug)]
-pub struct StackFrame {
-	pub msg: String,
-	pub pos: String,
+/// What to do when the per-thread event ring is full.
+#[derive(Clone, Copy, Debug, Default)]
+pub enum Backpressure {
+	/// Wait for the drain thread to catch up.
+	#[default]
+	Block = 0,
+	/// Drop progress updates and debug logs, wait for everything else.
+	DropProgress = 1,
 }
 
-#[derive(Debug)]
-pub struct ErrorInfoBuilder {
-	level: Level,
-	msg: String,
-	pub stack_frames: Vec<StackFrame>,
+#[derive(Clone, Copy, Debug)]
+pub enum LoggerMode {
+	/// Nix events are converted to tracing on the thread that produced them.
+	Sync,
+	/// Nix events are written to per-thread rings, and converted to tracing by a single drain thread.
+	Buffered {
+		/// Per-thread ring size in bytes, rounded up to a power of two.
+		ring_capacity: usize,
+		backpressure: Backpressure,
+	},
 }
-fn new_error_info(lvl: u32, v: &[u8]) -> Box<ErrorInfoBuilder> {
-	let verbosity = Verbosity::from_int(lvl);
-	let level: Level = verbosity.into();
-	let v = String::from_utf8_lossy(v);
-	Box::new(ErrorInfoBuilder {
-		level,
-		msg: v.to_string(),
-		stack_frames: Vec::new(),
-	})
+
+/// Replaces nix logger, should only be called after `init_libraries`.
+pub fn set_logger_mode(mode: LoggerMode) {
+	match mode {
+		LoggerMode::Sync => nix_logging_cxx::apply_tracing_logger(),
+		LoggerMode::Buffered {
+			ring_capacity,
+			backpressure,
+		} => nix_logging_cxx::apply_buffered_tracing_logger(ring_capacity, backpressure as u8),
+	}
+	refresh_log_filter();
 }
-impl ErrorInfoBuilder {
-	fn push_stack_frame(&mut self, v: &[u8], pos: &[u8]) {
-		let v = String::from_utf8_lossy(v);
-		let pos = String::from_utf8_lossy(pos);
-		self.stack_frames.push(StackFrame {
-			msg: v.to_string(),
-			pos: pos.to_string(),
+
+/// Waits until all buffered nix events are converted to tracing.
+pub fn flush_logger() {
+	nix_logging_cxx::flush_tracing_logger();
+}
+
+/// Size of the sparse file reserved for activity recording, unused tail is truncated on stop.
+const ACTIVITY_RECORDING_CAPACITY: u64 = 4 << 30;
+
+/// Starts writing every nix activity event into a binary file, regardless of the log filter.
+///
+/// The file can be read with [`crate::recording::Recording`].
+pub fn start_activity_recording(path: &Path) -> anyhow::Result<()> {
+	let path = path
+		.to_str()
+		.ok_or_else(|| anyhow!("non-utf8 recording path: {}", path.display()))?;
+	nix_logging_cxx::start_activity_recording(path, ACTIVITY_RECORDING_CAPACITY)?;
+	Ok(())
+}
+
+/// Finishes activity recording started with [`start_activity_recording`].
+pub fn stop_activity_recording() {
+	let dropped = nix_logging_cxx::stop_activity_recording();
+	if dropped != 0 {
+		warn!("activity recording is full, {dropped} events were dropped");
+	}
+}
+
+/// Starts storing output of every nix build as a zstd-compressed file in `dir`, indexed by
+/// derivation and build owner (see [`register_build_graph`] and [`build_log_owner`]).
+///
+/// Only the last `tail_lines` lines of a build are shown, once it stops, 0 hides the output of
+/// stored builds. Stored logs can be read with [`crate::build_logs`].
+pub fn open_build_log_store(dir: &Path, tail_lines: usize) -> anyhow::Result<()> {
+	let dir = dir
+		.to_str()
+		.ok_or_else(|| anyhow!("non-utf8 build log directory: {}", dir.display()))?;
+	nix_logging_cxx::open_build_log_store(dir, tail_lines)?;
+	Ok(())
+}
+
+/// Shows build output only as a part of build errors, no lines are forwarded to tracing.
+///
+/// The logger then reports itself as non-verbose to nix, which keeps the last `log-lines`
+/// (nix setting) lines of every build, and includes them into the error of a failed one.
+/// Nix may also print less of its own output for a non-verbose logger.
+pub fn set_build_log_tail_on_failure(enabled: bool) {
+	nix_logging_cxx::set_build_log_tail_on_failure(enabled);
+}
+
+/// Stops storing build logs, started with [`open_build_log_store`].
+pub fn close_build_log_store() {
+	nix_logging_cxx::close_build_log_store();
+}
+
+/// Resets build log owner of the current thread on drop.
+pub struct BuildLogOwner(());
+impl Drop for BuildLogOwner {
+	fn drop(&mut self) {
+		nix_logging_cxx::set_build_log_owner("");
+	}
+}
+
+/// Builds started on the current thread are stored as owned by `owner` (fleet host name)
+/// until the guard is dropped, instead of owners from [`register_build_graph`]. Activities
+/// started by them are timed as owned by it too, see [`start_activity_timings`].
+pub fn build_log_owner(owner: &str) -> BuildLogOwner {
+	nix_logging_cxx::set_build_log_owner(owner);
+	BuildLogOwner(())
+}
+
+/// Nix activity doing the work, collected with [`start_activity_timings`].
+pub struct TimedActivity {
+	pub ty: ActivityType,
+	/// Derivation name for builds, store path name for substitutions and copies, url for
+	/// downloads.
+	pub subject: String,
+	/// Builder, substituter, or copy destination.
+	pub host: Option<String>,
+	/// Time since the collection start, activities which didn't stop end with the collection.
+	pub time: Range<Duration>,
+}
+
+/// Activities of a single fleet host.
+pub struct OwnerTimings {
+	/// Fleet host, see [`register_build_graph`], empty if unknown.
+	pub owner: String,
+	/// From the first activity start, to the last activity stop.
+	pub time: Range<Duration>,
+	/// Activities, each one starting after the previous one stopped, ending with the last
+	/// stopped activity. Each activity is the latest one, that stopped before the next started.
+	pub critical_path: Vec<TimedActivity>,
+	/// Total time of activities, waiting for a build machine.
+	pub waiting: Duration,
+	pub building: Duration,
+	pub substituting: Duration,
+	pub copying: Duration,
+}
+
+/// Time spent in a build phase (stdenv `unpackPhase`, `checkPhase`...) by all builds.
+pub struct PhaseTotal {
+	/// Phase name without the `Phase` suffix
+	pub name: String,
+	pub builds: usize,
+	pub total: Duration,
+	pub longest: Duration,
+}
+
+/// Phase of a single build, each phase lasts until the next one starts, or the build stops.
+pub struct SlowPhase {
+	/// Fleet hosts, see [`register_build_graph`], a single empty one if unknown.
+	pub owners: Vec<String>,
+	/// Derivation name
+	pub drv: String,
+	pub name: String,
+	pub took: Duration,
+}
+
+/// Summary of nix activities, collected with [`start_activity_timings`].
+pub struct ActivityTimings {
+	pub owners: Vec<OwnerTimings>,
+	pub phases: Vec<PhaseTotal>,
+	/// Slowest phases of single builds, slowest first.
+	pub slowest_phases: Vec<SlowPhase>,
+}
+
+/// Starts collecting start and stop times of builds, substitutions, copies and downloads,
+/// regardless of the log filter.
+///
+/// Activities are summarized as they stop, keeping `slowest_phases` slowest build phases.
+pub fn start_activity_timings(slowest_phases: usize) -> anyhow::Result<()> {
+	nix_logging_cxx::start_activity_timings(slowest_phases)?;
+	Ok(())
+}
+
+/// Stops collection started with [`start_activity_timings`], and returns the summary.
+pub fn take_activity_timings() -> ActivityTimings {
+	let summary = nix_logging_cxx::take_activity_timings();
+	let ns = Duration::from_nanos;
+	let owners = summary
+		.owners
+		.into_iter()
+		.map(|o| OwnerTimings {
+			owner: o.owner,
+			time: ns(o.start_ns)..ns(o.stop_ns),
+			critical_path: o
+				.critical_path
+				.into_iter()
+				.map(|t| {
+					let ty = ActivityType::from_int(t.ty);
+					let subject = match ty {
+						ActivityType::BuildWaiting => {
+							parse_drv(parse_build_waiting(&t.subject).unwrap_or(&t.subject))
+						}
+						ActivityType::FileTransfer => &t.subject,
+						_ => parse_drv(&t.subject),
+					};
+					let host = match ty {
+						ActivityType::BuildWaiting | ActivityType::FileTransfer => None,
+						_ => Some(parse_host(&t.host).to_owned()),
+					};
+					TimedActivity {
+						ty,
+						subject: subject.to_owned(),
+						host,
+						time: ns(t.start_ns)..ns(t.stop_ns),
+					}
+				})
+				.collect(),
+			waiting: ns(o.waiting_ns),
+			building: ns(o.build_ns),
+			substituting: ns(o.substitute_ns),
+			copying: ns(o.copy_ns),
+		})
+		.collect();
+	let mut phases = BTreeMap::<&str, PhaseTotal>::new();
+	for p in &summary.phases {
+		let name = phase_name(&p.name);
+		let total = phases.entry(name).or_insert_with(|| PhaseTotal {
+			name: name.to_owned(),
+			builds: 0,
+			total: Duration::ZERO,
+			longest: Duration::ZERO,
 		});
+		total.builds += p.builds as usize;
+		total.total += ns(p.total_ns);
+		total.longest = total.longest.max(ns(p.longest_ns));
 	}
-	fn emit_error_info(&mut self) {
-		error!("{}", self.msg);
-		for frame in &self.stack_frames {
-			error!("  {} at {}", frame.msg, frame.pos)
+	let slowest_phases = summary
+		.slowest_phases
+		.iter()
+		.map(|p| SlowPhase {
+			owners: p.owners.clone(),
+			drv: parse_drv(&p.subject).to_owned(),
+			name: phase_name(&p.name).to_owned(),
+			took: ns(p.took_ns),
+		})
+		.collect();
+	ActivityTimings {
+		owners,
+		phases: phases.into_values().collect(),
+		slowest_phases,
+	}
+}
+
+/// Substituter queries, downloads and copies of a host, collected with
+/// [`start_transfer_metrics`].
+pub struct TransferMetrics {
+	/// Substituter, or copy source/destination.
+	pub host: String,
+	/// Path info queries, sent to the host as a substituter.
+	pub queries: u64,
+	/// Paths substituted from the host.
+	pub substitutes: u64,
+	pub downloads: u64,
+	pub download_bytes: u64,
+	/// Time, when at least one download was running.
+	pub download_time: Duration,
+	pub copies: u64,
+	pub copy_bytes: u64,
+	/// Time, when at least one copy was running.
+	pub copy_time: Duration,
+	/// Query latency histogram, bucket `i` counts queries which took less than `2^i` ms, the last
+	/// one counts all the slower queries.
+	pub latency: Vec<u64>,
+}
+impl TransferMetrics {
+	/// Share of queries, which ended with the path being substituted from the host.
+	pub fn hit_ratio(&self) -> Option<f64> {
+		(self.queries != 0).then(|| self.substitutes as f64 / self.queries as f64)
+	}
+	/// Bytes per second, while downloads were running.
+	pub fn download_rate(&self) -> Option<f64> {
+		(!self.download_time.is_zero())
+			.then(|| self.download_bytes as f64 / self.download_time.as_secs_f64())
+	}
+	/// Bytes per second, while copies were running.
+	pub fn copy_rate(&self) -> Option<f64> {
+		(!self.copy_time.is_zero()).then(|| self.copy_bytes as f64 / self.copy_time.as_secs_f64())
+	}
+	/// Upper bound of the `q` (0..=1) quantile of query latency, `None` for the last bucket.
+	pub fn latency_quantile(&self, q: f64) -> Option<Duration> {
+		let total = self.latency.iter().sum::<u64>();
+		let target = (total as f64 * q).ceil().max(1.0) as u64;
+		let mut seen = 0;
+		for (i, count) in self.latency.iter().enumerate() {
+			seen += count;
+			if seen >= target {
+				return (i + 1 < self.latency.len()).then(|| Duration::from_millis(1 << i));
+			}
 		}
+		None
 	}
 }
 
+/// Starts collecting per-host counters of substituter queries, downloads and copies, regardless
+/// of the log filter.
+pub fn start_transfer_metrics() -> anyhow::Result<()> {
+	nix_logging_cxx::start_transfer_metrics()?;
+	Ok(())
+}
+
+/// Stops collection started with [`start_transfer_metrics`], and returns the counters.
+pub fn take_transfer_metrics() -> Vec<TransferMetrics> {
+	let mut out = nix_logging_cxx::take_transfer_metrics()
+		.into_iter()
+		.map(|t| TransferMetrics {
+			host: parse_host(&t.host).to_owned(),
+			queries: t.queries,
+			substitutes: t.substitutes,
+			downloads: t.downloads,
+			download_bytes: t.download_bytes,
+			download_time: Duration::from_nanos(t.download_ns),
+			copies: t.copies,
+			copy_bytes: t.copy_bytes,
+			copy_time: Duration::from_nanos(t.copy_ns),
+			latency: t.latency,
+		})
+		.collect::<Vec<_>>();
+	out.sort_by(|a, b| a.host.cmp(&b.host));
+	out
+}
+
+/// Limits how many frames of nix error traces are kept, frames next to the error and the
+/// outermost ones are preferred. 0 keeps all frames.
+pub fn set_error_trace_depth(depth: usize) {
+	nix_logging_cxx::set_error_trace_depth(depth);
+}
+
+/// Forwards every nix event to tracing until the next filter refresh.
+#[doc(hidden)]
+pub fn forward_all_nix_events() {
+	nix_logging_cxx::reset_log_filter();
+}
+
+/// Argument of the activity text pattern, used for activity span, if any pattern matches.
+#[doc(hidden)]
+pub fn match_activity_text(ty: ActivityType, s: &str) -> Option<&str> {
+	activity_text::find(ty, s).map(|(_, arg)| arg)
+}
+
 #[cxx::bridge]
 pub mod nix_logging_cxx {
-	extern "Rust" {
-		type StartActivityBuilder;
-		fn new_start_activity(activity_id: u64, lvl: u32, typ: u32) -> Box<StartActivityBuilder>;
-		fn add_int_field(&mut self, i: i32);
-		fn add_string_field(&mut self, v: &[u8]);
-		fn emit(&mut self, parent: u64, s: &str);
-		fn emit_result(&mut self, ty: u32);
+	/// Per-host counters of `TransferMetrics` in logging_transfers.cc
+	struct HostTransfers {
+		host: String,
+		queries: u64,
+		substitutes: u64,
+		downloads: u64,
+		download_bytes: u64,
+		download_ns: u64,
+		copies: u64,
+		copy_bytes: u64,
+		copy_ns: u64,
+		latency: Vec<u64>,
+	}
+	/// Step of a critical path, timed by `ActivityTimings` in logging_timings.cc
+	struct ActivityTiming {
+		ty: u32,
+		/// First field of the activity, or its text for `BuildWaiting`
+		subject: String,
+		host: String,
+		start_ns: u64,
+		stop_ns: u64,
+	}
+	/// Activities of a single owner
+	struct OwnerTiming {
+		owner: String,
+		start_ns: u64,
+		stop_ns: u64,
+		critical_path: Vec<ActivityTiming>,
+		waiting_ns: u64,
+		build_ns: u64,
+		substitute_ns: u64,
+		copy_ns: u64,
+	}
+	/// Totals of a build phase, by its name as reported by the builder
+	struct PhaseTiming {
+		name: String,
+		builds: u64,
+		total_ns: u64,
+		longest_ns: u64,
+	}
+	struct SlowPhaseTiming {
+		owners: Vec<String>,
+		subject: String,
+		name: String,
+		took_ns: u64,
+	}
+	struct TimingsSummary {
+		owners: Vec<OwnerTiming>,
+		phases: Vec<PhaseTiming>,
+		/// Slowest first
+		slowest_phases: Vec<SlowPhaseTiming>,
 	}
 	extern "Rust" {
 		type ErrorInfoBuilder;
-		fn new_error_info(lvl: u32, v: &[u8]) -> Box<ErrorInfoBuilder>;
-		fn push_stack_frame(&mut self, v: &[u8], pos: &[u8]);
+		fn new_error_info(
+			lvl: u32,
+			v: &[u8],
+			trace: UniquePtr<ErrorTrace>,
+		) -> Box<ErrorInfoBuilder>;
 		fn emit_error_info(&mut self);
 	}
+	extern "Rust" {
+		fn build_graph_owners(path: &str) -> Vec<String>;
+	}
+	extern "Rust" {
+		fn capture_span() -> u64;
+		fn enter_captured_span(id: u64);
+		fn exit_captured_span(id: u64);
+		fn release_captured_span(id: u64);
+	}
 	extern "Rust" {
 		fn emit_warn(v: &str);
 		fn emit_stop(id: u64);
@@ -712,8 +1603,34 @@ pub mod nix_logging_cxx {
 		include!("nix-eval/src/logging.hh");
 
 		type nix_c_context = crate::nix_raw::c_context;
+		type ErrorTrace;
+		type BuildLogReader;
 
 		fn apply_tracing_logger();
+		fn apply_buffered_tracing_logger(ring_capacity: usize, policy: u8);
+		fn flush_tracing_logger();
+		fn set_log_filter(logs: u8, actions: u8, activities: u64, generic: u64, results: u64);
+		fn reset_log_filter();
+		fn set_error_trace_depth(depth: usize);
+		fn size(self: &ErrorTrace) -> usize;
+		fn message(self: &ErrorTrace, i: usize) -> String;
+		fn position(self: &ErrorTrace, i: usize) -> String;
+		fn repeats(self: &ErrorTrace, i: usize) -> usize;
+		fn omitted(self: &ErrorTrace) -> usize;
+		#[cxx_name = "omittedAfter"]
+		fn omitted_after(self: &ErrorTrace) -> usize;
+		fn start_activity_recording(path: &str, capacity: u64) -> Result<()>;
+		fn stop_activity_recording() -> u64;
+		fn open_build_log_store(dir: &str, tail_lines: usize) -> Result<()>;
+		fn close_build_log_store();
+		fn set_build_log_tail_on_failure(enabled: bool);
+		fn set_build_log_owner(owner: &str);
+		fn start_activity_timings(slowest_phases: usize) -> Result<()>;
+		fn take_activity_timings() -> TimingsSummary;
+		fn start_transfer_metrics() -> Result<()>;
+		fn take_transfer_metrics() -> Vec<HostTransfers>;
+		fn open_build_log(path: &str) -> Result<UniquePtr<BuildLogReader>>;
+		fn read(self: Pin<&mut BuildLogReader>) -> Result<&[u8]>;
 		unsafe fn extract_error_info(ctx: *const nix_c_context) -> Box<ErrorInfoBuilder>;
 	}
 }
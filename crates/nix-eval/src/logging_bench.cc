@@ -0,0 +1,181 @@
+#include "logging_bench.hh"
+#include <nix/util/logging.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace nix;
+
+void replay_synthetic_activities(uint64_t activities, uint32_t threads) {
+  threads = std::max<uint32_t>(threads, 1);
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads; ++t) {
+    workers.emplace_back([=] {
+      uint64_t count = activities / threads + (t < activities % threads);
+      for (uint64_t i = 0; i < count; ++i) {
+        auto path = std::format("/nix/store/{:032}-synthetic-{}", i, t);
+        Activity act(*logger, lvlTalkative, actCopyPath, "",
+                     Logger::Fields{path, "local", "ssh-ng://synthetic"});
+        for (uint64_t done = 1024; done <= 4096; done += 1024) {
+          act.progress(done, 4096);
+        }
+        act.result(resBuildLogLine, "synthetic build output");
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+void replay_synthetic_builds(rust::Slice<const rust::String> drvs,
+                             uint32_t threads) {
+  threads = std::max<uint32_t>(threads, 1);
+  std::atomic<size_t> next = 0;
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&] {
+      for (size_t i; (i = next.fetch_add(1)) < drvs.size();) {
+        std::string drv(drvs[i]);
+        Activity act(*logger, lvlInfo, actBuild, "",
+                     Logger::Fields{drv, "", 1, 1});
+        for (auto phase : {"unpackPhase", "buildPhase", "installPhase"}) {
+          act.result(resSetPhase, phase);
+          for (int line = 0; line < 10; ++line) {
+            act.result(resBuildLogLine, "synthetic build output");
+          }
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+LoggerStress stress_tracing_logger(rust::Slice<const LoggerCall> calls,
+                                   uint32_t threads, uint32_t rounds) {
+  struct Call {
+    LoggerCallKind kind;
+    Verbosity lvl;
+    uint32_t type;
+    // Dense activity index, 0 for none
+    uint64_t act;
+    uint64_t parent;
+    std::string text;
+    Logger::Fields fields;
+    std::optional<ErrorInfo> error;
+  };
+  // Activity ids are remapped, so every thread and round gets its own ones
+  std::unordered_map<uint64_t, uint64_t> ids;
+  auto index = [&](uint64_t act) -> uint64_t {
+    return act == 0 ? 0 : ids.try_emplace(act, ids.size() + 1).first->second;
+  };
+  std::vector<Call> prepared;
+  prepared.reserve(calls.size());
+  for (auto &call : calls) {
+    Call c{
+        .kind = call.kind,
+        .lvl = Verbosity(call.lvl),
+        .type = call.ty,
+        .act = index(call.activity),
+        .parent = index(call.parent),
+        .text = std::string(call.text),
+    };
+    for (auto &f : call.fields) {
+      if (f.string) {
+        c.fields.emplace_back(std::string(f.s));
+      } else {
+        c.fields.emplace_back(f.i);
+      }
+    }
+    if (c.kind == LoggerCallKind::Error) {
+      c.error = ErrorInfo{.level = c.lvl, .msg = HintFmt(c.text)};
+    }
+    prepared.push_back(std::move(c));
+  }
+
+  threads = std::max<uint32_t>(threads, 1);
+  rounds = std::max<uint32_t>(rounds, 1);
+  std::vector<std::vector<uint32_t>> latencies(threads);
+  std::atomic<uint32_t> ready = 0;
+  std::atomic<bool> go = false;
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      auto &out = latencies[t];
+      out.reserve(prepared.size() * rounds);
+      ready.fetch_add(1);
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      for (uint32_t r = 0; r < rounds; ++r) {
+        uint64_t base = (uint64_t(t) * rounds + r + 1) << 40;
+        auto id = [&](uint64_t act) { return act == 0 ? 0 : base | act; };
+        for (auto &c : prepared) {
+          auto start = std::chrono::steady_clock::now();
+          switch (c.kind) {
+          case LoggerCallKind::Log:
+            logger->log(c.lvl, c.text);
+            break;
+          case LoggerCallKind::Error:
+            logger->logEI(*c.error);
+            break;
+          case LoggerCallKind::Start:
+            logger->startActivity(id(c.act), c.lvl, ActivityType(c.type),
+                                  c.text, c.fields, id(c.parent));
+            break;
+          case LoggerCallKind::Stop:
+            logger->stopActivity(id(c.act));
+            break;
+          case LoggerCallKind::Result:
+            logger->result(id(c.act), ResultType(c.type), c.fields);
+            break;
+          default:
+            break;
+          }
+          out.push_back(
+              uint32_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count()));
+        }
+      }
+    });
+  }
+  while (ready.load() != threads) {
+    std::this_thread::yield();
+  }
+  auto started = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - started;
+
+  std::vector<uint32_t> all;
+  for (auto &l : latencies) {
+    all.insert(all.end(), l.begin(), l.end());
+  }
+  auto percentile = [&](double p) -> uint64_t {
+    if (all.empty()) {
+      return 0;
+    }
+    auto nth = all.begin() + size_t(double(all.size() - 1) * p);
+    std::nth_element(all.begin(), nth, all.end());
+    return *nth;
+  };
+  return LoggerStress{
+      .calls = all.size(),
+      .elapsed_ns = uint64_t(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+              .count()),
+      .p50_ns = percentile(0.5),
+      .p99_ns = percentile(0.99),
+  };
+}
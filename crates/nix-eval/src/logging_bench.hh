@@ -0,0 +1,10 @@
+#pragma once
+#include "rust/cxx.h"
+
+#include "nix-eval/src/logging_bench.rs"
+
+void replay_synthetic_activities(uint64_t activities, uint32_t threads);
+void replay_synthetic_builds(rust::Slice<const rust::String> drvs,
+                             uint32_t threads);
+LoggerStress stress_tracing_logger(rust::Slice<const LoggerCall> calls,
+                                   uint32_t threads, uint32_t rounds);
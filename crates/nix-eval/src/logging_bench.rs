@@ -0,0 +1,66 @@
+//! Drivers for logger benchmarks, calling the current nix logger from C++ threads.
+//!
+//! Only built with the `bench` feature, see logging_bench.cc.
+
+/// Pushes a synthetic stream of copy activities through the current nix logger.
+pub fn replay_synthetic_activities(activities: u64, threads: u32) {
+	nix_logging_bench_cxx::replay_synthetic_activities(activities, threads);
+}
+
+/// Runs build activities for the given derivations through the current nix logger,
+/// `threads` builds at a time.
+pub fn replay_synthetic_builds(drvs: &[String], threads: u32) {
+	nix_logging_bench_cxx::replay_synthetic_builds(drvs, threads);
+}
+
+pub use nix_logging_bench_cxx::{CallField, LoggerCall, LoggerCallKind, LoggerStress};
+
+/// Replays nix logger calls through the current nix logger from `threads` threads at once,
+/// every thread repeats the whole sequence `rounds` times with its own activity ids.
+pub fn stress_tracing_logger(calls: &[LoggerCall], threads: u32, rounds: u32) -> LoggerStress {
+	nix_logging_bench_cxx::stress_tracing_logger(calls, threads, rounds)
+}
+
+#[cxx::bridge]
+mod nix_logging_bench_cxx {
+	/// Nix logger method, called by `stress_tracing_logger`
+	#[repr(u8)]
+	enum LoggerCallKind {
+		Log,
+		/// `logEI` with the call text as the message
+		Error,
+		Start,
+		Stop,
+		Result,
+	}
+	struct CallField {
+		string: bool,
+		i: u64,
+		s: String,
+	}
+	struct LoggerCall {
+		kind: LoggerCallKind,
+		lvl: u32,
+		/// Activity or result type
+		ty: u32,
+		activity: u64,
+		parent: u64,
+		/// Log line, error message or activity text
+		text: String,
+		fields: Vec<CallField>,
+	}
+	struct LoggerStress {
+		calls: u64,
+		elapsed_ns: u64,
+		/// Per-call latency percentiles
+		p50_ns: u64,
+		p99_ns: u64,
+	}
+	unsafe extern "C++" {
+		include!("nix-eval/src/logging_bench.hh");
+
+		fn replay_synthetic_activities(activities: u64, threads: u32);
+		fn replay_synthetic_builds(drvs: &[String], threads: u32);
+		fn stress_tracing_logger(calls: &[LoggerCall], threads: u32, rounds: u32) -> LoggerStress;
+	}
+}
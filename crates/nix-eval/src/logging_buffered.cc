@@ -0,0 +1,614 @@
+#include "logging_internal.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <format>
+#include <ranges>
+#include <unordered_set>
+
+using namespace nix;
+using namespace fleet_logging;
+
+namespace {
+
+enum class EventKind : uint8_t { Log, Error, Warn, Start, Stop, Result };
+
+enum class Backpressure : uint8_t {
+  // Producer waits for the drain thread to free space.
+  Block = 0,
+  // Progress-like events and debug logs are dropped, everything else blocks.
+  DropProgress = 1,
+};
+
+// Fixed part of every queued event. It is followed by `textLen` bytes of
+// text and `fieldCount` fields, each one being either a tag byte and
+// uint64_t, or a tag byte, uint32_t length and string bytes.
+struct EventHeader {
+  // Global order of events, used to merge per-thread rings.
+  uint64_t seq;
+  ActivityId act;
+  ActivityId parent;
+  // Id of the span, that was current on the producing thread, 0 for none.
+  // Owned by the record.
+  uint64_t span;
+  uint32_t type;
+  uint32_t textLen;
+  uint16_t fieldCount;
+  EventKind kind;
+  uint8_t lvl;
+};
+
+rust::Slice<const unsigned char> bytes(std::string_view s) {
+  return rust::Slice<const unsigned char>(
+      reinterpret_cast<const unsigned char *>(s.data()), s.size());
+}
+
+// Cuts string to at most `max` bytes, not splitting utf-8 sequences.
+std::string_view utf8Prefix(std::string_view s, size_t max) {
+  if (s.size() <= max) {
+    return s;
+  }
+  while (max > 0 && (static_cast<uint8_t>(s[max]) & 0xc0) == 0x80) {
+    --max;
+  }
+  return s.substr(0, max);
+}
+
+// Keeps the captured span entered on the drain thread, releasing it on exit.
+struct CapturedSpanScope {
+  explicit CapturedSpanScope(uint64_t span) : span(span) {
+    if (span) {
+      enter_captured_span(span);
+    }
+  }
+  ~CapturedSpanScope() {
+    if (span) {
+      exit_captured_span(span);
+    }
+  }
+  uint64_t span;
+};
+
+// Single producer single consumer byte ring, storing length-prefixed records.
+class EventRing {
+public:
+  explicit EventRing(size_t capacity)
+      : buffer(new std::byte[capacity]), mask(capacity - 1) {}
+
+  size_t capacity() const { return mask + 1; }
+
+  bool tryPush(std::span<const std::byte> record) {
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    uint64_t h = head.load(std::memory_order_acquire);
+    size_t need = sizeof(uint32_t) + record.size();
+    if (capacity() - (t - h) < need) {
+      return false;
+    }
+    uint32_t len = record.size();
+    write(t, &len, sizeof(len));
+    write(t + sizeof(len), record.data(), record.size());
+    tail.store(t + need, std::memory_order_release);
+    return true;
+  }
+
+  std::optional<uint64_t> peekSeq() const {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return {};
+    }
+    uint64_t seq;
+    read(h + sizeof(uint32_t) + offsetof(EventHeader, seq), &seq, sizeof(seq));
+    return seq;
+  }
+
+  void pop(std::vector<std::byte> &out) {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    uint32_t len;
+    read(h, &len, sizeof(len));
+    out.resize(len);
+    read(h + sizeof(len), out.data(), len);
+    head.store(h + sizeof(len) + len, std::memory_order_release);
+  }
+
+  uint64_t produced() const { return tail.load(std::memory_order_acquire); }
+  uint64_t consumed() const { return head.load(std::memory_order_acquire); }
+  bool empty() const { return consumed() == produced(); }
+
+  // Set when the producing thread exits, ring is removed once drained.
+  std::atomic<bool> orphaned = false;
+
+private:
+  void write(uint64_t pos, const void *src, size_t len) {
+    size_t off = pos & mask;
+    size_t first = std::min(len, capacity() - off);
+    memcpy(buffer.get() + off, src, first);
+    memcpy(buffer.get(), static_cast<const std::byte *>(src) + first,
+           len - first);
+  }
+  void read(uint64_t pos, void *dst, size_t len) const {
+    size_t off = pos & mask;
+    size_t first = std::min(len, capacity() - off);
+    memcpy(dst, buffer.get() + off, first);
+    memcpy(static_cast<std::byte *>(dst) + first, buffer.get(), len - first);
+  }
+
+  std::unique_ptr<std::byte[]> buffer;
+  size_t mask;
+  alignas(64) std::atomic<uint64_t> head = 0;
+  alignas(64) std::atomic<uint64_t> tail = 0;
+};
+
+class EventWriter {
+public:
+  EventWriter(std::vector<std::byte> &out, size_t limit)
+      : out(out), limit(limit) {
+    out.clear();
+  }
+
+  void header(EventHeader h, std::string_view text, size_t fieldCount) {
+    h.fieldCount = fieldCount;
+    text = utf8Prefix(text, budget(sizeof(h)));
+    h.textLen = text.size();
+    append(&h, sizeof(h));
+    append(text.data(), text.size());
+  }
+  void field(uint64_t i) {
+    append(&FIELD_INT, sizeof(FIELD_INT));
+    append(&i, sizeof(i));
+  }
+  void field(std::string_view s) {
+    s = utf8Prefix(s, budget(sizeof(FIELD_STRING) + sizeof(uint32_t)));
+    uint32_t len = s.size();
+    append(&FIELD_STRING, sizeof(FIELD_STRING));
+    append(&len, sizeof(len));
+    append(s.data(), s.size());
+  }
+  void interned(uint64_t handle) {
+    append(&FIELD_INTERNED, sizeof(FIELD_INTERNED));
+    append(&handle, sizeof(handle));
+  }
+  void fields(const Logger::Fields &fields, bool intern = false) {
+    for (auto &f : fields) {
+      if (f.type == Logger::Field::tInt) {
+        field(f.i);
+      } else if (f.type == Logger::Field::tString && intern) {
+        interned(internString(f.s));
+      } else if (f.type == Logger::Field::tString) {
+        field(std::string_view(f.s));
+      } else {
+        unreachable();
+      }
+    }
+  }
+
+private:
+  // Bytes left for string data, after writing `overhead` bytes.
+  // Every field reserves space for at least one more int field.
+  size_t budget(size_t overhead) const {
+    size_t reserve = overhead + sizeof(FIELD_INT) + sizeof(uint64_t);
+    size_t used = out.size() + reserve;
+    return used >= limit ? 0 : limit - used;
+  }
+  void append(const void *data, size_t len) {
+    auto p = static_cast<const std::byte *>(data);
+    out.insert(out.end(), p, p + len);
+  }
+
+  std::vector<std::byte> &out;
+  size_t limit;
+};
+
+class EventReader {
+public:
+  explicit EventReader(std::span<const std::byte> data) : data(data) {}
+
+  EventHeader header() {
+    EventHeader h;
+    take(&h, sizeof(h));
+    return h;
+  }
+  std::string_view text(size_t len) {
+    std::string_view s(reinterpret_cast<const char *>(data.data()), len);
+    data = data.subspan(len);
+    return s;
+  }
+  // Returned views point into the record.
+  void fields(size_t count, std::vector<NixField> &out) {
+    out.clear();
+    for (size_t i = 0; i < count; ++i) {
+      uint8_t tag;
+      take(&tag, sizeof(tag));
+      if (tag == FIELD_INT || tag == FIELD_INTERNED) {
+        uint64_t v;
+        take(&v, sizeof(v));
+        out.push_back(NixField{tag, v, nullptr, 0});
+      } else {
+        uint32_t len;
+        take(&len, sizeof(len));
+        auto s = text(len);
+        out.push_back(NixField{FIELD_STRING, 0, s.data(), s.size()});
+      }
+    }
+  }
+
+private:
+  void take(void *dst, size_t len) {
+    memcpy(dst, data.data(), len);
+    data = data.subspan(len);
+  }
+  std::span<const std::byte> data;
+};
+
+std::atomic<uint64_t> nextLoggerGeneration = 1;
+
+// Ring of the current thread, rings of replaced loggers are abandoned.
+struct ThreadRing {
+  uint64_t generation = 0;
+  std::shared_ptr<EventRing> ring;
+  std::vector<std::byte> scratch;
+
+  ~ThreadRing() {
+    if (ring) {
+      ring->orphaned.store(true, std::memory_order_release);
+    }
+  }
+};
+thread_local ThreadRing threadRing;
+
+// Logger, that only serializes events into the per-thread rings.
+// Conversion into tracing events/spans happens in the single drain thread,
+// so nix threads never wait on the Rust side locks.
+struct BufferedTracingLogger : TracingLogger {
+  BufferedTracingLogger(size_t ringCapacity, Backpressure policy)
+      : TracingLogger(false),
+        ringCapacity(std::bit_ceil(std::max<size_t>(ringCapacity, 4096))),
+        policy(policy) {
+    drain = std::thread([this] { drainLoop(); });
+  }
+  ~BufferedTracingLogger() {
+    stopping.store(true, std::memory_order_release);
+    wake();
+    drain.join();
+  }
+
+  void log(Verbosity lvl, std::string_view s) override {
+    if (!logEnabled(lvl)) {
+      return;
+    }
+    auto w = writer();
+    w.header(header(EventKind::Log, lvl, 0, 0, 0, capture_span()), s, 0);
+    push(lvl > lvlInfo);
+  }
+  void logEI(const ErrorInfo &ei) override {
+    // Trace is copied, as ErrorInfo doesn't outlive the call. It is passed
+    // by pointer, and owned by the record.
+    auto msg = ei.msg.str();
+    auto trace = std::make_unique<ErrorTrace>(ei);
+    auto w = writer();
+    w.header(header(EventKind::Error, ei.level, 0, 0, 0, capture_span()), msg,
+             1);
+    w.field(uint64_t(reinterpret_cast<uintptr_t>(trace.release())));
+    push(false);
+  }
+  void warn(const std::string &msg) override {
+    auto w = writer();
+    w.header(header(EventKind::Warn, lvlWarn, 0, 0, 0, capture_span()), msg,
+             0);
+    push(false);
+  }
+
+  // Waits until every event, queued before the call, is converted.
+  void flush() {
+    std::vector<std::pair<std::shared_ptr<EventRing>, uint64_t>> targets;
+    {
+      std::lock_guard lock(ringsMutex);
+      for (auto &ring : rings) {
+        targets.emplace_back(ring, ring->produced());
+      }
+    }
+    flushWaiters.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    wake();
+    {
+      std::unique_lock lock(flushMutex);
+      flushedCv.wait(lock, [&] {
+        return std::ranges::all_of(targets, [](auto &t) {
+          return t.first->consumed() >= t.second;
+        });
+      });
+    }
+    flushWaiters.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+protected:
+  void forwardStart(ActivityId act, Verbosity lvl, ActivityType type,
+                    const std::string &s, const Fields &fields,
+                    ActivityId parent) override {
+    // Activities without nix parent are attached to the current tracing span
+    auto span = parent == 0 ? capture_span() : 0;
+    auto w = writer();
+    w.header(header(EventKind::Start, lvl, type, act, parent, span), s,
+             fields.size());
+    w.fields(fields, internedFields(type));
+    push(false);
+  }
+  void forwardStop(ActivityId act) override {
+    // Latest progress is queued before the stop, to be shown as final
+    progress.remove(act, [&](ActivityId act, ResultType type,
+                             std::span<const uint64_t> values) {
+      auto w = writer();
+      w.header(header(EventKind::Result, 0, type, act, 0, 0), {},
+               values.size());
+      for (auto v : values) {
+        w.field(v);
+      }
+      push(false);
+    });
+    auto w = writer();
+    w.header(header(EventKind::Stop, 0, 0, act, 0, 0), {}, 0);
+    push(false);
+  }
+  void forwardResult(ActivityId act, ResultType type,
+                     const Fields &fields) override {
+    auto w = writer();
+    w.header(header(EventKind::Result, 0, type, act, 0, 0), {},
+             fields.size());
+    w.fields(fields);
+    push(type == resProgress || type == resSetExpected ||
+         type == resSetPhase || type == resFetchStatus);
+  }
+
+private:
+  EventHeader header(EventKind kind, uint32_t lvl, uint32_t type,
+                     ActivityId act, ActivityId parent, uint64_t span) {
+    return EventHeader{
+        .seq = nextSeq.fetch_add(1, std::memory_order_relaxed),
+        .act = act,
+        .parent = parent,
+        .span = span,
+        .type = type,
+        .textLen = 0,
+        .fieldCount = 0,
+        .kind = kind,
+        .lvl = static_cast<uint8_t>(lvl),
+    };
+  }
+
+  EventWriter writer() {
+    if (threadRing.generation != generation) {
+      if (threadRing.ring) {
+        threadRing.ring->orphaned.store(true, std::memory_order_release);
+      }
+      threadRing.ring = std::make_shared<EventRing>(ringCapacity);
+      threadRing.generation = generation;
+      std::lock_guard lock(ringsMutex);
+      rings.push_back(threadRing.ring);
+      ringsVersion.fetch_add(1, std::memory_order_release);
+    }
+    // Records are limited to half of the ring, longer strings are truncated
+    return EventWriter(threadRing.scratch, ringCapacity / 2);
+  }
+
+  void push(bool lossy) {
+    auto &ring = *threadRing.ring;
+    std::span<const std::byte> record(threadRing.scratch);
+    while (!ring.tryPush(record)) {
+      if (lossy && policy == Backpressure::DropProgress) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        EventHeader h;
+        memcpy(&h, record.data(), sizeof(h));
+        if (h.span) {
+          release_captured_span(h.span);
+        }
+        return;
+      }
+      wake();
+      std::this_thread::yield();
+    }
+    // Pairs with the fence in waitForEvents(), either this thread observes
+    // the idle drain thread, or the drain thread observes the record
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (drainIdle.load(std::memory_order_relaxed)) {
+      wake();
+    }
+  }
+
+  void wake() {
+    std::lock_guard lock(wakeMutex);
+    wakeCv.notify_one();
+  }
+
+  // Picks ring with the lowest sequence number at its head.
+  //
+  // Sequence numbers are taken before records are pushed, so records of
+  // unrelated threads may be drained out of sequence order. Only a record,
+  // that was pushed before its producer handed off to another thread (e.g.
+  // activity start before a result on a worker), precedes the records of
+  // that thread: it is published before they are observed, so the scan is
+  // repeated until the result is stable.
+  EventRing *nextInOrder(const std::vector<std::shared_ptr<EventRing>> &rings) {
+    std::optional<uint64_t> previous;
+    while (true) {
+      EventRing *best = nullptr;
+      uint64_t bestSeq = UINT64_MAX;
+      for (auto &ring : rings) {
+        auto seq = ring->peekSeq();
+        if (seq && *seq < bestSeq) {
+          best = ring.get();
+          bestSeq = *seq;
+        }
+      }
+      if (!best || previous == bestSeq) {
+        return best;
+      }
+      previous = bestSeq;
+    }
+  }
+
+  void dispatch(std::span<const std::byte> record) {
+    EventReader r(record);
+    auto h = r.header();
+    auto text = r.text(h.textLen);
+
+    CapturedSpanScope scope(h.span);
+
+    switch (h.kind) {
+    case EventKind::Log:
+      emit_log(h.lvl, bytes(text));
+      break;
+    case EventKind::Error: {
+      r.fields(h.fieldCount, views);
+      std::unique_ptr<ErrorTrace> trace(
+          reinterpret_cast<ErrorTrace *>(static_cast<uintptr_t>(views[0].i)));
+      new_error_info(h.lvl, bytes(text), std::move(trace))->emit_error_info();
+      break;
+    }
+    case EventKind::Warn:
+      emit_warn(rust::Str(text.data(), text.size()));
+      break;
+    case EventKind::Start:
+      liveActivities.insert(h.act);
+      r.fields(h.fieldCount, views);
+      fleet_nix_emit_start(h.act, h.lvl, h.type, views.data(), views.size(),
+                           h.parent, text.data(), text.size());
+      break;
+    case EventKind::Stop:
+      liveActivities.erase(h.act);
+      emit_stop(h.act);
+      break;
+    case EventKind::Result:
+      r.fields(h.fieldCount, views);
+      fleet_nix_emit_result(h.act, h.type, views.data(), views.size());
+      break;
+    }
+  }
+
+  void drainLoop() {
+    std::vector<std::shared_ptr<EventRing>> snapshot;
+    uint64_t snapshotVersion = UINT64_MAX;
+    std::vector<std::byte> record;
+    uint64_t reportedDrops = 0;
+    auto nextProgressFlush = std::chrono::steady_clock::now();
+
+    while (true) {
+      if (auto now = std::chrono::steady_clock::now();
+          now >= nextProgressFlush) {
+        // Progress is only passed between start and stop of its activity,
+        // as seen in ring order
+        progress.flush(emitIntResult, [&](ActivityId act) {
+          return liveActivities.contains(act);
+        });
+        nextProgressFlush = now + progressFlushInterval;
+      }
+      if (ringsVersion.load(std::memory_order_acquire) != snapshotVersion) {
+        std::lock_guard lock(ringsMutex);
+        snapshot = rings;
+        snapshotVersion = ringsVersion.load(std::memory_order_relaxed);
+      }
+
+      if (auto ring = nextInOrder(snapshot)) {
+        ring->pop(record);
+        dispatch(record);
+        notifyFlushed();
+        continue;
+      }
+
+      if (auto drops = dropped.load(std::memory_order_relaxed);
+          drops != reportedDrops) {
+        emit_warn(std::format("nix log buffer is full, dropped {} events",
+                              drops - reportedDrops));
+        reportedDrops = drops;
+      }
+      if (stopping.load(std::memory_order_acquire)) {
+        break;
+      }
+      // Rings of exited threads are removed once drained
+      if (std::ranges::any_of(snapshot, [](auto &ring) {
+            return ring->orphaned.load(std::memory_order_acquire);
+          })) {
+        std::lock_guard lock(ringsMutex);
+        std::erase_if(rings, [](auto &ring) {
+          return ring->orphaned.load(std::memory_order_acquire) &&
+                 ring->empty();
+        });
+        snapshot = rings;
+        snapshotVersion = ringsVersion.load(std::memory_order_relaxed);
+      }
+      notifyFlushed();
+      waitForEvents(snapshot, snapshotVersion, nextProgressFlush);
+    }
+  }
+
+  // Sleeps until a record is pushed, a ring is registered, or the logger is
+  // stopping. Coalesced progress is not pushed, so while activities are
+  // running, the thread also wakes up to flush it.
+  void waitForEvents(const std::vector<std::shared_ptr<EventRing>> &snapshot,
+                     uint64_t snapshotVersion,
+                     std::chrono::steady_clock::time_point nextProgressFlush) {
+    std::unique_lock lock(wakeMutex);
+    drainIdle.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool pending =
+        stopping.load(std::memory_order_acquire) ||
+        ringsVersion.load(std::memory_order_acquire) != snapshotVersion ||
+        std::ranges::any_of(snapshot,
+                            [](auto &ring) { return !ring->empty(); });
+    if (!pending && liveActivities.empty()) {
+      wakeCv.wait(lock);
+    } else if (!pending) {
+      wakeCv.wait_until(lock, nextProgressFlush);
+    }
+    drainIdle.store(false, std::memory_order_relaxed);
+  }
+
+  // Wakes flush() callers, after the drain thread consumed a record.
+  void notifyFlushed() {
+    // Pairs with the increment in flush(), either the waiter observes the
+    // consumed record, or this thread observes the waiter
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (flushWaiters.load(std::memory_order_relaxed) != 0) {
+      std::lock_guard lock(flushMutex);
+      flushedCv.notify_all();
+    }
+  }
+
+  // Drain thread only
+  std::vector<NixField> views;
+  // Activities, whose start was dispatched, but stop wasn't yet
+  std::unordered_set<ActivityId> liveActivities;
+
+  const uint64_t generation =
+      nextLoggerGeneration.fetch_add(1, std::memory_order_relaxed);
+  const size_t ringCapacity;
+  const Backpressure policy;
+
+  std::atomic<uint64_t> nextSeq = 0;
+  std::atomic<uint64_t> dropped = 0;
+
+  std::mutex ringsMutex;
+  std::vector<std::shared_ptr<EventRing>> rings;
+  std::atomic<uint64_t> ringsVersion = 0;
+
+  std::mutex wakeMutex;
+  std::condition_variable wakeCv;
+  std::mutex flushMutex;
+  std::condition_variable flushedCv;
+  std::atomic<uint64_t> flushWaiters = 0;
+  std::atomic<bool> drainIdle = false;
+  std::atomic<bool> stopping = false;
+  std::thread drain;
+};
+
+} // namespace
+
+extern "C" {
+void apply_buffered_tracing_logger(size_t ring_capacity, uint8_t policy) {
+  logger = std::make_unique<BufferedTracingLogger>(
+      ring_capacity, static_cast<Backpressure>(policy));
+}
+void flush_tracing_logger() {
+  if (auto buffered = dynamic_cast<BufferedTracingLogger *>(logger.get())) {
+    buffered->flush();
+  }
+}
+}
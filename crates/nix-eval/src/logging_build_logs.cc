@@ -0,0 +1,339 @@
+#include "logging_internal.hh"
+
+#include <chrono>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <system_error>
+#include <unistd.h>
+#include <zstd.h>
+
+using namespace nix;
+using namespace fleet_logging;
+
+struct BuildLogReader::Stream {
+  std::string path;
+  int fd;
+  ZSTD_DCtx *dctx = nullptr;
+  std::vector<char> in = std::vector<char>(ZSTD_DStreamInSize());
+  std::vector<char> out = std::vector<char>(ZSTD_DStreamOutSize());
+  ZSTD_inBuffer input{nullptr, 0, 0};
+  // Output was full, the decoder may still hold some of it
+  bool full = false;
+};
+
+BuildLogReader::BuildLogReader(const std::string &path)
+    : stream(std::make_unique<Stream>()) {
+  stream->path = path;
+  stream->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (stream->fd < 0) {
+    throw std::system_error(errno, std::generic_category(), "opening " + path);
+  }
+  stream->dctx = ZSTD_createDCtx();
+}
+BuildLogReader::~BuildLogReader() {
+  ZSTD_freeDCtx(stream->dctx);
+  ::close(stream->fd);
+}
+
+rust::Slice<const uint8_t> BuildLogReader::read() {
+  auto &s = *stream;
+  while (true) {
+    if (s.input.pos == s.input.size && !s.full) {
+      ssize_t n = ::read(s.fd, s.in.data(), s.in.size());
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        throw std::system_error(errno, std::generic_category(),
+                                "reading " + s.path);
+      }
+      if (n == 0) {
+        return {};
+      }
+      s.input = ZSTD_inBuffer{s.in.data(), size_t(n), 0};
+    }
+    ZSTD_outBuffer output{s.out.data(), s.out.size(), 0};
+    size_t ret = ZSTD_decompressStream(s.dctx, &output, &s.input);
+    if (ZSTD_isError(ret)) {
+      throw std::runtime_error("decompressing " + s.path + ": " +
+                               ZSTD_getErrorName(ret));
+    }
+    s.full = output.pos == output.size;
+    if (output.pos != 0) {
+      return rust::Slice<const uint8_t>(
+          reinterpret_cast<const uint8_t *>(s.out.data()), output.pos);
+    }
+  }
+}
+
+namespace {
+void writeAll(int fd, const void *data, size_t len) {
+  auto p = static_cast<const char *>(data);
+  while (len > 0) {
+    ssize_t n = ::write(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "writing build log");
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+// Output of a single build, compressed into its own file as it arrives.
+class StoredBuildLog {
+public:
+  StoredBuildLog(const std::string &path, size_t tailLines)
+      : cctx(ZSTD_createCCtx()), buffer(ZSTD_CStreamOutSize()),
+        tailLines(tailLines) {
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      int err = errno;
+      ZSTD_freeCCtx(cctx);
+      throw std::system_error(err, std::generic_category(), "opening " + path);
+    }
+  }
+  ~StoredBuildLog() {
+    ZSTD_freeCCtx(cctx);
+    close(fd);
+  }
+
+  void line(std::string_view s) {
+    std::lock_guard lock(mutex);
+    compress(s, ZSTD_e_continue);
+    compress("\n", ZSTD_e_continue);
+    ++lines;
+    if (tailLines != 0) {
+      if (tail.size() == tailLines) {
+        tail.pop_front();
+      }
+      tail.emplace_back(s);
+    }
+  }
+
+  // Writes the end of the compressed stream, returns the last lines.
+  std::deque<std::string> finish() {
+    std::lock_guard lock(mutex);
+    compress({}, ZSTD_e_end);
+    return std::move(tail);
+  }
+
+  size_t lineCount() const { return lines; }
+
+private:
+  void compress(std::string_view s, ZSTD_EndDirective mode) {
+    ZSTD_inBuffer in{s.data(), s.size(), 0};
+    bool done;
+    do {
+      ZSTD_outBuffer out{buffer.data(), buffer.size(), 0};
+      size_t left = ZSTD_compressStream2(cctx, &out, &in, mode);
+      if (ZSTD_isError(left)) {
+        throw std::runtime_error(std::string("compressing build log: ") +
+                                 ZSTD_getErrorName(left));
+      }
+      writeAll(fd, buffer.data(), out.pos);
+      done = mode == ZSTD_e_end ? left == 0 : in.pos == in.size;
+    } while (!done);
+  }
+
+  std::mutex mutex;
+  ZSTD_CCtx *cctx;
+  int fd;
+  std::vector<char> buffer;
+  const size_t tailLines;
+  std::deque<std::string> tail;
+  size_t lines = 0;
+};
+
+// Build logs of every derivation, stored as `<run>-<n>-<drv name>.log.zst` in
+// a directory, with an `index` of tab-separated owner, drv path, log file,
+// unix start time and line count. Later index entries override earlier ones,
+// builds shared between owners have an entry for each of them.
+// Run id is the store opening time and pid, so that rebuilds and concurrent
+// fleet processes never overwrite each other's logs.
+class BuildLogStore {
+public:
+  BuildLogStore(std::filesystem::path dir, size_t tailLines)
+      : dir(std::move(dir)), tailLines(tailLines),
+        run(std::format("{}-{}",
+                        std::chrono::duration_cast<std::chrono::seconds>(
+                            std::chrono::system_clock::now().time_since_epoch())
+                            .count(),
+                        getpid())) {
+    std::filesystem::create_directories(this->dir);
+    indexFd = open((this->dir / "index").c_str(),
+                   O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (indexFd < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "opening build log index");
+    }
+  }
+
+  void start(ActivityId act, const Logger::Fields &fields,
+             const std::vector<std::string> &owners) {
+    if (fields.empty() || fields[0].type != Logger::Field::tString) {
+      return;
+    }
+    auto &drvPath = fields[0].s;
+    auto file = std::format(
+        "{}-{}-{}.log.zst", run,
+        nextLog.fetch_add(1, std::memory_order_relaxed),
+        std::filesystem::path(drvPath).filename().string());
+    Entry entry{
+        .owners = owners,
+        .drvPath = drvPath,
+        .file = file,
+        .started = std::chrono::system_clock::now(),
+        .log = nullptr,
+    };
+    // Builds of unknown owners are indexed with an empty one
+    if (entry.owners.empty()) {
+      entry.owners.emplace_back();
+    }
+    try {
+      entry.log = std::make_shared<StoredBuildLog>(dir / file, tailLines);
+    } catch (std::exception &e) {
+      emit_warn(std::format("build log of {} is not stored: {}", drvPath,
+                            e.what()));
+      return;
+    }
+    std::lock_guard lock(mutex);
+    builds.insert_or_assign(act, std::move(entry));
+  }
+
+  // Returns false if the activity is not a stored build.
+  bool line(ActivityId act, std::string_view s) {
+    auto log = find(act);
+    if (!log) {
+      return false;
+    }
+    log->line(s);
+    return true;
+  }
+
+  // Finishes the log of the build, and returns its last lines.
+  std::deque<std::string> stop(ActivityId act) {
+    Entry entry;
+    {
+      std::lock_guard lock(mutex);
+      auto it = builds.find(act);
+      if (it == builds.end()) {
+        return {};
+      }
+      entry = std::move(it->second);
+      builds.erase(it);
+    }
+    return finish(entry);
+  }
+
+  // Finishes logs of builds, which are still running, and closes the index.
+  void close() {
+    std::unordered_map<ActivityId, Entry> running;
+    {
+      std::lock_guard lock(mutex);
+      running.swap(builds);
+    }
+    for (auto &[_, entry] : running) {
+      finish(entry);
+    }
+    std::lock_guard lock(indexMutex);
+    ::close(indexFd);
+    indexFd = -1;
+  }
+
+private:
+  struct Entry {
+    std::vector<std::string> owners;
+    std::string drvPath;
+    std::string file;
+    std::chrono::system_clock::time_point started;
+    std::shared_ptr<StoredBuildLog> log;
+  };
+
+  std::shared_ptr<StoredBuildLog> find(ActivityId act) {
+    std::lock_guard lock(mutex);
+    auto it = builds.find(act);
+    return it == builds.end() ? nullptr : it->second.log;
+  }
+
+  std::deque<std::string> finish(Entry &entry) {
+    std::deque<std::string> tail;
+    try {
+      tail = entry.log->finish();
+      auto started = std::chrono::duration_cast<std::chrono::seconds>(
+          entry.started.time_since_epoch());
+      std::string lines;
+      for (auto &owner : entry.owners) {
+        lines += std::format("{}\t{}\t{}\t{}\t{}\n", owner, entry.drvPath,
+                             entry.file, started.count(),
+                             entry.log->lineCount());
+      }
+      std::lock_guard lock(indexMutex);
+      if (indexFd >= 0) {
+        writeAll(indexFd, lines.data(), lines.size());
+      }
+    } catch (std::exception &e) {
+      emit_warn(std::format("failed to store build log of {}: {}",
+                            entry.drvPath, e.what()));
+    }
+    return tail;
+  }
+
+  const std::filesystem::path dir;
+  const size_t tailLines;
+  const std::string run;
+  std::atomic<uint64_t> nextLog = 0;
+  std::mutex mutex;
+  std::unordered_map<ActivityId, Entry> builds;
+  std::mutex indexMutex;
+  int indexFd;
+};
+Installed<BuildLogStore> buildLogStore;
+
+// Build output is only shown as a part of errors of failed builds
+std::atomic<bool> tailOnFailure = false;
+} // namespace
+
+namespace fleet_logging {
+bool buildLogsStored() { return buildLogStore.get(); }
+bool buildLogTailOnFailure() {
+  return tailOnFailure.load(std::memory_order_relaxed);
+}
+void storeBuildStart(ActivityId act, const Logger::Fields &fields,
+                     const std::vector<std::string> &owners) {
+  if (auto store = buildLogStore.get()) {
+    store->start(act, fields, owners);
+  }
+}
+bool storeBuildLine(ActivityId act, std::string_view s) {
+  auto store = buildLogStore.get();
+  return store && store->line(act, s);
+}
+std::deque<std::string> storeBuildStop(ActivityId act) {
+  auto store = buildLogStore.get();
+  return store ? store->stop(act) : std::deque<std::string>();
+}
+} // namespace fleet_logging
+
+extern "C" {
+void open_build_log_store(rust::Str dir, size_t tail_lines) {
+  buildLogStore.install(
+      std::make_unique<BuildLogStore>(std::string(dir), tail_lines),
+      "build log store is already open");
+}
+void close_build_log_store() {
+  if (auto store = buildLogStore.take()) {
+    store->close();
+  }
+}
+void set_build_log_tail_on_failure(bool enabled) {
+  tailOnFailure.store(enabled, std::memory_order_relaxed);
+}
+std::unique_ptr<BuildLogReader> open_build_log(rust::Str path) {
+  return std::make_unique<BuildLogReader>(std::string(path));
+}
+}
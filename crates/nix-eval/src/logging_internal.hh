@@ -0,0 +1,358 @@
+#pragma once
+// Declarations shared by the logger translation units. Collectors, that
+// observe every activity regardless of the log filter (activity recording,
+// build logs, timings and transfer metrics), are private to their own
+// translation units, and are only reachable through the functions below.
+#include "logging.hh"
+#include <nix/util/logging.hh>
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace fleet_logging {
+using namespace nix;
+
+constexpr uint8_t FIELD_INT = Logger::Field::tInt;
+constexpr uint8_t FIELD_STRING = Logger::Field::tString;
+// Handle of a string, registered with fleet_nix_intern
+constexpr uint8_t FIELD_INTERNED = 2;
+
+struct StringHash {
+  using is_transparent = void;
+  size_t operator()(std::string_view s) const {
+    return std::hash<std::string_view>{}(s);
+  }
+};
+
+// Handle of the string, passed to Rust once with fleet_nix_intern.
+uint64_t internString(std::string_view s);
+// Activities, whose string fields are store paths and store URIs
+bool internedFields(ActivityType type);
+
+// Passes fields to `f` as borrowed views, without heap allocation for the
+// usual short field lists. With `intern`, string fields are passed as handles.
+template <typename F>
+void withFieldViews(const Logger::Fields &fields, bool intern, F &&f) {
+  constexpr size_t inlineFields = 8;
+  NixField inlineViews[inlineFields];
+  std::vector<NixField> heapViews;
+  NixField *views = inlineViews;
+  if (fields.size() > inlineFields) {
+    heapViews.resize(fields.size());
+    views = heapViews.data();
+  }
+  for (size_t i = 0; i < fields.size(); ++i) {
+    auto &field = fields[i];
+    if (field.type == Logger::Field::tInt) {
+      views[i] = NixField{FIELD_INT, field.i, nullptr, 0};
+    } else if (field.type == Logger::Field::tString && intern) {
+      views[i] = NixField{FIELD_INTERNED, internString(field.s), nullptr, 0};
+    } else if (field.type == Logger::Field::tString) {
+      views[i] = NixField{FIELD_STRING, 0, field.s.data(), field.s.size()};
+    } else {
+      unreachable();
+    }
+  }
+  f(views, fields.size());
+}
+
+// Which events are passed to Rust, updated from the tracing filter by
+// set_log_filter. Until then, everything is forwarded.
+struct LogFilter {
+  std::atomic<uint8_t> logs = 0xff;
+  std::atomic<uint8_t> actions = 0xff;
+  std::atomic<uint64_t> activities = UINT64_MAX;
+  std::atomic<uint64_t> generic = UINT64_MAX;
+  std::atomic<uint64_t> results = UINT64_MAX;
+};
+extern LogFilter logFilter;
+
+// Bit of activity/result type in the filter masks, see type_bit in logging.rs
+inline uint64_t typeBit(uint32_t type) {
+  return type >= 100 && type < 163 ? uint64_t(1) << (type - 100)
+                                   : uint64_t(1) << 63;
+}
+inline bool levelIn(const std::atomic<uint8_t> &mask, Verbosity lvl) {
+  return lvl > lvlVomit || mask.load(std::memory_order_relaxed) >> lvl & 1;
+}
+
+inline bool logEnabled(Verbosity lvl) { return levelIn(logFilter.logs, lvl); }
+inline bool activityEnabled(Verbosity lvl, ActivityType type,
+                            std::string_view s) {
+  auto bit = typeBit(type);
+  if (logFilter.activities.load(std::memory_order_relaxed) & bit) {
+    return true;
+  }
+  if ((logFilter.generic.load(std::memory_order_relaxed) & bit) &&
+      levelIn(logFilter.actions, lvl)) {
+    return true;
+  }
+  // Activity message is logged even if its span is disabled
+  return !s.empty() && logEnabled(lvl);
+}
+inline bool resultEnabled(ResultType type) {
+  return logFilter.results.load(std::memory_order_relaxed) & typeBit(type);
+}
+
+// How often coalesced progress is passed to Rust
+constexpr auto progressFlushInterval = std::chrono::milliseconds(100);
+
+// Latest progress of a single activity. Values are updated independently, so a
+// flush may observe a mix of two consecutive updates, which is fine for UI.
+struct ProgressSlot {
+  // done, expected, running, failed
+  std::array<std::atomic<uint64_t>, 4> progress{};
+  // SetExpected values, indexed by activity type - actCopyPath
+  std::array<std::atomic<uint64_t>, 16> expected{};
+  // Bit 0 for progress, bit 1 + i for expected[i]
+  std::atomic<uint32_t> dirty = 0;
+};
+
+inline std::atomic<uint64_t> nextProgressTableId = 1;
+
+// Progress of an activity is usually reported by the same thread in a row, the
+// last used slot is cached to skip the shard lock.
+struct CachedProgressSlot {
+  uint64_t table = 0;
+  ActivityId act = 0;
+  std::shared_ptr<ProgressSlot> slot;
+};
+inline thread_local CachedProgressSlot cachedProgressSlot;
+
+// Progress and SetExpected results are coalesced per activity, and passed to
+// Rust at most once per flush, instead of once per update.
+class ProgressTable {
+public:
+  static bool coalesced(ResultType type) {
+    return type == resProgress || type == resSetExpected;
+  }
+
+  // Returns false if the update can't be coalesced, and should be passed as is.
+  bool update(ActivityId act, ResultType type, const Logger::Fields &fields) {
+    for (auto &f : fields) {
+      if (f.type != Logger::Field::tInt) {
+        return false;
+      }
+    }
+    if (type == resProgress && fields.size() == 4) {
+      auto &s = slot(act);
+      for (size_t i = 0; i < 4; ++i) {
+        s.progress[i].store(fields[i].i, std::memory_order_relaxed);
+      }
+      s.dirty.fetch_or(1, std::memory_order_release);
+      return true;
+    }
+    if (type == resSetExpected && fields.size() == 2 &&
+        fields[0].i >= actCopyPath && fields[0].i - actCopyPath < 16) {
+      auto &s = slot(act);
+      size_t i = fields[0].i - actCopyPath;
+      s.expected[i].store(fields[1].i, std::memory_order_relaxed);
+      s.dirty.fetch_or(2 << i, std::memory_order_release);
+      return true;
+    }
+    return false;
+  }
+
+  // Forgets the activity, passing its not yet flushed progress to `emit`.
+  template <typename F> void remove(ActivityId act, F &&emit) {
+    std::shared_ptr<ProgressSlot> removed;
+    {
+      auto &shard = shardOf(act);
+      std::lock_guard lock(shard.mutex);
+      auto it = shard.slots.find(act);
+      if (it == shard.slots.end()) {
+        return;
+      }
+      removed = std::move(it->second);
+      shard.slots.erase(it);
+    }
+    flushSlot(act, *removed, emit);
+  }
+
+  // Passes every changed value to `emit(act, type, values)`.
+  template <typename F> void flush(F &&emit) {
+    flush(emit, [](ActivityId) { return true; });
+  }
+  // Same, but activities rejected by `include` are skipped, and stay dirty.
+  template <typename F, typename P> void flush(F &&emit, P &&include) {
+    std::vector<std::pair<ActivityId, std::shared_ptr<ProgressSlot>>> dirty;
+    for (auto &shard : shards) {
+      std::lock_guard lock(shard.mutex);
+      for (auto &[act, s] : shard.slots) {
+        if (s->dirty.load(std::memory_order_relaxed) && include(act)) {
+          dirty.emplace_back(act, s);
+        }
+      }
+    }
+    // Rust side is called without holding shard locks
+    for (auto &[act, s] : dirty) {
+      flushSlot(act, *s, emit);
+    }
+  }
+
+private:
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<ActivityId, std::shared_ptr<ProgressSlot>> slots;
+  };
+
+  ProgressSlot &slot(ActivityId act) {
+    auto &cached = cachedProgressSlot;
+    if (cached.table == id && cached.act == act) {
+      return *cached.slot;
+    }
+    auto &shard = shardOf(act);
+    std::lock_guard lock(shard.mutex);
+    auto &s = shard.slots[act];
+    if (!s) {
+      s = std::make_shared<ProgressSlot>();
+    }
+    cached = CachedProgressSlot{id, act, s};
+    return *s;
+  }
+
+  Shard &shardOf(ActivityId act) { return shards[act % shards.size()]; }
+
+  template <typename F>
+  static void flushSlot(ActivityId act, ProgressSlot &s, F &&emit) {
+    uint32_t dirty = s.dirty.exchange(0, std::memory_order_acquire);
+    if (dirty & 1) {
+      uint64_t values[4];
+      for (size_t i = 0; i < 4; ++i) {
+        values[i] = s.progress[i].load(std::memory_order_relaxed);
+      }
+      emit(act, resProgress, std::span<const uint64_t>(values));
+    }
+    for (dirty >>= 1; dirty; dirty &= dirty - 1) {
+      size_t i = std::countr_zero(dirty);
+      uint64_t values[2] = {actCopyPath + i,
+                            s.expected[i].load(std::memory_order_relaxed)};
+      emit(act, resSetExpected, std::span<const uint64_t>(values));
+    }
+  }
+
+  const uint64_t id =
+      nextProgressTableId.fetch_add(1, std::memory_order_relaxed);
+  std::array<Shard, 16> shards;
+};
+
+void emitIntResult(ActivityId act, ResultType type,
+                   std::span<const uint64_t> values);
+
+// Collector, found by nix threads through an atomic pointer. A collector is
+// never freed once installed, as nix threads may still be using it after it
+// was taken, so it is leaked instead.
+template <typename T> class Installed {
+public:
+  T *get() const { return current.load(std::memory_order_acquire); }
+
+  // Throws `error`, if another collector is installed.
+  void install(std::unique_ptr<T> collector, const char *error) {
+    T *expected = nullptr;
+    if (!current.compare_exchange_strong(expected, collector.get(),
+                                         std::memory_order_acq_rel)) {
+      throw std::runtime_error(error);
+    }
+    collector.release();
+  }
+  // Uninstalls the collector, it stays allocated.
+  T *take() { return current.exchange(nullptr, std::memory_order_acq_rel); }
+
+private:
+  std::atomic<T *> current = nullptr;
+};
+
+// Activity recording, see logging_recorder.cc. Events are ignored unless
+// recording is started.
+void recordStart(ActivityId act, Verbosity lvl, ActivityType type,
+                 std::string_view s, const Logger::Fields &fields,
+                 ActivityId parent);
+void recordStop(ActivityId act);
+void recordResult(ActivityId act, ResultType type,
+                  const Logger::Fields &fields);
+
+// Build log store, see logging_build_logs.cc.
+bool buildLogsStored();
+// Build output is only shown as a part of errors of failed builds
+bool buildLogTailOnFailure();
+void storeBuildStart(ActivityId act, const Logger::Fields &fields,
+                     const std::vector<std::string> &owners);
+// Returns false if the activity is not a stored build.
+bool storeBuildLine(ActivityId act, std::string_view s);
+// Finishes the log of a stored build, and returns its last lines.
+std::deque<std::string> storeBuildStop(ActivityId act);
+
+// Activity timings, see logging_timings.cc.
+bool activitiesTimed();
+void timeStart(ActivityId act, ActivityType type, std::string_view s,
+               const Logger::Fields &fields, ActivityId parent,
+               std::vector<std::string> owners);
+void timePhase(ActivityId act, std::string_view name);
+void timeStop(ActivityId act);
+
+// Transfer metrics, see logging_transfers.cc.
+void measureStart(ActivityId act, ActivityType type,
+                  const Logger::Fields &fields);
+void measureProgress(ActivityId act, const Logger::Fields &fields);
+void measureStop(ActivityId act);
+
+// Events, which were filtered out, never leave C++. Activities are skipped
+// as a whole, Rust ignores stops and results of unknown activities.
+struct TracingLogger : Logger {
+  TracingLogger() : TracingLogger(true) {}
+  ~TracingLogger();
+
+  bool isVerbose() override;
+  void log(Verbosity lvl, std::string_view s) override;
+  void logEI(const ErrorInfo &ei) override;
+  void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+                     const std::string &s, const Fields &fields,
+                     ActivityId parent) override;
+  void stopActivity(ActivityId act) override;
+  void result(ActivityId act, ResultType type, const Fields &fields) override;
+  void writeToStdout(std::string_view s) override;
+  void warn(const std::string &msg) override;
+  virtual std::optional<char> ask(std::string_view s);
+
+protected:
+  // Without a flush thread, progress.flush() needs to be called periodically
+  explicit TracingLogger(bool flushThread) : flushThread(flushThread) {}
+
+  // Called for activities and results, which passed the filter
+  virtual void forwardStart(ActivityId act, Verbosity lvl, ActivityType type,
+                            const std::string &s, const Fields &fields,
+                            ActivityId parent);
+  virtual void forwardStop(ActivityId act);
+  virtual void forwardResult(ActivityId act, ResultType type,
+                             const Fields &fields);
+
+  ProgressTable progress;
+
+private:
+  void startProgressThread();
+  void progressLoop();
+
+  std::mutex progressMutex;
+  std::condition_variable progressCv;
+  bool progressStopping = false;
+  const bool flushThread;
+  std::once_flag progressStarted;
+  std::thread progressThread;
+};
+
+} // namespace fleet_logging
@@ -0,0 +1,283 @@
+#include "logging_internal.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <system_error>
+#include <unistd.h>
+
+using namespace nix;
+using namespace fleet_logging;
+
+namespace {
+// Binary activity log, see recording.rs for the reader.
+//
+// File starts with RecordingHeader, followed by 8 byte aligned records, each
+// starting with RecordHeader. Strings are interned, and written as separate
+// records once, before the first record referencing them.
+enum class RecordKind : uint8_t { String = 1, Start = 2, Stop = 3, Result = 4 };
+
+struct RecordingHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  // Wall clock time of the recording start, in ns since the unix epoch
+  uint64_t startedAt;
+  // Records, which didn't fit into the file
+  uint64_t dropped;
+};
+
+struct RecordHeader {
+  // Total size of the record, written last
+  uint32_t size;
+  RecordKind kind;
+  uint8_t lvl;
+  uint16_t fieldCount;
+  // Activity or result type, byte length for strings
+  uint32_t type;
+  uint32_t thread;
+  // Nanoseconds since the recording start
+  uint64_t time;
+  // Activity id, string id for strings
+  uint64_t act;
+};
+// Start is followed by parent activity id, a word with text string id in the
+// low and string field mask in the high half, and fields. Result is followed by
+// string field mask and fields. Every field is 8 bytes: an int or a string id,
+// string id 0 means that the string was not recorded.
+
+constexpr size_t maxRecordedFields = 32;
+
+std::atomic<uint64_t> nextRecorderId = 1;
+
+// Strings, that the current thread already interned, so that repeated store
+// paths skip the shared table lock. Cleared when it grows too large.
+struct RecorderStringCache {
+  static constexpr size_t maxSize = 4096;
+  uint64_t recorder = 0;
+  std::unordered_map<std::string, uint32_t, StringHash, std::equal_to<>> ids;
+};
+thread_local RecorderStringCache recorderStringCache;
+
+// Activity events are written directly into a shared file mapping, with a
+// single atomic increment to reserve space. File is created sparse, and
+// truncated to the written size when recording is stopped.
+class ActivityRecorder {
+public:
+  ActivityRecorder(const std::string &path, uint64_t capacity)
+      : capacity(capacity), started(std::chrono::steady_clock::now()) {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "opening " + path);
+    }
+    if (ftruncate(fd, capacity) != 0) {
+      int err = errno;
+      close(fd);
+      throw std::system_error(err, std::generic_category(),
+                              "resizing " + path);
+    }
+    void *map = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    if (map == MAP_FAILED) {
+      int err = errno;
+      close(fd);
+      throw std::system_error(err, std::generic_category(),
+                              "mapping " + path);
+    }
+    data = static_cast<std::byte *>(map);
+
+    RecordingHeader header{
+        .magic = {'F', 'L', 'E', 'E', 'T', 'A', 'C', 'T'},
+        .version = 1,
+        .headerSize = sizeof(RecordingHeader),
+        .startedAt = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch())
+                .count()),
+        .dropped = 0,
+    };
+    memcpy(data, &header, sizeof(header));
+  }
+
+  void start(ActivityId act, Verbosity lvl, ActivityType type,
+             std::string_view s, const Logger::Fields &fields,
+             ActivityId parent) {
+    uint64_t words[2 + maxRecordedFields];
+    uint32_t mask = 0;
+    size_t count = encodeFields(fields, true, words + 2, mask);
+    words[0] = parent;
+    words[1] = uint64_t(mask) << 32 | intern(s);
+    write(RecordKind::Start, lvl, type, act, count,
+          std::span(words, 2 + count));
+  }
+  void stop(ActivityId act) { write(RecordKind::Stop, 0, 0, act, 0, {}); }
+  void result(ActivityId act, ResultType type, const Logger::Fields &fields) {
+    // Log lines are not interned, there are too many of them
+    bool strings = type != resBuildLogLine && type != resPostBuildLogLine;
+    uint64_t words[1 + maxRecordedFields];
+    uint32_t mask = 0;
+    size_t count = encodeFields(fields, strings, words + 1, mask);
+    words[0] = mask;
+    write(RecordKind::Result, 0, type, act, count,
+          std::span(words, 1 + count));
+  }
+
+  // Waits for the records being written, and truncates the file.
+  // Recorder is never freed, late events are ignored.
+  uint64_t finish() {
+    uint64_t end = cursor.fetch_add(closed, std::memory_order_acq_rel);
+    while (committed.load(std::memory_order_acquire) != end) {
+      std::this_thread::yield();
+    }
+    uint64_t droppedRecords = dropped.load(std::memory_order_relaxed);
+    memcpy(data + offsetof(RecordingHeader, dropped), &droppedRecords,
+           sizeof(droppedRecords));
+    munmap(data, capacity);
+    if (ftruncate(fd, std::min(end, capacity)) != 0) {
+      emit_warn("failed to truncate nix activity recording");
+    }
+    close(fd);
+    return droppedRecords;
+  }
+
+private:
+  static constexpr uint64_t closed = uint64_t(1) << 62;
+
+  size_t encodeFields(const Logger::Fields &fields, bool strings,
+                      uint64_t *values, uint32_t &mask) {
+    size_t count = std::min(fields.size(), maxRecordedFields);
+    for (size_t i = 0; i < count; ++i) {
+      auto &field = fields[i];
+      if (field.type == Logger::Field::tInt) {
+        values[i] = field.i;
+      } else {
+        values[i] = strings ? intern(field.s) : 0;
+        mask |= uint32_t(1) << i;
+      }
+    }
+    return count;
+  }
+
+  uint32_t intern(std::string_view s) {
+    auto &cache = recorderStringCache;
+    if (cache.recorder != id || cache.ids.size() >= cache.maxSize) {
+      cache.ids.clear();
+      cache.recorder = id;
+    }
+    if (auto it = cache.ids.find(s); it != cache.ids.end()) {
+      return it->second;
+    }
+    uint32_t string = internShared(s);
+    cache.ids.emplace(s, string);
+    return string;
+  }
+  uint32_t internShared(std::string_view s) {
+    std::lock_guard lock(stringsMutex);
+    if (auto it = strings.find(s); it != strings.end()) {
+      return it->second;
+    }
+    uint32_t string = strings.size() + 1;
+    strings.emplace(s, string);
+    // Written under the lock, so the string record is always before the
+    // records referencing it
+    write(RecordKind::String, 0, s.size(), string, 0, {},
+          std::as_bytes(std::span(s.data(), s.size())));
+    return string;
+  }
+
+  void write(RecordKind kind, uint8_t lvl, uint32_t type, uint64_t act,
+             size_t fieldCount, std::span<const uint64_t> words,
+             std::span<const std::byte> raw = {}) {
+    size_t size =
+        (sizeof(RecordHeader) + words.size_bytes() + raw.size() + 7) &
+        ~size_t(7);
+    uint64_t offset = cursor.fetch_add(size, std::memory_order_relaxed);
+    if (offset >= closed) {
+      return;
+    }
+    if (offset + size > capacity) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      committed.fetch_add(size, std::memory_order_release);
+      return;
+    }
+
+    thread_local uint32_t threadId = nextThreadId.fetch_add(1);
+    auto out = data + offset;
+    RecordHeader header{
+        .size = 0,
+        .kind = kind,
+        .lvl = lvl,
+        .fieldCount = static_cast<uint16_t>(fieldCount),
+        .type = type,
+        .thread = threadId,
+        .time = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - started)
+                .count()),
+        .act = act,
+    };
+    memcpy(out, &header, sizeof(header));
+    if (!words.empty()) {
+      memcpy(out + sizeof(header), words.data(), words.size_bytes());
+    }
+    if (!raw.empty()) {
+      memcpy(out + sizeof(header) + words.size_bytes(), raw.data(),
+             raw.size());
+    }
+    std::atomic_ref<uint32_t>(*reinterpret_cast<uint32_t *>(out))
+        .store(size, std::memory_order_release);
+    committed.fetch_add(size, std::memory_order_release);
+  }
+
+  const uint64_t id = nextRecorderId.fetch_add(1, std::memory_order_relaxed);
+  const uint64_t capacity;
+  const std::chrono::steady_clock::time_point started;
+  int fd;
+  std::byte *data;
+
+  std::atomic<uint64_t> cursor = sizeof(RecordingHeader);
+  std::atomic<uint64_t> committed = sizeof(RecordingHeader);
+  std::atomic<uint64_t> dropped = 0;
+  std::atomic<uint32_t> nextThreadId = 1;
+
+  std::mutex stringsMutex;
+  std::unordered_map<std::string, uint32_t, StringHash, std::equal_to<>>
+      strings;
+};
+Installed<ActivityRecorder> activityRecorder;
+} // namespace
+
+namespace fleet_logging {
+void recordStart(ActivityId act, Verbosity lvl, ActivityType type,
+                 std::string_view s, const Logger::Fields &fields,
+                 ActivityId parent) {
+  if (auto r = activityRecorder.get()) {
+    r->start(act, lvl, type, s, fields, parent);
+  }
+}
+void recordStop(ActivityId act) {
+  if (auto r = activityRecorder.get()) {
+    r->stop(act);
+  }
+}
+void recordResult(ActivityId act, ResultType type,
+                  const Logger::Fields &fields) {
+  if (auto r = activityRecorder.get()) {
+    r->result(act, type, fields);
+  }
+}
+} // namespace fleet_logging
+
+extern "C" {
+void start_activity_recording(rust::Str path, uint64_t capacity) {
+  activityRecorder.install(
+      std::make_unique<ActivityRecorder>(std::string(path), capacity),
+      "nix activity is already being recorded");
+}
+uint64_t stop_activity_recording() {
+  auto r = activityRecorder.take();
+  return r ? r->finish() : 0;
+}
+}
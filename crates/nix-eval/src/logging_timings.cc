@@ -0,0 +1,376 @@
+#include "logging_internal.hh"
+
+#include <algorithm>
+#include <map>
+#include <ranges>
+#include <set>
+
+using namespace nix;
+using namespace fleet_logging;
+
+namespace {
+// Start and stop times of activities doing the work, regardless of the log
+// filter. Activities are attributed to the build owner of the starting thread,
+// to owners of the build graphs including their derivation or output, or to
+// owners of their parent activity. Builds also get start times of their
+// phases, each phase lasts until the next one starts, or the build stops.
+//
+// Stopped activities are folded into totals and the critical path of their
+// owner, and into phase totals, so only running activities are kept whole.
+// Owners and phase totals are sharded, so stops of unrelated activities don't
+// contend on a single lock.
+class ActivityTimings {
+public:
+  explicit ActivityTimings(size_t slowestPhases)
+      : started(std::chrono::steady_clock::now()),
+        slowestPhases(slowestPhases) {}
+
+  static bool timed(ActivityType type) {
+    return type == actBuild || type == actBuildWaiting ||
+           type == actSubstitute || type == actCopyPath ||
+           type == actFileTransfer;
+  }
+
+  void start(ActivityId act, ActivityType type, std::string_view s,
+             const Logger::Fields &fields, ActivityId parent,
+             std::vector<std::string> owners) {
+    auto field = [&](size_t i) -> std::string_view {
+      if (i >= fields.size() || fields[i].type != Logger::Field::tString) {
+        return {};
+      }
+      return fields[i].s;
+    };
+    Timing timing{
+        .type = type,
+        .owners = std::move(owners),
+        .subject = std::string(type == actBuildWaiting ? s : field(0)),
+        .host = std::string(field(type == actCopyPath ? 2 : 1)),
+        .start = now(),
+    };
+    if (timing.owners.empty() && parent != 0) {
+      auto &shard = shardOf(parent);
+      std::lock_guard lock(shard.mutex);
+      if (auto it = shard.owners.find(parent); it != shard.owners.end()) {
+        timing.owners = it->second;
+      }
+    }
+    bool known = !timing.owners.empty();
+    // Activities of unknown owners are timed together under an empty one
+    if (!known) {
+      timing.owners.emplace_back();
+    }
+    if (timed(type)) {
+      for (auto &name : timing.owners) {
+        auto &shard = ownerShardOf(name);
+        std::lock_guard lock(shard.mutex);
+        shard.owners[name].runningStarts.insert(timing.start);
+      }
+    }
+    auto &shard = shardOf(act);
+    std::lock_guard lock(shard.mutex);
+    if (known) {
+      shard.owners.insert_or_assign(act, timing.owners);
+    }
+    if (timed(type)) {
+      shard.running.insert_or_assign(act, std::move(timing));
+    }
+  }
+
+  void phase(ActivityId act, std::string_view name) {
+    auto &shard = shardOf(act);
+    std::lock_guard lock(shard.mutex);
+    if (auto it = shard.running.find(act); it != shard.running.end()) {
+      it->second.phases.emplace_back(name, now());
+    }
+  }
+
+  void stop(ActivityId act) {
+    std::optional<Timing> timing;
+    {
+      auto &shard = shardOf(act);
+      std::lock_guard lock(shard.mutex);
+      if (auto it = shard.running.find(act); it != shard.running.end()) {
+        timing = std::move(it->second);
+        shard.running.erase(it);
+      }
+      shard.owners.erase(act);
+    }
+    if (timing) {
+      fold(act, std::move(*timing));
+    }
+  }
+
+  // Activities, which are still running, end at the time of the call.
+  TimingsSummary take() {
+    std::vector<std::pair<ActivityId, Timing>> running;
+    for (auto &shard : shards) {
+      std::lock_guard lock(shard.mutex);
+      for (auto &[act, timing] : shard.running) {
+        running.emplace_back(act, std::move(timing));
+      }
+      shard.running.clear();
+      shard.owners.clear();
+    }
+    std::ranges::sort(running, {},
+                      [](auto &entry) { return entry.second.start; });
+    for (auto &[act, timing] : running) {
+      fold(act, std::move(timing));
+    }
+
+    // Summary is sorted by owner name
+    std::map<std::string, OwnerState> owners;
+    std::vector<SlowPhase> slowest;
+    TimingsSummary out;
+    for (auto &shard : ownerShards) {
+      std::lock_guard lock(shard.mutex);
+      owners.merge(shard.owners);
+      shard.owners.clear();
+    }
+    for (auto &shard : phaseShards) {
+      std::lock_guard lock(shard.mutex);
+      // Rust side merges totals of the same phase
+      for (auto &[name, total] : shard.totals) {
+        out.phases.push_back(PhaseTiming{
+            .name = rust::String::lossy(name),
+            .builds = total.builds,
+            .total_ns = total.total,
+            .longest_ns = total.longest,
+        });
+      }
+      for (auto &phase : shard.slowest) {
+        pushSlowest(slowest, std::move(phase));
+      }
+      shard.totals.clear();
+      shard.slowest.clear();
+    }
+    for (auto &[name, owner] : owners) {
+      if (owner.recent.empty()) {
+        continue;
+      }
+      std::vector<const PathStep *> path;
+      for (auto step = owner.recent.back().get(); step;
+           step = step->prev.get()) {
+        path.push_back(step);
+      }
+      rust::Vec<ActivityTiming> steps;
+      for (auto step : std::views::reverse(path)) {
+        steps.push_back(ActivityTiming{
+            .ty = static_cast<uint32_t>(step->type),
+            .subject = rust::String::lossy(step->subject),
+            .host = rust::String::lossy(step->host),
+            .start_ns = step->start,
+            .stop_ns = step->stop,
+        });
+      }
+      out.owners.push_back(OwnerTiming{
+          .owner = rust::String::lossy(name),
+          .start_ns = owner.start,
+          .stop_ns = owner.stop,
+          .critical_path = std::move(steps),
+          .waiting_ns = owner.totals[actBuildWaiting],
+          .build_ns = owner.totals[actBuild],
+          .substitute_ns = owner.totals[actSubstitute],
+          .copy_ns = owner.totals[actCopyPath],
+      });
+    }
+    std::ranges::sort_heap(slowest, std::greater{});
+    for (auto &phase : slowest) {
+      out.slowest_phases.push_back(SlowPhaseTiming{
+          .owners = ownerNames(phase.owners),
+          .subject = rust::String::lossy(phase.subject),
+          .name = rust::String::lossy(phase.name),
+          .took_ns = phase.took,
+      });
+    }
+    return out;
+  }
+
+private:
+  struct Timing {
+    ActivityType type;
+    std::vector<std::string> owners;
+    std::string subject;
+    std::string host;
+    uint64_t start;
+    uint64_t stop = 0;
+    // Name and start time of build phases
+    std::vector<std::pair<std::string, uint64_t>> phases;
+  };
+  // Stopped activity, linked to the previous step of its critical path
+  struct PathStep : Timing {
+    std::shared_ptr<const PathStep> prev;
+  };
+  struct OwnerState {
+    uint64_t start = UINT64_MAX;
+    uint64_t stop = 0;
+    std::unordered_map<ActivityType, uint64_t> totals;
+    // Stopped activities by stop time. Only the ones, which may still precede
+    // a running or a future activity, are kept, along with their paths.
+    std::deque<std::shared_ptr<const PathStep>> recent;
+    std::multiset<uint64_t> runningStarts;
+  };
+  struct PhaseTotal {
+    uint64_t builds = 0;
+    uint64_t total = 0;
+    uint64_t longest = 0;
+  };
+  struct SlowPhase {
+    uint64_t took;
+    std::vector<std::string> owners;
+    std::string subject;
+    std::string name;
+    bool operator>(const SlowPhase &other) const { return took > other.took; }
+  };
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::unordered_map<ActivityId, Timing> running;
+    std::unordered_map<ActivityId, std::vector<std::string>> owners;
+  };
+  struct alignas(64) OwnerShard {
+    std::mutex mutex;
+    std::map<std::string, OwnerState> owners;
+  };
+  struct alignas(64) PhaseShard {
+    std::mutex mutex;
+    std::map<std::string, PhaseTotal> totals;
+    // Min-heap of the slowest phases
+    std::vector<SlowPhase> slowest;
+  };
+
+  static rust::Vec<rust::String>
+  ownerNames(const std::vector<std::string> &owners) {
+    rust::Vec<rust::String> out;
+    for (auto &owner : owners) {
+      out.push_back(rust::String::lossy(owner));
+    }
+    return out;
+  }
+
+  // Activities of several owners are on the critical path of each of them,
+  // but their phases are only counted once. Stop time is taken under the
+  // owner shard lock, so that stop times of an owner are never decreasing.
+  void fold(ActivityId act, Timing timing) {
+    if (!timing.phases.empty()) {
+      auto &shard = phaseShards[act % phaseShards.size()];
+      std::lock_guard lock(shard.mutex);
+      auto stop = now();
+      for (size_t i = 0; i < timing.phases.size(); ++i) {
+        auto &[name, start] = timing.phases[i];
+        auto end = i + 1 < timing.phases.size() ? timing.phases[i + 1].second
+                                                : stop;
+        auto &total = shard.totals[name];
+        ++total.builds;
+        total.total += end - start;
+        total.longest = std::max(total.longest, end - start);
+        if (slowestPhases == 0) {
+          continue;
+        }
+        pushSlowest(shard.slowest, SlowPhase{end - start, timing.owners,
+                                             timing.subject, std::move(name)});
+      }
+      timing.phases.clear();
+    }
+
+    auto names = std::move(timing.owners);
+    for (auto &name : names) {
+      auto &shard = ownerShardOf(name);
+      std::lock_guard lock(shard.mutex);
+      foldOwner(shard.owners[name], timing, now());
+    }
+  }
+
+  // Keeps `slowestPhases` of the slowest phases in the min-heap.
+  void pushSlowest(std::vector<SlowPhase> &slowest, SlowPhase phase) {
+    slowest.push_back(std::move(phase));
+    std::ranges::push_heap(slowest, std::greater{});
+    if (slowest.size() > slowestPhases) {
+      std::ranges::pop_heap(slowest, std::greater{});
+      slowest.pop_back();
+    }
+  }
+
+  void foldOwner(OwnerState &owner, const Timing &timing, uint64_t stop) {
+    if (auto it = owner.runningStarts.find(timing.start);
+        it != owner.runningStarts.end()) {
+      owner.runningStarts.erase(it);
+    }
+    owner.start = std::min(owner.start, timing.start);
+    owner.stop = std::max(owner.stop, stop);
+    owner.totals[timing.type] += stop - timing.start;
+
+    // Previous step is the latest activity, which stopped before this one
+    // started
+    auto &recent = owner.recent;
+    auto before = std::ranges::partition_point(
+        recent, [&](auto &step) { return step->stop <= timing.start; });
+    auto step = std::make_shared<PathStep>();
+    static_cast<Timing &>(*step) = timing;
+    step->stop = stop;
+    if (before != recent.begin()) {
+      step->prev = *std::prev(before);
+    }
+    recent.push_back(std::move(step));
+
+    // Steps before the latest one, that stopped before every running activity
+    // started, will never be picked again
+    auto oldest = owner.runningStarts.empty() ? UINT64_MAX
+                                              : *owner.runningStarts.begin();
+    auto keep = std::ranges::partition_point(
+        recent, [&](auto &step) { return step->stop <= oldest; });
+    if (keep != recent.begin()) {
+      recent.erase(recent.begin(), std::prev(keep));
+    }
+  }
+
+  uint64_t now() const {
+    // Zero is reserved for activities, which were not stopped
+    return std::max<uint64_t>(
+        1, std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - started)
+               .count());
+  }
+  Shard &shardOf(ActivityId act) { return shards[act % shards.size()]; }
+  OwnerShard &ownerShardOf(const std::string &name) {
+    return ownerShards[std::hash<std::string>{}(name) % ownerShards.size()];
+  }
+
+  const std::chrono::steady_clock::time_point started;
+  const size_t slowestPhases;
+  std::array<Shard, 16> shards;
+  std::array<OwnerShard, 16> ownerShards;
+  std::array<PhaseShard, 16> phaseShards;
+};
+Installed<ActivityTimings> activityTimings;
+} // namespace
+
+namespace fleet_logging {
+bool activitiesTimed() { return activityTimings.get(); }
+void timeStart(ActivityId act, ActivityType type, std::string_view s,
+               const Logger::Fields &fields, ActivityId parent,
+               std::vector<std::string> owners) {
+  if (auto timings = activityTimings.get()) {
+    timings->start(act, type, s, fields, parent, std::move(owners));
+  }
+}
+void timePhase(ActivityId act, std::string_view name) {
+  if (auto timings = activityTimings.get()) {
+    timings->phase(act, name);
+  }
+}
+void timeStop(ActivityId act) {
+  if (auto timings = activityTimings.get()) {
+    timings->stop(act);
+  }
+}
+} // namespace fleet_logging
+
+extern "C" {
+void start_activity_timings(size_t slowest_phases) {
+  activityTimings.install(std::make_unique<ActivityTimings>(slowest_phases),
+                          "activity timings are already collected");
+}
+TimingsSummary take_activity_timings() {
+  auto timings = activityTimings.take();
+  return timings ? timings->take() : TimingsSummary{};
+}
+}
@@ -0,0 +1,245 @@
+#include "logging_internal.hh"
+
+#include <algorithm>
+
+using namespace nix;
+using namespace fleet_logging;
+
+namespace {
+// Number of buckets in request latency histograms, bucket 0 counts requests
+// under 1ms, bucket i ones under 2^i ms, the last one counts the rest.
+constexpr size_t latencyBuckets = 16;
+
+// Per-host counters of substituter queries, downloads and copies, regardless
+// of the log filter. Downloads are attributed to the origin of their url, so
+// they are counted together with queries of the same substituter. Counters
+// are sharded by host, as transfers to different hosts run concurrently.
+class TransferMetrics {
+public:
+  TransferMetrics() : started(std::chrono::steady_clock::now()) {}
+
+  static bool measured(ActivityType type) {
+    return type == actQueryPathInfo || type == actSubstitute ||
+           type == actFileTransfer || type == actCopyPath;
+  }
+
+  void start(ActivityId act, ActivityType type, const Logger::Fields &fields) {
+    auto field = [&](size_t i) -> std::string_view {
+      if (i >= fields.size() || fields[i].type != Logger::Field::tString) {
+        return {};
+      }
+      return fields[i].s;
+    };
+    std::string_view host;
+    if (type == actFileTransfer) {
+      host = urlOrigin(field(0));
+    } else if (type == actCopyPath) {
+      // Copies into the local store are attributed to their source
+      host = isLocal(field(2)) ? field(1) : field(2);
+    } else {
+      host = field(1);
+    }
+    Running running{.type = type, .host = std::string(host), .start = now()};
+    {
+      auto &hosts = hostShardOf(running.host);
+      std::lock_guard lock(hosts.mutex);
+      auto &stats = hosts.stats[running.host];
+      if (type == actFileTransfer) {
+        stats.downloads.start(running.start);
+      } else if (type == actCopyPath) {
+        stats.copies.start(running.start);
+      }
+    }
+    auto &shard = shardOf(act);
+    std::lock_guard lock(shard.mutex);
+    shard.running.insert_or_assign(act, std::move(running));
+  }
+
+  void progress(ActivityId act, const Logger::Fields &fields) {
+    if (fields.empty() || fields[0].type != Logger::Field::tInt) {
+      return;
+    }
+    auto &shard = shardOf(act);
+    std::lock_guard lock(shard.mutex);
+    if (auto it = shard.running.find(act); it != shard.running.end()) {
+      it->second.bytes = fields[0].i;
+    }
+  }
+
+  void stop(ActivityId act) {
+    Running running;
+    {
+      auto &shard = shardOf(act);
+      std::lock_guard lock(shard.mutex);
+      auto it = shard.running.find(act);
+      if (it == shard.running.end()) {
+        return;
+      }
+      running = std::move(it->second);
+      shard.running.erase(it);
+    }
+    auto &hosts = hostShardOf(running.host);
+    std::lock_guard lock(hosts.mutex);
+    auto stopped = now();
+    auto &stats = hosts.stats[running.host];
+    switch (running.type) {
+    case actQueryPathInfo: {
+      stats.queries++;
+      auto ms = (stopped - running.start) / 1000000;
+      stats.latency[std::min<size_t>(std::bit_width(ms),
+                                     latencyBuckets - 1)]++;
+      break;
+    }
+    case actSubstitute:
+      stats.substitutes++;
+      break;
+    case actFileTransfer:
+      stats.downloads.stop(stopped, running.bytes);
+      break;
+    case actCopyPath:
+      stats.copies.stop(stopped, running.bytes);
+      break;
+    default:
+      break;
+    }
+  }
+
+  rust::Vec<HostTransfers> take() {
+    std::unordered_map<std::string, HostStats> hosts;
+    for (auto &shard : hostShards) {
+      std::lock_guard lock(shard.mutex);
+      hosts.merge(shard.stats);
+      shard.stats.clear();
+    }
+    auto stopped = now();
+    rust::Vec<HostTransfers> out;
+    for (auto &[host, stats] : hosts) {
+      rust::Vec<uint64_t> latency;
+      for (auto count : stats.latency) {
+        latency.push_back(count);
+      }
+      out.push_back(HostTransfers{
+          .host = rust::String::lossy(host),
+          .queries = stats.queries,
+          .substitutes = stats.substitutes,
+          .downloads = stats.downloads.count,
+          .download_bytes = stats.downloads.bytes,
+          .download_ns = stats.downloads.busyUntil(stopped),
+          .copies = stats.copies.count,
+          .copy_bytes = stats.copies.bytes,
+          .copy_ns = stats.copies.busyUntil(stopped),
+          .latency = std::move(latency),
+      });
+    }
+    return out;
+  }
+
+private:
+  struct Running {
+    ActivityType type;
+    std::string host;
+    uint64_t start;
+    // Last reported progress
+    uint64_t bytes = 0;
+  };
+  // Transfers of one kind to/from a host, busy time is the time when at least
+  // one of them was running, so concurrent transfers are not counted twice.
+  struct Transfers {
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    uint64_t busyNs = 0;
+    uint32_t active = 0;
+    uint64_t since = 0;
+
+    void start(uint64_t time) {
+      if (active++ == 0) {
+        since = time;
+      }
+    }
+    void stop(uint64_t time, uint64_t transferred) {
+      count++;
+      bytes += transferred;
+      if (active != 0 && --active == 0) {
+        busyNs += time - since;
+      }
+    }
+    uint64_t busyUntil(uint64_t time) const {
+      return active != 0 ? busyNs + (time - since) : busyNs;
+    }
+  };
+  struct HostStats {
+    uint64_t queries = 0;
+    uint64_t substitutes = 0;
+    Transfers downloads;
+    Transfers copies;
+    std::array<uint64_t, latencyBuckets> latency{};
+  };
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::unordered_map<ActivityId, Running> running;
+  };
+  struct alignas(64) HostShard {
+    std::mutex mutex;
+    std::unordered_map<std::string, HostStats> stats;
+  };
+
+  static bool isLocal(std::string_view uri) {
+    return uri.empty() || uri == "local" || uri == "auto" ||
+           uri.starts_with("daemon") || uri.starts_with("/");
+  }
+  // scheme://authority part of the url
+  static std::string_view urlOrigin(std::string_view url) {
+    auto scheme = url.find("://");
+    if (scheme == std::string_view::npos) {
+      return url;
+    }
+    return url.substr(0, url.find('/', scheme + 3));
+  }
+
+  uint64_t now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - started)
+        .count();
+  }
+  Shard &shardOf(ActivityId act) { return shards[act % shards.size()]; }
+  HostShard &hostShardOf(const std::string &host) {
+    return hostShards[std::hash<std::string>{}(host) % hostShards.size()];
+  }
+
+  const std::chrono::steady_clock::time_point started;
+  std::array<Shard, 16> shards;
+  std::array<HostShard, 16> hostShards;
+};
+Installed<TransferMetrics> transferMetrics;
+} // namespace
+
+namespace fleet_logging {
+void measureStart(ActivityId act, ActivityType type,
+                  const Logger::Fields &fields) {
+  if (auto metrics = transferMetrics.get();
+      metrics && TransferMetrics::measured(type)) {
+    metrics->start(act, type, fields);
+  }
+}
+void measureProgress(ActivityId act, const Logger::Fields &fields) {
+  if (auto metrics = transferMetrics.get()) {
+    metrics->progress(act, fields);
+  }
+}
+void measureStop(ActivityId act) {
+  if (auto metrics = transferMetrics.get()) {
+    metrics->stop(act);
+  }
+}
+} // namespace fleet_logging
+
+extern "C" {
+void start_transfer_metrics() {
+  transferMetrics.install(std::make_unique<TransferMetrics>(),
+                          "transfer metrics are already collected");
+}
+rust::Vec<HostTransfers> take_transfer_metrics() {
+  auto metrics = transferMetrics.take();
+  return metrics ? metrics->take() : rust::Vec<HostTransfers>{};
+}
+}
@@ -90,3 +90,9 @@ macro_rules! nix_go_json {
 		$crate::__macro_support::block_in_place(|| $crate::nix_go!($($tt)*).as_json())?
 	}};
 }
+#[macro_export]
+macro_rules! nix_go_lazy {
+	($($tt:tt)*) => {{
+		$crate::__macro_support::block_in_place(|| $crate::nix_go!($($tt)*).as_lazy())?
+	}};
+}
@@ -0,0 +1,336 @@
+//! Reader for nix activity recordings, written with [`crate::logging::start_activity_recording`].
+//!
+//! File format is described next to `ActivityRecorder` in logging_recorder.cc.
+use std::collections::HashMap;
+use std::ops::Range;
+use std::path::Path;
+use std::time::{Duration, SystemTime};
+
+use anyhow::{Context, Result, bail, ensure};
+
+use crate::logging::{ActivityType, parse_build_waiting, parse_drv, parse_host};
+
+const MAGIC: &[u8; 8] = b"FLEETACT";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 32;
+const RECORD_HEADER_SIZE: usize = 32;
+
+const RECORD_STRING: u8 = 1;
+const RECORD_START: u8 = 2;
+const RECORD_STOP: u8 = 3;
+const RECORD_RESULT: u8 = 4;
+
+#[derive(Debug, Clone, Copy)]
+pub enum Field {
+	Int(u64),
+	/// Interned string id, strings of log lines are not recorded and have id 0.
+	Str(u32),
+}
+
+#[derive(Debug)]
+pub enum EventKind {
+	Start {
+		ty: ActivityType,
+		parent: u64,
+		text: u32,
+		fields: Vec<Field>,
+	},
+	Stop,
+	Result {
+		/// Nix `ResultType`
+		ty: u32,
+		fields: Vec<Field>,
+	},
+}
+
+#[derive(Debug)]
+pub struct Event {
+	/// Time since the recording start
+	pub time: Duration,
+	/// Sequential id of the thread, that produced the event
+	pub thread: u32,
+	pub activity: u64,
+	pub kind: EventKind,
+}
+
+pub struct Recording {
+	pub started_at: SystemTime,
+	/// Number of events, which didn't fit into the file.
+	pub dropped: u64,
+	strings: HashMap<u32, String>,
+	pub events: Vec<Event>,
+}
+
+/// Nix activity, reconstructed from its start and stop events.
+#[derive(Debug)]
+pub struct Activity {
+	pub id: u64,
+	pub parent: u64,
+	pub ty: ActivityType,
+	pub text: u32,
+	pub fields: Vec<Field>,
+	pub thread: u32,
+	pub start: Duration,
+	/// None if the activity wasn't stopped before the recording ended.
+	pub stop: Option<Duration>,
+}
+
+struct Reader<'d> {
+	data: &'d [u8],
+}
+impl<'d> Reader<'d> {
+	fn take(&mut self, len: usize) -> Result<&'d [u8]> {
+		ensure!(self.data.len() >= len, "truncated record");
+		let (out, rest) = self.data.split_at(len);
+		self.data = rest;
+		Ok(out)
+	}
+	fn u8(&mut self) -> Result<u8> {
+		Ok(self.take(1)?[0])
+	}
+	fn u16(&mut self) -> Result<u16> {
+		Ok(u16::from_le_bytes(
+			self.take(2)?.try_into().expect("2 bytes"),
+		))
+	}
+	fn u32(&mut self) -> Result<u32> {
+		Ok(u32::from_le_bytes(
+			self.take(4)?.try_into().expect("4 bytes"),
+		))
+	}
+	fn u64(&mut self) -> Result<u64> {
+		Ok(u64::from_le_bytes(
+			self.take(8)?.try_into().expect("8 bytes"),
+		))
+	}
+	fn fields(&mut self, count: u16, string_mask: u32) -> Result<Vec<Field>> {
+		(0..count)
+			.map(|i| {
+				let v = self.u64()?;
+				Ok(if string_mask & (1 << i) != 0 {
+					Field::Str(v as u32)
+				} else {
+					Field::Int(v)
+				})
+			})
+			.collect()
+	}
+}
+
+impl Recording {
+	pub fn read(path: &Path) -> Result<Self> {
+		let data = std::fs::read(path).with_context(|| format!("reading {}", path.display()))?;
+		Self::parse(&data).with_context(|| format!("parsing {}", path.display()))
+	}
+
+	fn parse(data: &[u8]) -> Result<Self> {
+		let mut header = Reader { data };
+		ensure!(
+			header.take(MAGIC.len()).ok() == Some(MAGIC),
+			"not a nix activity recording"
+		);
+		let version = header.u32()?;
+		ensure!(
+			version == VERSION,
+			"unsupported recording version {version}"
+		);
+		let header_size = header.u32()? as usize;
+		let started_at = SystemTime::UNIX_EPOCH + Duration::from_nanos(header.u64()?);
+		let dropped = header.u64()?;
+		ensure!(
+			header_size >= HEADER_SIZE && header_size <= data.len(),
+			"invalid header size"
+		);
+
+		let mut strings = HashMap::new();
+		let mut events = Vec::new();
+		let mut offset = header_size;
+		while data.len() - offset >= RECORD_HEADER_SIZE {
+			let mut r = Reader {
+				data: &data[offset..],
+			};
+			let size = r.u32()? as usize;
+			if size == 0 {
+				// Record was not finished when the process exited
+				break;
+			}
+			ensure!(
+				size >= RECORD_HEADER_SIZE && size <= data.len() - offset,
+				"invalid record size at {offset}"
+			);
+			r.data = &data[offset + 4..offset + size];
+			offset += size;
+
+			let kind = r.u8()?;
+			let _lvl = r.u8()?;
+			let field_count = r.u16()?;
+			let ty = r.u32()?;
+			let thread = r.u32()?;
+			let time = Duration::from_nanos(r.u64()?);
+			let activity = r.u64()?;
+			let kind = match kind {
+				RECORD_STRING => {
+					let s = r.take(ty as usize)?;
+					strings.insert(activity as u32, String::from_utf8_lossy(s).into_owned());
+					continue;
+				}
+				RECORD_START => {
+					let parent = r.u64()?;
+					let text = r.u32()?;
+					let string_mask = r.u32()?;
+					EventKind::Start {
+						ty: ActivityType::from_int(ty),
+						parent,
+						text,
+						fields: r.fields(field_count, string_mask)?,
+					}
+				}
+				RECORD_STOP => EventKind::Stop,
+				RECORD_RESULT => {
+					let string_mask = r.u64()? as u32;
+					EventKind::Result {
+						ty,
+						fields: r.fields(field_count, string_mask)?,
+					}
+				}
+				kind => bail!("unknown record kind {kind} at {offset}"),
+			};
+			events.push(Event {
+				time,
+				thread,
+				activity,
+				kind,
+			});
+		}
+		// Records are written concurrently, and may be slightly out of order
+		events.sort_by_key(|e| e.time);
+
+		Ok(Self {
+			started_at,
+			dropped,
+			strings,
+			events,
+		})
+	}
+
+	pub fn string(&self, id: u32) -> Option<&str> {
+		self.strings.get(&id).map(String::as_str)
+	}
+	pub fn field_str(&self, field: Field) -> Option<&str> {
+		match field {
+			Field::Str(id) => self.string(id),
+			Field::Int(_) => None,
+		}
+	}
+
+	/// Time of the last recorded event.
+	pub fn end(&self) -> Duration {
+		self.events.last().map(|e| e.time).unwrap_or_default()
+	}
+
+	/// Activities in the order they were started.
+	pub fn activities(&self) -> Vec<Activity> {
+		let mut out = Vec::new();
+		let mut running = HashMap::new();
+		for event in &self.events {
+			match &event.kind {
+				EventKind::Start {
+					ty,
+					parent,
+					text,
+					fields,
+				} => {
+					running.insert(event.activity, out.len());
+					out.push(Activity {
+						id: event.activity,
+						parent: *parent,
+						ty: *ty,
+						text: *text,
+						fields: fields.clone(),
+						thread: event.thread,
+						start: event.time,
+						stop: None,
+					});
+				}
+				EventKind::Stop => {
+					if let Some(idx) = running.remove(&event.activity) {
+						out[idx].stop = Some(event.time);
+					}
+				}
+				EventKind::Result { .. } => {}
+			}
+		}
+		out
+	}
+
+	/// Store path (derivation for builds) and host, which the activity works with.
+	pub fn subject<'s>(&'s self, activity: &Activity) -> Option<(&'s str, Option<&'s str>)> {
+		let field = |i: usize| {
+			activity
+				.fields
+				.get(i)
+				.and_then(|f| self.field_str(*f))
+				.filter(|s| !s.is_empty())
+		};
+		let host = |i: usize| field(i).map(parse_host);
+		match activity.ty {
+			ActivityType::Build | ActivityType::Substitute | ActivityType::QueryPathInfo => {
+				Some((parse_drv(field(0)?), host(1)))
+			}
+			ActivityType::CopyPath => Some((parse_drv(field(0)?), host(2))),
+			ActivityType::FileTransfer => Some((field(0)?, None)),
+			ActivityType::BuildWaiting => {
+				let drv = parse_build_waiting(self.string(activity.text)?)?;
+				Some((parse_drv(drv), None))
+			}
+			_ => None,
+		}
+	}
+}
+
+/// Chain of intervals, which determined when the last of them ended.
+///
+/// Starting from the interval that ended last, each step goes to the interval which ended last
+/// before the current one started. Dependencies are not known, so an interval is assumed to be
+/// waiting for whatever finished right before it.
+///
+/// Returns indices of the chain intervals, in chronological order.
+pub fn critical_path(intervals: &[Range<Duration>]) -> Vec<usize> {
+	let mut by_end = (0..intervals.len()).collect::<Vec<_>>();
+	by_end.sort_by_key(|i| intervals[*i].end);
+
+	let mut out = Vec::new();
+	let Some(mut current) = by_end.last().copied() else {
+		return out;
+	};
+	loop {
+		out.push(current);
+		let start = intervals[current].start;
+		let before = by_end.partition_point(|i| intervals[*i].end <= start);
+		// Zero-length intervals may end exactly at their own start
+		match by_end[..before].iter().rev().find(|i| **i != current) {
+			Some(prev) => current = *prev,
+			None => break,
+		}
+	}
+	out.reverse();
+	out
+}
+
+#[cfg(test)]
+mod tests {
+	use super::*;
+
+	#[test]
+	fn critical_path_follows_latest_predecessor() {
+		let s = Duration::from_secs;
+		let path = critical_path(&[
+			s(0)..s(10),
+			s(0)..s(4),
+			s(4)..s(6),
+			s(11)..s(20),
+			s(5)..s(19),
+		]);
+		assert_eq!(path, [0, 3]);
+	}
+}
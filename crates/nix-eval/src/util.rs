@@ -10,6 +10,21 @@ pub fn assert_warn(action: &str, val: &Value) -> anyhow::Result<()> {
 	let before_errors = Instant::now();
 	let errors: Vec<String> = nix_go_json!(val.errors);
 	debug!("errors evaluation took {:?}", before_errors.elapsed());
+
+	check_assertions(errors, || {
+		let before_errors = Instant::now();
+		let warnings: Vec<String> = nix_go_json!(val.warnings);
+		debug!("warnings evaluation took {:?}", before_errors.elapsed());
+		Ok(warnings)
+	})
+}
+
+/// Same as [`assert_warn`], for `errors` and `warnings` obtained elsewhere, warnings are only
+/// requested if there are no errors.
+pub fn check_assertions(
+	errors: Vec<String>,
+	warnings: impl FnOnce() -> anyhow::Result<Vec<String>>,
+) -> anyhow::Result<()> {
 	if !errors.is_empty() {
 		bail!(
 			"failed with error{}{}",
@@ -18,9 +33,7 @@ pub fn assert_warn(action: &str, val: &Value) -> anyhow::Result<()> {
 		);
 	}
 
-	let before_errors = Instant::now();
-	let warnings: Vec<String> = nix_go_json!(val.warnings);
-	debug!("warnings evaluation took {:?}", before_errors.elapsed());
+	let warnings = warnings()?;
 	if !warnings.is_empty() {
 		warn!(
 			"completed with warning{}{}",
@@ -187,6 +187,7 @@
 
                 pkg-config
                 openssl
+                zstd
                 rustPlatform.bindgenHook
                 inputs'.nix.packages.nix-expr-c
                 inputs'.nix.packages.nix-flake-c
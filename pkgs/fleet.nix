@@ -5,6 +5,7 @@
   inputs',
   pkg-config,
   rustPlatform,
+  zstd,
 }:
 craneLib.buildPackage rec {
   pname = "fleet";
@@ -24,6 +25,7 @@ craneLib.buildPackage rec {
     inputs'.nix.packages.nix-expr-c
     inputs'.nix.packages.nix-flake-c
     inputs'.nix.packages.nix-fetchers-c
+    zstd
   ];
   nativeBuildInputs = [
     installShellFiles